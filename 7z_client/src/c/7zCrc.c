@@ -0,0 +1,63 @@
+/* 7zCrc.c -- CRC32 calculation (slicing-by-4)
+The implementation of this client for the functions declared in 7zCrc.h.
+It's not the upstream 7-Zip code (7zCrc.c / 7zCrcOpt.c). */
+
+#include "Precomp.h"
+
+#include "7zCrc.h"
+
+#define kCrcPoly 0xEDB88320
+
+#define CRC_NUM_TABLES 4
+
+/* g_CrcTable[k * 256 + b] is CRC of byte (b) followed by (k) zero bytes.
+   So we can process 4 bytes per iteration (slicing-by-4).
+   The bytes are loaded one by one, so the code doesn't depend on endianness. */
+static UInt32 g_CrcTable[256 * CRC_NUM_TABLES];
+
+#define CRC_UPDATE_BYTE(crc, b) (g_CrcTable[((crc) ^ (b)) & 0xFF] ^ ((crc) >> 8))
+
+void Z7_FASTCALL CrcGenerateTable(void)
+{
+  UInt32 i;
+  for (i = 0; i < 256; i++)
+  {
+    UInt32 r = i;
+    unsigned j;
+    for (j = 0; j < 8; j++)
+      r = (r >> 1) ^ (kCrcPoly & ((UInt32)0 - (r & 1)));
+    g_CrcTable[i] = r;
+  }
+  for (i = 256; i < 256 * CRC_NUM_TABLES; i++)
+  {
+    const UInt32 r = g_CrcTable[(size_t)i - 256];
+    g_CrcTable[i] = g_CrcTable[r & 0xFF] ^ (r >> 8);
+  }
+}
+
+UInt32 Z7_FASTCALL CrcUpdate(UInt32 crc, const void *data, size_t size)
+{
+  const Byte *p = (const Byte *)data;
+  for (; size != 0 && ((size_t)p & 3) != 0; size--, p++)
+    crc = CRC_UPDATE_BYTE(crc, *p);
+  for (; size >= 4; size -= 4, p += 4)
+  {
+    crc ^= (UInt32)p[0]
+        | ((UInt32)p[1] << 8)
+        | ((UInt32)p[2] << 16)
+        | ((UInt32)p[3] << 24);
+    crc =
+        g_CrcTable[0x300 + ((crc      ) & 0xFF)]
+      ^ g_CrcTable[0x200 + ((crc >>  8) & 0xFF)]
+      ^ g_CrcTable[0x100 + ((crc >> 16) & 0xFF)]
+      ^ g_CrcTable[0x000 + ((crc >> 24))];
+  }
+  for (; size != 0; size--, p++)
+    crc = CRC_UPDATE_BYTE(crc, *p);
+  return crc;
+}
+
+UInt32 Z7_FASTCALL CrcCalc(const void *data, size_t size)
+{
+  return CRC_GET_DIGEST(CrcUpdate(CRC_INIT_VAL, data, size));
+}
@@ -0,0 +1,24 @@
+/* 7zCrc.h -- CRC32 calculation
+This client has its own small slicing-by-4 implementation (7zCrc.c).
+It's not the upstream 7-Zip code: only the function names follow upstream 7zCrc.h,
+so the code that uses them doesn't depend on the implementation. */
+
+#ifndef ZIP7_INC_7Z_CRC_H
+#define ZIP7_INC_7Z_CRC_H
+
+#include "7zTypes.h"
+
+EXTERN_C_BEGIN
+
+/* Call CrcGenerateTable one time before other CRC functions */
+void Z7_FASTCALL CrcGenerateTable(void);
+
+#define CRC_INIT_VAL 0xFFFFFFFF
+#define CRC_GET_DIGEST(crc) ((crc) ^ CRC_INIT_VAL)
+
+UInt32 Z7_FASTCALL CrcUpdate(UInt32 crc, const void *data, size_t size);
+UInt32 Z7_FASTCALL CrcCalc(const void *data, size_t size);
+
+EXTERN_C_END
+
+#endif
@@ -0,0 +1,316 @@
+// ArcDetector.cpp
+
+#include "StdAfx.h"
+
+#include <string.h>
+
+#include <mutex>
+
+#include "../../Common/MyBuffer.h"
+
+#include "../../Windows/FileFind.h"
+
+#include "ArcDetector.h"
+#include "StreamUtils.h"
+
+using namespace NWindows;
+using namespace NFile;
+
+// the formats that are tried, if no signature was matched
+static const char * const k_DefaultPriority[] =
+{
+    "7z"
+  , "zip"
+  , "Rar5"
+  , "Rar"
+  , "xz"
+  , "gzip"
+  , "bzip2"
+  , "tar"
+  , "Chm"
+};
+
+struct CArcDetectCacheItem
+{
+  FString Path;
+  const CArcLibrary *Library;
+  UInt64 Size;
+  CFiTime MTime;
+  unsigned FormatIndex;
+  UInt64 ScanSize;
+  UInt64 LastUse; // for eviction of least recently used item
+};
+
+static int ComparePaths(const FChar *s1, const FChar *s2)
+{
+  for (;;)
+  {
+    const FChar c1 = *s1++;
+    const FChar c2 = *s2++;
+    if (c1 != c2)
+      return c1 < c2 ? -1 : 1;
+    if (c1 == 0)
+      return 0;
+  }
+}
+
+/* the items are sorted by (Path, Library) for binary search.
+   The number of items is limited: the least recently used item is evicted,
+   when new item is added to full cache. */
+struct CArcDetectCache
+{
+  std::mutex Mutex;
+  CObjectVector<CArcDetectCacheItem> Items;
+  UInt64 UseCounter;
+
+  static const unsigned kMaxItems = 1 << 10;
+
+  CArcDetectCache(): UseCounter(0) {}
+
+  // it returns the index of item or the position for insertion
+  bool Find(const FString &path, const CArcLibrary *library, unsigned &index) const
+  {
+    unsigned left = 0, right = Items.Size();
+    while (left != right)
+    {
+      const unsigned mid = (left + right) / 2;
+      const CArcDetectCacheItem &item = Items[mid];
+      int cmp = ComparePaths(path, item.Path);
+      if (cmp == 0)
+        cmp = MyCompare((size_t)library, (size_t)item.Library);
+      if (cmp == 0)
+      {
+        index = mid;
+        return true;
+      }
+      if (cmp < 0)
+        right = mid;
+      else
+        left = mid + 1;
+    }
+    index = left;
+    return false;
+  }
+
+  CArcDetectCacheItem &Add(const FString &path, const CArcLibrary *library)
+  {
+    unsigned index;
+    if (!Find(path, library, index))
+    {
+      if (Items.Size() >= kMaxItems)
+      {
+        unsigned oldest = 0;
+        FOR_VECTOR (i, Items)
+          if (Items[i].LastUse < Items[oldest].LastUse)
+            oldest = i;
+        Items.Delete(oldest);
+        if (index > oldest)
+          index--;
+      }
+      Items.Insert(index, CArcDetectCacheItem());
+      CArcDetectCacheItem &item = Items[index];
+      item.Path = path;
+      item.Library = library;
+    }
+    CArcDetectCacheItem &item = Items[index];
+    item.LastUse = ++UseCounter;
+    return item;
+  }
+};
+
+static CArcDetectCache &GetCache()
+{
+  static CArcDetectCache *cache = new CArcDetectCache;
+  return *cache;
+}
+
+static bool AreFileTimesEqual(const CFiTime &t1, const CFiTime &t2)
+{
+ #ifdef _WIN32
+  return t1.dwLowDateTime == t2.dwLowDateTime && t1.dwHighDateTime == t2.dwHighDateTime;
+ #else
+  return t1.tv_sec == t2.tv_sec && t1.tv_nsec == t2.tv_nsec;
+ #endif
+}
+
+static bool IsExtensionOfFormat(const UString &extensions, const UString &ext)
+{
+  // (extensions) is the list separated by spaces : "7z" or "tar ova"
+  UStringVector exts;
+  SplitString(extensions, exts);
+  FOR_VECTOR (i, exts)
+    if (exts[i].IsEqualTo_NoCase(ext))
+      return true;
+  return false;
+}
+
+static int CompareUInt64(const UInt64 *p1, const UInt64 *p2, void * /* param */)
+{
+  return MyCompare(*p1, *p2);
+}
+
+HRESULT CArcDetector::GetCandidates(IInStream *stream, const FString &path,
+    CRecordVector<CCandidate> &candidates) const
+{
+  candidates.Clear();
+  const CObjectVector<CArcFormatInfo> &formats = Library->Formats;
+  CRecordVector<unsigned> used;
+  CRecordVector<CCandidate> preArcCandidates;
+
+  // signatures. One read for all formats
+  {
+    CByteBuffer header(HeaderSize);
+    size_t size = HeaderSize;
+    RINOK(InStream_SeekToBegin(stream))
+    RINOK(ReadStream(stream, header, &size))
+
+    // the longer signature is more specific, so it's tried first
+    CRecordVector<UInt64> matched; // (sigSize << 32) | formatIndex
+    FOR_VECTOR (i, formats)
+    {
+      const CArcFormatInfo &f = formats[i];
+      size_t maxSigSize = 0;
+      FOR_VECTOR (k, f.Signatures)
+      {
+        const CByteBuffer &sig = f.Signatures[k];
+        if ((UInt64)f.SignatureOffset + sig.Size() <= size
+            && memcmp(header + f.SignatureOffset, sig, sig.Size()) == 0
+            && maxSigSize < sig.Size())
+          maxSigSize = sig.Size();
+      }
+      if (maxSigSize != 0)
+        matched.Add(((UInt64)(0xFFFF - maxSigSize) << 32) | i);
+    }
+    matched.Sort(CompareUInt64, NULL);
+    FOR_VECTOR (i, matched)
+    {
+      CCandidate c;
+      c.FormatIndex = (unsigned)(UInt32)matched[i];
+      c.ScanSize = 0;
+      // the formats of stubs (PE, ELF) are tried after all other candidates
+      if (formats[c.FormatIndex].Flags & NArcInfoFlags::kPreArc)
+        preArcCandidates.Add(c);
+      else
+        candidates.Add(c);
+      used.AddToUniqueSorted(c.FormatIndex);
+    }
+  }
+
+  // extension
+  {
+    const int dotPos = path.ReverseFind_Dot();
+    const int slashPos = path.ReverseFind_PathSepar();
+    if (dotPos > slashPos)
+    {
+      const UString ext = fs2us(path.Ptr((unsigned)(dotPos + 1)));
+      FOR_VECTOR (i, formats)
+        if (used.FindInSorted(i) < 0 && IsExtensionOfFormat(formats[i].Extensions, ext))
+        {
+          CCandidate c;
+          c.FormatIndex = i;
+          c.ScanSize = MaxScanSize;
+          candidates.Add(c);
+          used.AddToUniqueSorted(i);
+        }
+    }
+  }
+
+  // priority list
+  for (unsigned i = 0; i < Z7_ARRAY_SIZE(k_DefaultPriority); i++)
+  {
+    const int index = Library->FindFormat(UString(k_DefaultPriority[i]));
+    if (index < 0 || used.FindInSorted((unsigned)index) >= 0)
+      continue;
+    CCandidate c;
+    c.FormatIndex = (unsigned)index;
+    c.ScanSize = MaxScanSize;
+    candidates.Add(c);
+    used.AddToUniqueSorted((unsigned)index);
+  }
+
+  // the file is opened as stub, only if no archive was found after the stub
+  candidates += preArcCandidates;
+  return S_OK;
+}
+
+static HRESULT TryOpen(const CArcLibrary &library, unsigned formatIndex, UInt64 scanSize,
+    IInStream *stream, IArchiveOpenCallback *openCallback, CMyComPtr<IInArchive> &archive)
+{
+  archive.Release();
+  CMyComPtr<IInArchive> arc;
+  if (library.CreateObject(library.Formats[formatIndex].ClassID, IID_IInArchive, (void **)&arc) != S_OK || !arc)
+    return S_FALSE;
+  RINOK(InStream_SeekToBegin(stream))
+  const HRESULT res = arc->Open(stream, &scanSize, openCallback);
+  if (res == E_ABORT || res == E_OUTOFMEMORY)
+    return res;
+  if (res != S_OK)
+  {
+    arc->Close();
+    return S_FALSE;
+  }
+  archive = arc;
+  return S_OK;
+}
+
+HRESULT CArcDetector::Open(IInStream *stream, const FString &path, IArchiveOpenCallback *openCallback,
+    CMyComPtr<IInArchive> &archive, int &formatIndex) const
+{
+  archive.Release();
+  formatIndex = -1;
+  if (!Library)
+    return E_FAIL;
+
+  NFind::CFileInfo fi;
+  const bool fiIsDefined = fi.Find(path);
+  CArcDetectCache &cache = GetCache();
+
+  if (fiIsDefined)
+  {
+    CArcDetectCacheItem item;
+    bool found = false;
+    {
+      std::lock_guard<std::mutex> lock(cache.Mutex);
+      unsigned index;
+      if (cache.Find(path, Library, index))
+      {
+        CArcDetectCacheItem &cached = cache.Items[index];
+        cached.LastUse = ++cache.UseCounter;
+        item = cached;
+        found = (item.Size == fi.Size && AreFileTimesEqual(item.MTime, fi.MTime));
+      }
+    }
+    if (found)
+    {
+      const HRESULT res = TryOpen(*Library, item.FormatIndex, item.ScanSize, stream, openCallback, archive);
+      if (res == S_OK)
+        formatIndex = (int)item.FormatIndex;
+      if (res != S_FALSE)
+        return res;
+    }
+  }
+
+  CRecordVector<CCandidate> candidates;
+  RINOK(GetCandidates(stream, path, candidates))
+  FOR_VECTOR (i, candidates)
+  {
+    const CCandidate &c = candidates[i];
+    const HRESULT res = TryOpen(*Library, c.FormatIndex, c.ScanSize, stream, openCallback, archive);
+    if (res == S_FALSE)
+      continue;
+    if (res != S_OK)
+      return res;
+    formatIndex = (int)c.FormatIndex;
+    if (fiIsDefined)
+    {
+      std::lock_guard<std::mutex> lock(cache.Mutex);
+      CArcDetectCacheItem &item = cache.Add(path, Library);
+      item.Size = fi.Size;
+      item.MTime = fi.MTime;
+      item.FormatIndex = c.FormatIndex;
+      item.ScanSize = c.ScanSize;
+    }
+    return S_OK;
+  }
+  return S_FALSE;
+}
@@ -0,0 +1,54 @@
+// ArcDetector.h
+
+#ifndef ZIP7_INC_ARC_DETECTOR_H
+#define ZIP7_INC_ARC_DETECTOR_H
+
+#include "../../Common/MyCom.h"
+#include "../../Common/MyString.h"
+#include "../../Common/MyVector.h"
+
+#include "../Archive/IArchive.h"
+
+#include "ArcLibrary.h"
+
+/*
+CArcDetector selects the handler for archive file:
+  1) it reads first (HeaderSize) bytes of file with one Read() call
+     and compares them with the signatures of all formats of library.
+     The handlers with matched signature are tried first, and
+     they are opened with (maxCheckStartPosition = 0).
+     The formats of stubs (NArcInfoFlags::kPreArc : PE, ELF, ...) are not tried here.
+  2) if no handler with matched signature can open the file, it tries
+     the handlers for extension of file, and then the handlers from
+     priority list (7z, zip, rar, ...) with (maxCheckStartPosition = MaxScanSize).
+     So the archive after stub (SFX) is opened instead of the stub.
+  3) the formats of stubs with matched signature are tried last.
+The handler that opened the file is stored to process-wide cache with
+the size and modification time of file. The cache keeps up to 1024 files
+(least recently used item is evicted). Next Open() of same file
+tries that handler first without reading of header.
+*/
+
+class CArcDetector
+{
+  struct CCandidate
+  {
+    unsigned FormatIndex;
+    UInt64 ScanSize;
+  };
+
+  HRESULT GetCandidates(IInStream *stream, const FString &path, CRecordVector<CCandidate> &candidates) const;
+public:
+  const CArcLibrary *Library;
+  size_t HeaderSize;
+  UInt64 MaxScanSize;
+
+  CArcDetector(): Library(NULL), HeaderSize((size_t)1 << 12), MaxScanSize((UInt64)1 << 20) {}
+
+  /* it returns S_FALSE, if no handler can open the file.
+     (formatIndex) is the index in (Library->Formats). */
+  HRESULT Open(IInStream *stream, const FString &path, IArchiveOpenCallback *openCallback,
+      CMyComPtr<IInArchive> &archive, int &formatIndex) const;
+};
+
+#endif
@@ -0,0 +1,184 @@
+// ArcLibrary.cpp
+
+#include "StdAfx.h"
+
+#include <string.h>
+
+#include <chrono>
+#include <mutex>
+
+#include "../../Windows/Defs.h"
+#include "../../Windows/FileIO.h"
+#include "../../Windows/PropVariant.h"
+
+#include "ArcLibrary.h"
+
+using namespace NWindows;
+
+static UInt64 GetTimeDiff_us(const std::chrono::steady_clock::time_point &start)
+{
+  return (UInt64)std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+static HRESULT GetFormatProp(Func_GetHandlerProperty2 func, UInt32 index, PROPID propID, NCOM::CPropVariant &prop)
+{
+  prop.Clear();
+  return func(index, propID, &prop);
+}
+
+static bool GetBinaryProp(const NCOM::CPropVariant &prop, CByteBuffer &buf)
+{
+  buf.Free();
+  if (prop.vt != VT_BSTR)
+    return false;
+  const UInt32 len = ::SysStringByteLen(prop.bstrVal);
+  buf.CopyFrom((const Byte *)prop.bstrVal, len);
+  return true;
+}
+
+HRESULT CArcLibrary::LoadFormats()
+{
+  Formats.Clear();
+  if (!GetNumberOfFormatsFunc || !GetHandlerProperty2Func)
+    return S_OK;
+  UInt32 numFormats = 0;
+  RINOK(GetNumberOfFormatsFunc(&numFormats))
+  for (UInt32 i = 0; i < numFormats; i++)
+  {
+    CArcFormatInfo &f = Formats.AddNew();
+    NCOM::CPropVariant prop;
+
+    RINOK(GetFormatProp(GetHandlerProperty2Func, i, NArchive::NHandlerPropID::kName, prop))
+    if (prop.vt == VT_BSTR)
+      f.Name = prop.bstrVal;
+
+    CByteBuffer buf;
+    RINOK(GetFormatProp(GetHandlerProperty2Func, i, NArchive::NHandlerPropID::kClassID, prop))
+    if (!GetBinaryProp(prop, buf) || buf.Size() != sizeof(GUID))
+      return E_FAIL;
+    memcpy(&f.ClassID, buf, sizeof(GUID));
+
+    RINOK(GetFormatProp(GetHandlerProperty2Func, i, NArchive::NHandlerPropID::kExtension, prop))
+    if (prop.vt == VT_BSTR)
+      f.Extensions = prop.bstrVal;
+
+    RINOK(GetFormatProp(GetHandlerProperty2Func, i, NArchive::NHandlerPropID::kUpdate, prop))
+    f.UpdateEnabled = (prop.vt == VT_BOOL && VARIANT_BOOLToBool(prop.boolVal));
+
+    RINOK(GetFormatProp(GetHandlerProperty2Func, i, NArchive::NHandlerPropID::kFlags, prop))
+    f.Flags = (prop.vt == VT_UI4) ? prop.ulVal : 0;
+
+    RINOK(GetFormatProp(GetHandlerProperty2Func, i, NArchive::NHandlerPropID::kSignatureOffset, prop))
+    f.SignatureOffset = (prop.vt == VT_UI4) ? prop.ulVal : 0;
+
+    RINOK(GetFormatProp(GetHandlerProperty2Func, i, NArchive::NHandlerPropID::kSignature, prop))
+    if (GetBinaryProp(prop, buf) && buf.Size() != 0)
+      f.Signatures.Add(buf);
+
+    // kMultiSignature : the sequence of (size byte, signature)
+    RINOK(GetFormatProp(GetHandlerProperty2Func, i, NArchive::NHandlerPropID::kMultiSignature, prop))
+    if (GetBinaryProp(prop, buf))
+    {
+      const Byte *p = buf;
+      size_t rem = buf.Size();
+      while (rem != 0)
+      {
+        const size_t size = p[0];
+        p++;
+        rem--;
+        if (size > rem)
+          break;
+        if (size != 0)
+          f.Signatures.AddNew().CopyFrom(p, size);
+        p += size;
+        rem -= size;
+      }
+    }
+  }
+  return S_OK;
+}
+
+HRESULT CArcLibrary::Load(const FString &path)
+{
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  Path = path;
+  if (!_lib.Load(path))
+    return GetLastError_noZero_HRESULT();
+
+ #ifdef _WIN32
+Z7_DIAGNOSTIC_IGNORE_CAST_FUNCTION
+ #endif
+
+  CreateObjectFunc = Z7_GET_PROC_ADDRESS(
+      Func_CreateObject, _lib.Get_HMODULE(), "CreateObject");
+  GetNumberOfFormatsFunc = Z7_GET_PROC_ADDRESS(
+      Func_GetNumberOfFormats, _lib.Get_HMODULE(), "GetNumberOfFormats");
+  GetHandlerProperty2Func = Z7_GET_PROC_ADDRESS(
+      Func_GetHandlerProperty2, _lib.Get_HMODULE(), "GetHandlerProperty2");
+  if (!CreateObjectFunc)
+    return E_NOTIMPL;
+  LoadTime_us = GetTimeDiff_us(start);
+
+  const std::chrono::steady_clock::time_point startFormats = std::chrono::steady_clock::now();
+  const HRESULT res = LoadFormats();
+  FormatsTime_us = GetTimeDiff_us(startFormats);
+  return res;
+}
+
+int CArcLibrary::FindFormat(const UString &name) const
+{
+  FOR_VECTOR (i, Formats)
+    if (Formats[i].Name.IsEqualTo_NoCase(name))
+      return (int)i;
+  return -1;
+}
+
+int CArcLibrary::FindFormat(const GUID &classID) const
+{
+  FOR_VECTOR (i, Formats)
+    if (Formats[i].ClassID == classID)
+      return (int)i;
+  return -1;
+}
+
+
+struct CArcLibraryRegistry
+{
+  std::mutex Mutex;
+  // the objects are not moved, when new library is added
+  CObjectVector<CArcLibrary> Libraries;
+};
+
+static CArcLibraryRegistry &GetRegistry()
+{
+  // it's not destroyed at exit: the objects from libraries can be released after main()
+  static CArcLibraryRegistry *registry = new CArcLibraryRegistry;
+  return *registry;
+}
+
+HRESULT GetArcLibrary(const FString &path, const CArcLibrary *&library)
+{
+  library = NULL;
+  CArcLibraryRegistry &registry = GetRegistry();
+  // the library is loaded under lock: the threads that request same library wait for it
+  std::lock_guard<std::mutex> lock(registry.Mutex);
+  FOR_VECTOR (i, registry.Libraries)
+  {
+    const CArcLibrary &lib = registry.Libraries[i];
+    if (lib.Path == path)
+    {
+      library = &lib;
+      return S_OK;
+    }
+  }
+  CArcLibrary &lib = registry.Libraries.AddNew();
+  const HRESULT res = lib.Load(path);
+  if (res != S_OK)
+  {
+    registry.Libraries.DeleteBack();
+    return res;
+  }
+  library = &lib;
+  return S_OK;
+}
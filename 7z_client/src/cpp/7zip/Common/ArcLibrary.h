@@ -0,0 +1,74 @@
+// ArcLibrary.h
+
+#ifndef ZIP7_INC_ARC_LIBRARY_H
+#define ZIP7_INC_ARC_LIBRARY_H
+
+#include "../../Common/MyBuffer.h"
+#include "../../Common/MyString.h"
+#include "../../Common/MyVector.h"
+
+#include "../../Windows/DLL.h"
+
+#include "../Archive/IArchive.h"
+
+/*
+CArcLibrary is the 7-Zip library (7z.dll / 7z.so) that was loaded once per process.
+GetArcLibrary() loads the library at first call for that path,
+gets CreateObject(), GetNumberOfFormats(), GetHandlerProperty2()
+and reads the properties of all formats. Next calls from any thread
+return the same object without dlopen() / LoadLibrary().
+The libraries are not unloaded until the end of process,
+so the returned pointer and the functions are valid always.
+*/
+
+struct CArcFormatInfo
+{
+  UString Name;
+  GUID ClassID;
+  UString Extensions;
+  CObjectVector<CByteBuffer> Signatures;
+  UInt32 SignatureOffset;
+  UInt32 Flags;
+  bool UpdateEnabled;
+};
+
+class CArcLibrary
+{
+  Z7_CLASS_NO_COPY(CArcLibrary)
+
+  NWindows::NDLL::CLibrary _lib;
+
+  HRESULT LoadFormats();
+public:
+  FString Path;
+  Func_CreateObject CreateObjectFunc;
+  Func_GetNumberOfFormats GetNumberOfFormatsFunc;
+  Func_GetHandlerProperty2 GetHandlerProperty2Func;
+  CObjectVector<CArcFormatInfo> Formats;
+
+  // the time of first loading
+  UInt64 LoadTime_us;     // LoadLibrary() / dlopen() and GetProcAddress()
+  UInt64 FormatsTime_us;  // the properties of formats
+
+  CArcLibrary():
+      CreateObjectFunc(NULL),
+      GetNumberOfFormatsFunc(NULL),
+      GetHandlerProperty2Func(NULL),
+      LoadTime_us(0),
+      FormatsTime_us(0)
+      {}
+
+  HRESULT Load(const FString &path);
+
+  // it returns the index of format with that name (case insensitive), or -1
+  int FindFormat(const UString &name) const;
+  int FindFormat(const GUID &classID) const;
+
+  HRESULT CreateObject(const GUID &classID, const GUID &iid, void **outObject) const
+    { return CreateObjectFunc(&classID, &iid, outObject); }
+};
+
+// it's thread-safe
+HRESULT GetArcLibrary(const FString &path, const CArcLibrary *&library);
+
+#endif
@@ -0,0 +1,299 @@
+// DirScanner.cpp
+
+#include "StdAfx.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../../Windows/FileName.h"
+
+#include "DirScanner.h"
+
+using namespace NWindows;
+using namespace NFile;
+
+UInt64 CDirScanStat::GetItemsPerSec() const
+{
+  const UInt64 numItems = NumFiles + NumDirs;
+  if (Time_ms == 0)
+    return numItems * 1000;
+  return numItems * 1000 / Time_ms;
+}
+
+UInt32 CDirScanStat::GetHoleRatio_Permille() const
+{
+  if (NumBytes == 0)
+    return 0;
+  return (UInt32)((double)NumHoleBytes * 1000 / (double)NumBytes);
+}
+
+void CDirScanStat::AddFile(const NFind::CFileInfo &fi)
+{
+  NumFiles++;
+  NumBytes += fi.Size;
+ #ifndef _WIN32
+  if (S_ISREG(fi.mode))
+  {
+    const UInt64 allocSize = (UInt64)fi.blocks << 9;
+    if (allocSize < fi.Size)
+      NumHoleBytes += fi.Size - allocSize;
+  }
+ #endif
+}
+
+// the path separator is smaller than any other character.
+// So the items of directory follow each other in sorted list.
+static int CompareRelPaths(const wchar_t *s1, const wchar_t *s2)
+{
+  for (;;)
+  {
+    const wchar_t c1 = *s1++;
+    const wchar_t c2 = *s2++;
+    if (c1 == c2)
+    {
+      if (c1 == 0)
+        return 0;
+      continue;
+    }
+    if (c1 == 0) return -1;
+    if (c2 == 0) return 1;
+    if (IS_PATH_SEPAR(c1)) return -1;
+    if (IS_PATH_SEPAR(c2)) return 1;
+    return c1 < c2 ? -1 : 1;
+  }
+}
+
+static int CompareScanItems(void *const *a1, void *const *a2, void * /* param */)
+{
+  const CDirScanItem &i1 = **(const CDirScanItem *const *)a1;
+  const CDirScanItem &i2 = **(const CDirScanItem *const *)a2;
+  if (i1.RootIndex != i2.RootIndex)
+    return MyCompare(i1.RootIndex, i2.RootIndex);
+  return CompareRelPaths(i1.RelPath, i2.RelPath);
+}
+
+static int CompareScanErrors(void *const *a1, void *const *a2, void * /* param */)
+{
+  const CDirScanError &e1 = **(const CDirScanError *const *)a1;
+  const CDirScanError &e2 = **(const CDirScanError *const *)a2;
+  if (e1.RootIndex != e2.RootIndex)
+    return MyCompare(e1.RootIndex, e2.RootIndex);
+  return CompareRelPaths(fs2us(e1.Path), fs2us(e2.Path));
+}
+
+static void AddError(CObjectVector<CDirScanError> &errors, const FString &path, unsigned rootIndex)
+{
+  const DWORD errorCode = ::GetLastError();
+  CDirScanError &e = errors.AddNew();
+  e.Path = path;
+  e.ErrorCode = errorCode;
+  e.RootIndex = rootIndex;
+}
+
+bool CDirScanner::GetTask(CTask &task)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cond.wait(lock, [this] { return !_tasks.IsEmpty() || _numActiveTasks == 0; });
+  if (_tasks.IsEmpty())
+    return false;
+  task = _tasks.Back();
+  _tasks.DeleteBack();
+  return true;
+}
+
+void CDirScanner::FinishTask(CObjectVector<CTask> &newTasks)
+{
+  bool notify;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    FOR_VECTOR (i, newTasks)
+      _tasks.Add(newTasks[i]);
+    _numActiveTasks += newTasks.Size();
+    _numActiveTasks--;
+    notify = (!newTasks.IsEmpty() || _numActiveTasks == 0);
+  }
+  if (notify)
+    _cond.notify_all();
+}
+
+void CDirScanner::ProcessTask(const CTask &task, CWorker &worker, CObjectVector<CTask> &newTasks)
+{
+  FString dirPrefix;
+
+  if (task.IsRoot)
+  {
+    NFind::CFileInfo fi;
+    if (!fi.Find(task.Path))
+    {
+      AddError(worker.Errors, task.Path, task.RootIndex);
+      return;
+    }
+    if (!fi.IsDir() || !_options.Recursive)
+    {
+      CDirScanItem &item = worker.Items.AddNew();
+      item.Info = fi;
+      item.RelPath = fs2us(fi.Name);
+      item.FullPath = task.Path;
+      item.RootIndex = task.RootIndex;
+      if (fi.IsDir())
+        worker.Stat.NumDirs++;
+      else
+        worker.Stat.AddFile(fi);
+      return;
+    }
+    dirPrefix = task.Path;
+    NName::NormalizeDirPathPrefix(dirPrefix);
+  }
+  else
+    dirPrefix = task.Path;
+
+  worker.Stat.NumDirs++;
+
+  NFind::CEnumerator enumerator;
+  enumerator.SetDirPrefix(dirPrefix);
+  for (;;)
+  {
+    NFind::CFileInfo fi;
+    bool found;
+   #ifdef _WIN32
+    if (!enumerator.Next(fi, found))
+    {
+      AddError(worker.Errors, dirPrefix, task.RootIndex);
+      return;
+    }
+    if (!found)
+      break;
+   #else
+    NFind::CDirEntry de;
+    if (!enumerator.Next(de, found))
+    {
+      AddError(worker.Errors, dirPrefix, task.RootIndex);
+      return;
+    }
+    if (!found)
+      break;
+    if (!enumerator.Fill_FileInfo(de, fi, false))
+    {
+      AddError(worker.Errors, dirPrefix + de.Name, task.RootIndex);
+      continue;
+    }
+   #endif
+
+    if (fi.IsDir())
+    {
+      CTask &t = newTasks.AddNew();
+      t.Path = dirPrefix;
+      t.Path += fi.Name;
+      t.Path.Add_PathSepar();
+      t.RelPrefix = task.RelPrefix;
+      t.RelPrefix += fs2us(fi.Name);
+      t.RelPrefix.Add_PathSepar();
+      t.RootIndex = task.RootIndex;
+      t.IsRoot = false;
+      continue;
+    }
+
+    CDirScanItem &item = worker.Items.AddNew();
+    item.RelPath = task.RelPrefix;
+    item.RelPath += fs2us(fi.Name);
+    item.FullPath = dirPrefix;
+    item.FullPath += fi.Name;
+    item.RootIndex = task.RootIndex;
+    worker.Stat.AddFile(fi);
+    item.Info = fi;
+  }
+}
+
+void CDirScanner::ThreadFunc(CWorker *worker)
+{
+  CTask task;
+  CObjectVector<CTask> newTasks;
+  while (GetTask(task))
+  {
+    newTasks.Clear();
+    try
+    {
+      ProcessTask(task, *worker, newTasks);
+    }
+    catch(...)
+    {
+      newTasks.Clear();
+      std::lock_guard<std::mutex> lock(_mutex);
+      _memError = true;
+    }
+    FinishTask(newTasks);
+  }
+}
+
+HRESULT CDirScanner::Scan(const FStringVector &paths, const CDirScanOptions &options)
+{
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  Items.Clear();
+  Errors.Clear();
+  Stat.Clear();
+  _options = options;
+  _memError = false;
+  _tasks.Clear();
+
+  FOR_VECTOR (i, paths)
+  {
+    CTask &t = _tasks.AddNew();
+    t.Path = paths[i];
+    t.RootIndex = i;
+    t.IsRoot = true;
+  }
+  _numActiveTasks = _tasks.Size();
+
+  unsigned numThreads = options.NumThreads;
+  if (numThreads == 0)
+    numThreads = 1;
+
+  CObjectVector<CWorker> workers;
+  for (unsigned i = 0; i < numThreads; i++)
+    workers.AddNew();
+
+  // the calling thread is worker 0
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < numThreads; i++)
+  {
+    try
+    {
+      threads.push_back(std::thread(&CDirScanner::ThreadFunc, this, &workers[i]));
+    }
+    catch(...)
+    {
+      // we continue with threads that were created already
+      break;
+    }
+  }
+  ThreadFunc(&workers[0]);
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+
+  if (_memError)
+    return E_OUTOFMEMORY;
+
+  {
+    unsigned numItems = 0;
+    FOR_VECTOR (i, workers)
+      numItems += workers[i].Items.Size();
+    Items.ClearAndReserve(numItems);
+  }
+  FOR_VECTOR (i, workers)
+  {
+    CWorker &w = workers[i];
+    FOR_VECTOR (k, w.Items)
+      Items.AddInReserved(w.Items[k]);
+    FOR_VECTOR (k, w.Errors)
+      Errors.Add(w.Errors[k]);
+    Stat.Add(w.Stat);
+  }
+  Items.Sort(CompareScanItems, NULL);
+  Errors.Sort(CompareScanErrors, NULL);
+
+  Stat.Time_ms = (UInt64)std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  return S_OK;
+}
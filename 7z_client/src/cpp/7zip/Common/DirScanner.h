@@ -0,0 +1,131 @@
+// DirScanner.h
+
+#ifndef ZIP7_INC_DIR_SCANNER_H
+#define ZIP7_INC_DIR_SCANNER_H
+
+#include <condition_variable>
+#include <mutex>
+
+#include "../../Common/MyString.h"
+#include "../../Common/MyVector.h"
+
+#include "../../Windows/FileFind.h"
+
+/*
+CDirScanner collects the files for compression in several threads.
+On network file systems the latency of stat() / FindNextFile() dominates,
+so the threads enumerate different directories at the same time.
+
+Each root path is stat()-ed by worker thread also.
+  - root file        : it's added with RelPath = its name.
+  - root directory   : if (Recursive), its files are added with RelPath
+                       relative to that root directory.
+                       Otherwise the directory itself is added as item.
+The items for subdirectories are not added.
+
+The threads don't share the list of found items: each thread appends
+the items to its own vector, and only the queue of directories is locked
+(one lock per directory instead of one lock per file).
+After the scan, the items are sorted by (RootIndex, RelPath),
+so the order doesn't depend on the number of threads and the timing.
+*/
+
+struct CDirScanItem
+{
+  NWindows::NFile::NFind::CFileInfo Info;
+  UString RelPath;
+  FString FullPath;
+  unsigned RootIndex;
+};
+
+struct CDirScanError
+{
+  FString Path;
+  DWORD ErrorCode;
+  unsigned RootIndex;
+};
+
+struct CDirScanStat
+{
+  UInt64 NumFiles;
+  UInt64 NumDirs;   // the number of enumerated directories
+  UInt64 NumBytes;  // the total size of files
+  /* the size of holes in sparse files: (size - allocated size).
+     It's estimated from st_blocks, and it's 0 in Windows. */
+  UInt64 NumHoleBytes;
+  UInt64 Time_ms;
+
+  CDirScanStat() { Clear(); }
+  void Clear()
+  {
+    NumFiles = 0;
+    NumDirs = 0;
+    NumBytes = 0;
+    NumHoleBytes = 0;
+    Time_ms = 0;
+  }
+  void Add(const CDirScanStat &s)
+  {
+    NumFiles += s.NumFiles;
+    NumDirs += s.NumDirs;
+    NumBytes += s.NumBytes;
+    NumHoleBytes += s.NumHoleBytes;
+  }
+  void AddFile(const NWindows::NFile::NFind::CFileInfo &fi);
+  // items (files and directories) per second
+  UInt64 GetItemsPerSec() const;
+  // the share of holes in total size of files, in 1/1000 units
+  UInt32 GetHoleRatio_Permille() const;
+};
+
+struct CDirScanOptions
+{
+  unsigned NumThreads;
+  bool Recursive;
+
+  CDirScanOptions(): NumThreads(8), Recursive(true) {}
+};
+
+class CDirScanner
+{
+  Z7_CLASS_NO_COPY(CDirScanner)
+
+  struct CTask
+  {
+    FString Path;       // full path of directory or root
+    UString RelPrefix;  // relative path of directory with trailing separator
+    unsigned RootIndex;
+    bool IsRoot;
+  };
+
+  struct CWorker
+  {
+    CObjectVector<CDirScanItem> Items;
+    CObjectVector<CDirScanError> Errors;
+    CDirScanStat Stat;
+  };
+
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  CObjectVector<CTask> _tasks;   // it's used as stack
+  unsigned _numActiveTasks;      // the tasks in queue and the tasks in progress
+  bool _memError;
+
+  CDirScanOptions _options;
+
+  bool GetTask(CTask &task);
+  void FinishTask(CObjectVector<CTask> &newTasks);
+  void ProcessTask(const CTask &task, CWorker &worker, CObjectVector<CTask> &newTasks);
+  void ThreadFunc(CWorker *worker);
+public:
+  CObjectVector<CDirScanItem> Items;
+  CObjectVector<CDirScanError> Errors;
+  CDirScanStat Stat;
+
+  CDirScanner(): _numActiveTasks(0), _memError(false) {}
+
+  // it returns S_OK, even if some paths were not found. Check (Errors) after call.
+  HRESULT Scan(const FStringVector &paths, const CDirScanOptions &options);
+};
+
+#endif
@@ -34,6 +34,14 @@ you should undefine it after including <sys/types.h>
 
 #endif // _WIN32
 
+#include "c/CpuArch.h"
+
+#if defined(MY_CPU_SSE2)
+#include <emmintrin.h>
+#elif defined(MY_CPU_ARM64)
+#include <arm_neon.h>
+#endif
+
 #include "../../Windows/FileFind.h"
 
 #ifdef Z7_DEVICE_FILE
@@ -43,7 +51,12 @@ you should undefine it after including <sys/types.h>
 
 #include "../PropID.h"
 
+#include "../../Common/MyBuffer.h"
+
 #include "FileStreams.h"
+#include "InFilePrefetcher.h"
+#include "LimitedStreams.h"
+#include "StreamUtils.h"
 
 static inline HRESULT GetLastError_HRESULT()
 {
@@ -66,6 +79,10 @@ static const UInt32 kClusterSize = 1 << 18;
 #endif
 
 CInFileStream::CInFileStream():
+  _prefetcher(NULL),
+  _sparse(false),
+  _extentIndex(0),
+  _sparsePos(0),
  #ifdef Z7_DEVICE_FILE
   VirtPos(0),
   PhyPos(0),
@@ -87,6 +104,8 @@ CInFileStream::CInFileStream():
 
 CInFileStream::~CInFileStream()
 {
+  Prefetch_Free();
+
   #ifdef Z7_DEVICE_FILE
   MidFree(Buf);
   #endif
@@ -95,10 +114,242 @@ CInFileStream::~CInFileStream()
     Callback->InFileStream_On_Destroy(this, CallbackRef);
 }
 
+HRESULT CInFileStream::Set_Prefetch(unsigned numBufs, size_t bufSize, bool useIoUring)
+{
+  Prefetch_Free();
+  if (numBufs == 0)
+    return S_OK;
+  // the bounce buffer of direct mode is not thread-safe
+  if (File.IsDirectIO())
+    return S_FALSE;
+  if (_sparse)
+    return S_FALSE;
+  UInt64 pos;
+  #ifdef Z7_FILE_STREAMS_USE_WIN_FILE
+  #ifdef Z7_DEVICE_FILE
+  if (File.IsDeviceFile)
+    return S_FALSE;
+  #endif
+  if (::GetFileType(File.GetHandle()) != FILE_TYPE_DISK)
+    return S_FALSE;
+  if (!File.GetPosition(pos))
+    return GetLastError_HRESULT();
+  #else
+  struct stat st;
+  if (File.my_fstat(&st) != 0)
+    return GetLastError_HRESULT();
+  // pread() doesn't work for pipes
+  if (!S_ISREG(st.st_mode))
+    return S_FALSE;
+  const off_t res = File.seekToCur();
+  if (res == -1)
+    return GetLastError_HRESULT();
+  pos = (UInt64)res;
+  #endif
+  CInFilePrefetcher *prefetcher = new CInFilePrefetcher;
+  const HRESULT hres = prefetcher->Create(&File, pos, numBufs, bufSize, useIoUring);
+  if (hres != S_OK)
+  {
+    delete prefetcher;
+    return hres;
+  }
+  _prefetcher = prefetcher;
+  return S_OK;
+}
+
+HRESULT CInFileStream::Prefetch_Start(UInt64 pos)
+{
+  if (!_prefetcher)
+    return S_FALSE;
+  _prefetcher->Start(pos);
+  return S_OK;
+}
+
+void CInFileStream::Prefetch_Free()
+{
+  if (!_prefetcher)
+    return;
+  const UInt64 pos = _prefetcher->VirtPos;
+  delete _prefetcher;
+  _prefetcher = NULL;
+  // prefetcher doesn't use the file pointer. So we set it to current virtual position.
+  #ifdef Z7_FILE_STREAMS_USE_WIN_FILE
+  UInt64 realNewPosition;
+  File.Seek(pos, realNewPosition);
+  #else
+  File.seek((off_t)pos, SEEK_SET);
+  #endif
+}
+
+void CInFileStream::Sparse_Free()
+{
+  if (!_sparse)
+    return;
+  _sparse = false;
+  _extents.Clear();
+  // the position of file was not changed by sparse reads
+  #ifndef Z7_FILE_STREAMS_USE_WIN_FILE
+  File.seek((off_t)_sparsePos, SEEK_SET);
+  #endif
+}
+
+HRESULT CInFileStream::Set_Sparse(bool enable)
+{
+  Prefetch_Free();
+  Sparse_Free();
+  if (!enable)
+    return S_OK;
+
+  #ifdef Z7_FILE_STREAMS_USE_WIN_FILE
+  return S_FALSE;
+  #else
+
+  struct stat st;
+  if (File.my_fstat(&st) != 0)
+    return GetLastError_HRESULT();
+  if (!S_ISREG(st.st_mode))
+    return S_FALSE;
+  const UInt64 size = (UInt64)st.st_size;
+  // we don't search holes in file that has all blocks allocated
+  if (((UInt64)st.st_blocks << 9) >= size)
+    return S_FALSE;
+  const off_t cur = File.seekToCur();
+  if (cur == -1)
+    return GetLastError_HRESULT();
+
+  bool hasHoles = false;
+  CSeekExtent e;
+  UInt64 pos = 0;
+  while (pos < size)
+  {
+    UInt64 dataStart, dataEnd;
+    if (!File.GetDataRange(pos, dataStart, dataEnd))
+    {
+      _extents.Clear();
+      return S_FALSE;
+    }
+    if (dataStart == dataEnd || dataStart > size)
+      dataStart = size;
+    if (dataEnd > size)
+      dataEnd = size;
+    if (dataStart != pos)
+    {
+      e.Virt = pos;
+      e.SetAs_ZeroFill();
+      _extents.Add(e);
+      hasHoles = true;
+    }
+    if (dataStart == size)
+      break;
+    e.Virt = dataStart;
+    e.Phy = dataStart;
+    _extents.Add(e);
+    pos = dataEnd;
+  }
+  if (!hasHoles)
+  {
+    _extents.Clear();
+    return S_FALSE;
+  }
+  e.Virt = size;
+  e.Phy = size;
+  _extents.Add(e);
+
+  _extentIndex = 0;
+  _sparsePos = (UInt64)cur;
+  _sparse = true;
+  return S_OK;
+
+  #endif
+}
+
+UInt64 CInFileStream::Get_HoleSize() const
+{
+  UInt64 size = 0;
+  for (unsigned i = 0; i + 1 < _extents.Size(); i++)
+    if (_extents[i].Is_ZeroFill())
+      size += _extents[i + 1].Virt - _extents[i].Virt;
+  return size;
+}
+
+HRESULT CInFileStream::ReadSparse(void *data, UInt32 size, UInt32 *processedSize)
+{
+  if (processedSize)
+    *processedSize = 0;
+  const UInt64 pos = _sparsePos;
+  if (pos >= _extents.Back().Virt || size == 0)
+    return S_OK;
+
+  unsigned left = _extentIndex;
+  if (pos <  _extents[left].Virt ||
+      pos >= _extents[left + 1].Virt)
+  {
+    left = 0;
+    unsigned right = _extents.Size() - 1;
+    for (;;)
+    {
+      const unsigned mid = (unsigned)(((size_t)left + (size_t)right) / 2);
+      if (mid == left)
+        break;
+      if (pos < _extents[mid].Virt)
+        right = mid;
+      else
+        left = mid;
+    }
+    _extentIndex = left;
+  }
+  {
+    const UInt64 rem = _extents[left + 1].Virt - pos;
+    if (size > rem)
+      size = (UInt32)rem;
+  }
+
+  if (_extents[left].Is_ZeroFill())
+    memset(data, 0, size);
+  else
+  {
+    #ifndef Z7_FILE_STREAMS_USE_WIN_FILE
+    const ssize_t res = File.pread_part(data, (size_t)size, pos);
+    if (res == -1)
+      return GetReadError_HRESULT();
+    size = (UInt32)res;
+    #endif
+  }
+  _sparsePos = pos + size;
+  if (processedSize)
+    *processedSize = size;
+  return S_OK;
+}
+
+HRESULT CInFileStream::GetReadError_HRESULT()
+{
+  const DWORD error = ::GetLastError();
+#if 0
+  if (File.IsStdStream && error == ERROR_BROKEN_PIPE)
+    return S_OK; // end of stream
+#endif
+  if (Callback)
+    return Callback->InFileStream_On_Error(CallbackRef, error);
+  if (error == 0)
+    return E_FAIL;
+  return HRESULT_FROM_WIN32(error);
+}
+
 Z7_COM7F_IMF(CInFileStream::Read(void *data, UInt32 size, UInt32 *processedSize))
 {
   // printf("\nCInFileStream::Read size=%d, VirtPos=%8d\n", (unsigned)size, (int)VirtPos);
 
+  if (_prefetcher)
+  {
+    UInt32 realProcessedSize = 0;
+    const bool result = _prefetcher->Read(data, size, realProcessedSize);
+    if (processedSize)
+      *processedSize = realProcessedSize;
+    if (result)
+      return S_OK;
+    return GetReadError_HRESULT();
+  }
+
   #ifdef Z7_FILE_STREAMS_USE_WIN_FILE
   
   #ifdef Z7_DEVICE_FILE
@@ -206,6 +457,8 @@ Z7_COM7F_IMF(CInFileStream::Read(void *data, UInt32 size, UInt32 *processedSize)
 
   #else // Z7_FILE_STREAMS_USE_WIN_FILE
   
+  if (_sparse)
+    return ReadSparse(data, size, processedSize);
   if (processedSize)
     *processedSize = 0;
   const ssize_t res = File.read_part(data, (size_t)size);
@@ -217,18 +470,7 @@ Z7_COM7F_IMF(CInFileStream::Read(void *data, UInt32 size, UInt32 *processedSize)
   }
   #endif // Z7_FILE_STREAMS_USE_WIN_FILE
 
-  {
-    const DWORD error = ::GetLastError();
-#if 0
-    if (File.IsStdStream && error == ERROR_BROKEN_PIPE)
-      return S_OK; // end of stream
-#endif
-    if (Callback)
-      return Callback->InFileStream_On_Error(CallbackRef, error);
-    if (error == 0)
-      return E_FAIL;
-    return HRESULT_FROM_WIN32(error);
-  }
+  return GetReadError_HRESULT();
 }
 
 #ifdef UNDER_CE
@@ -360,6 +602,9 @@ Z7_COM7F_IMF(CInFileStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPos
   if (seekOrigin >= 3)
     return STG_E_INVALIDFUNCTION;
 
+  if (_prefetcher)
+    return _prefetcher->Seek(offset, seekOrigin, newPosition);
+
   #ifdef Z7_FILE_STREAMS_USE_WIN_FILE
 
   #ifdef Z7_DEVICE_FILE
@@ -399,6 +644,23 @@ Z7_COM7F_IMF(CInFileStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPos
   return hres;
   
   #else
+
+  if (_sparse)
+  {
+    switch (seekOrigin)
+    {
+      case STREAM_SEEK_SET: break;
+      case STREAM_SEEK_CUR: offset += _sparsePos; break;
+      case STREAM_SEEK_END: offset += _extents.Back().Virt; break;
+      default: return STG_E_INVALIDFUNCTION;
+    }
+    if (offset < 0)
+      return HRESULT_WIN32_ERROR_NEGATIVE_SEEK;
+    _sparsePos = (UInt64)offset;
+    if (newPosition)
+      *newPosition = _sparsePos;
+    return S_OK;
+  }
   
   const off_t res = File.seek((off_t)offset, (int)seekOrigin);
   if (res == -1)
@@ -794,12 +1056,186 @@ Z7_COM7F_IMF(CInFileStream::ReloadProps())
 //////////////////////////
 // COutFileStream
 
+// the all-zero blocks of that size (aligned to file position) are skipped in sparse mode
+static const UInt32 kSparseBlockSize = (UInt32)1 << 12;
+
+// (size) is multiple of 64
+static bool IsZeroBuf(const Byte *p, size_t size)
+{
+  const Byte *lim = p + size;
+ #if defined(MY_CPU_SSE2)
+  for (; p != lim; p += 64)
+  {
+    const __m128i v = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)(const void *)p),
+                     _mm_loadu_si128((const __m128i *)(const void *)(p + 16))),
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)(const void *)(p + 32)),
+                     _mm_loadu_si128((const __m128i *)(const void *)(p + 48))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+      return false;
+  }
+ #elif defined(MY_CPU_ARM64)
+  for (; p != lim; p += 64)
+  {
+    const uint8x16_t v = vorrq_u8(
+        vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)),
+        vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48)));
+    if (vmaxvq_u8(v) != 0)
+      return false;
+  }
+ #else
+  for (; p != lim; p += 64)
+  {
+    UInt64 v = 0;
+    for (unsigned i = 0; i < 64; i += 8)
+      v |= GetUi64(p + i);
+    if (v != 0)
+      return false;
+  }
+ #endif
+  return true;
+}
+
 HRESULT COutFileStream::Close()
 {
-  return ConvertBoolToHRESULT(File.Close());
+  const HRESULT res = Sparse_Flush();
+  const bool closeRes = File.Close();
+  _sparse = false;
+  RINOK(res)
+  return ConvertBoolToHRESULT(closeRes);
 }
 
 Z7_COM7F_IMF(COutFileStream::Write(const void *data, UInt32 size, UInt32 *processedSize))
+{
+  if (!_sparse)
+    return WriteToFile(data, size, processedSize);
+
+  if (processedSize)
+    *processedSize = 0;
+  const Byte *p = (const Byte *)data;
+  while (size != 0)
+  {
+    /* (cur) is the size of data before first all-zero block that can be skipped.
+       The blocks inside old data of file are always written. */
+    UInt32 cur = 0;
+    UInt32 zeroSize = 0;
+    do
+    {
+      const UInt64 pos = _sparsePos + cur;
+      UInt32 blockSize = kSparseBlockSize - ((UInt32)pos & (kSparseBlockSize - 1));
+      if (blockSize > size - cur)
+        blockSize = size - cur;
+      if (blockSize == kSparseBlockSize
+          && pos >= _sparsePhySize
+          && IsZeroBuf(p + cur, kSparseBlockSize))
+      {
+        zeroSize = kSparseBlockSize;
+        break;
+      }
+      cur += blockSize;
+    }
+    while (cur != size);
+
+    if (cur != 0)
+    {
+      if (_sparseSkip != 0)
+      {
+        RINOK(SeekInFile((Int64)_sparsePos, STREAM_SEEK_SET, NULL))
+        _sparseSkip = 0;
+      }
+      UInt32 processed = 0;
+      const HRESULT res = WriteToFile(p, cur, &processed);
+      _sparsePos += processed;
+      if (_sparsePhySize < _sparsePos)
+        _sparsePhySize = _sparsePos;
+      if (_sparseVirtSize < _sparsePos)
+        _sparseVirtSize = _sparsePos;
+      if (processedSize)
+        *processedSize += processed;
+      RINOK(res)
+      if (processed != cur)
+        return E_FAIL;
+      p += cur;
+      size -= cur;
+    }
+    if (zeroSize != 0)
+    {
+      RINOK(Sparse_Skip(zeroSize))
+      if (processedSize)
+        *processedSize += zeroSize;
+      p += zeroSize;
+      size -= zeroSize;
+    }
+  }
+  return S_OK;
+}
+
+HRESULT COutFileStream::Sparse_Skip(UInt64 size)
+{
+  _sparsePos += size;
+  _sparseSkip += size;
+  if (_sparseVirtSize < _sparsePos)
+    _sparseVirtSize = _sparsePos;
+  ProcessedSize += size;
+  SparseSkippedSize += size;
+  return S_OK;
+}
+
+HRESULT COutFileStream::Sparse_Flush()
+{
+  if (!_sparse || _sparseSkip == 0)
+    return S_OK;
+  // the file is extended over the skipped zeros at the end
+  if (_sparseVirtSize > _sparsePhySize)
+  {
+    if (!File.SetLength_KeepPosition(_sparseVirtSize))
+      return GetLastError_HRESULT();
+    _sparsePhySize = _sparseVirtSize;
+  }
+  RINOK(SeekInFile((Int64)_sparsePos, STREAM_SEEK_SET, NULL))
+  _sparseSkip = 0;
+  return S_OK;
+}
+
+HRESULT COutFileStream::Set_Sparse(bool enable)
+{
+  if (!enable)
+  {
+    RINOK(Sparse_Flush())
+    _sparse = false;
+    return S_OK;
+  }
+  if (_sparse)
+    return S_OK;
+  UInt64 size;
+  RINOK(GetSize(&size))
+  UInt64 pos;
+  RINOK(SeekInFile(0, STREAM_SEEK_CUR, &pos))
+  // if file system doesn't support sparse files, the skipped ranges are filled with zeros by OS
+  File.SetSparse();
+  _sparsePos = pos;
+  _sparsePhySize = size;
+  _sparseVirtSize = size;
+  _sparseSkip = 0;
+  _sparse = true;
+  return S_OK;
+}
+
+HRESULT COutFileStream::WriteZeros(UInt64 size)
+{
+  if (_sparse && _sparsePos >= _sparsePhySize)
+    return Sparse_Skip(size);
+  static const Byte kZeros[kSparseBlockSize] = { 0 };
+  while (size != 0)
+  {
+    const UInt32 cur = size < kSparseBlockSize ? (UInt32)size : kSparseBlockSize;
+    RINOK(WriteStream(this, kZeros, cur))
+    size -= cur;
+  }
+  return S_OK;
+}
+
+HRESULT COutFileStream::WriteToFile(const void *data, UInt32 size, UInt32 *processedSize)
 {
   #ifdef Z7_FILE_STREAMS_USE_WIN_FILE
 
@@ -825,8 +1261,22 @@ Z7_COM7F_IMF(COutFileStream::Write(const void *data, UInt32 size, UInt32 *proces
   
   #endif
 }
-  
+
 Z7_COM7F_IMF(COutFileStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition))
+{
+  if (!_sparse)
+    return SeekInFile(offset, seekOrigin, newPosition);
+  // the skipped zeros at the end of file must be converted to hole before the change of position
+  RINOK(Sparse_Flush())
+  UInt64 pos;
+  RINOK(SeekInFile(offset, seekOrigin, &pos))
+  _sparsePos = pos;
+  if (newPosition)
+    *newPosition = pos;
+  return S_OK;
+}
+  
+HRESULT COutFileStream::SeekInFile(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
 {
   if (seekOrigin >= 3)
     return STG_E_INVALIDFUNCTION;
@@ -841,6 +1291,9 @@ Z7_COM7F_IMF(COutFileStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPo
   
   #else
   
+  // the buffered writes must be finished before the change of file position
+  if (!File.FlushBuffers())
+    return GetLastError_HRESULT();
   const off_t res = File.seek((off_t)offset, (int)seekOrigin);
   if (res == -1)
     return GetLastError_HRESULT();
@@ -853,14 +1306,120 @@ Z7_COM7F_IMF(COutFileStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPo
 
 Z7_COM7F_IMF(COutFileStream::SetSize(UInt64 newSize))
 {
-  return ConvertBoolToHRESULT(File.SetLength_KeepPosition(newSize));
+  RINOK(Sparse_Flush())
+  const bool result = File.SetLength_KeepPosition(newSize);
+  if (result && _sparse)
+  {
+    _sparsePhySize = newSize;
+    _sparseVirtSize = newSize;
+  }
+  return ConvertBoolToHRESULT(result);
 }
 
 HRESULT COutFileStream::GetSize(UInt64 *size)
 {
+  RINOK(Sparse_Flush())
+  if (!File.FlushBuffers())
+    return GetLastError_HRESULT();
   return ConvertBoolToHRESULT(File.GetLength(*size));
 }
 
+
+static const size_t kCopyBufSize = (size_t)1 << 20;
+
+static HRESULT CopyStreamData(ISequentialInStream *src, ISequentialOutStream *dest, UInt64 size, CByteBuffer &buf)
+{
+  if (size != 0 && buf.Size() == 0)
+    buf.Alloc(kCopyBufSize);
+  while (size != 0)
+  {
+    const size_t cur = size < kCopyBufSize ? (size_t)size : kCopyBufSize;
+    RINOK(ReadStream_FALSE(src, buf, cur))
+    RINOK(WriteStream(dest, buf, cur))
+    size -= cur;
+  }
+  return S_OK;
+}
+
+HRESULT CopyExtentsStream(CExtentsStream *src, UInt64 pos, UInt64 size, COutFileStream *dest)
+{
+  const CRecordVector<CSeekExtent> &extents = src->Extents;
+  if (size == 0)
+    return S_OK;
+  if (extents.Size() < 2 || pos > extents.Back().Virt || size > extents.Back().Virt - pos)
+    return S_FALSE;
+  CByteBuffer buf;
+  const UInt64 end = pos + size;
+  // the last extent is end marker
+  for (unsigned i = 0; i + 1 < extents.Size() && pos < end; i++)
+  {
+    const CSeekExtent &e = extents[i];
+    UInt64 extentEnd = extents[i + 1].Virt;
+    if (extentEnd <= pos)
+      continue;
+    if (extentEnd > end)
+      extentEnd = end;
+    const UInt64 rem = extentEnd - pos;
+    if (e.Is_ZeroFill())
+    {
+      RINOK(dest->WriteZeros(rem))
+    }
+    else
+    {
+      RINOK(InStream_SeekSet(src, pos))
+      RINOK(CopyStreamData(src, dest, rem, buf))
+    }
+    pos = extentEnd;
+  }
+  return S_OK;
+}
+
+HRESULT COutFileStream::CopyFromFile(NWindows::NFile::NIO::CInFile &src, UInt64 srcPos, UInt64 size, UInt64 &processed)
+{
+  processed = 0;
+  // the bounce buffer of direct mode keeps the position of file by itself
+  if (File.IsDirectIO())
+    return S_FALSE;
+  RINOK(Sparse_Flush())
+  const bool res = File.CopyRange(src, srcPos, size, processed);
+  ProcessedSize += processed;
+  CopyRangeSize += processed;
+  if (_sparse)
+  {
+    _sparsePos += processed;
+    if (_sparsePhySize < _sparsePos)
+      _sparsePhySize = _sparsePos;
+    if (_sparseVirtSize < _sparsePos)
+      _sparseVirtSize = _sparsePos;
+  }
+  // if it's not supported or if there is write error, the caller writes the rest via Write()
+  return res ? S_OK : S_FALSE;
+}
+
+HRESULT CInFileStream::CopyRangeTo(UInt64 pos, UInt64 size, COutFileStream *dest, UInt64 &processed)
+{
+  return dest->CopyFromFile(File, pos, size, processed);
+}
+
+HRESULT CopyLimitedStream(CLimitedInStream *src, CInFileStream *srcFile, COutFileStream *dest)
+{
+  if (src->GetStream() != static_cast<IInStream *>(srcFile))
+    return E_INVALIDARG;
+  UInt64 pos = src->GetPos();
+  const UInt64 size = src->GetSize();
+  if (pos >= size)
+    return S_OK;
+  UInt64 processed = 0;
+  const HRESULT res = srcFile->CopyRangeTo(src->GetStartOffset() + pos, size - pos, dest, processed);
+  if (res != S_OK && res != S_FALSE)
+    return res;
+  pos += processed;
+  RINOK(InStream_SeekSet(src, pos))
+  // the end of file was reached, or kernel copy is not supported
+  CByteBuffer buf;
+  return CopyStreamData(src, dest, size - pos, buf);
+}
+
 #ifdef UNDER_CE
 
 Z7_COM7F_IMF(CStdOutFileStream::Write(const void *data, UInt32 size, UInt32 *processedSize))
@@ -14,10 +14,13 @@
 
 #include "cpp/7zip/IStream.h"
 
+#include "LimitedStreams.h"
 #include "UniqBlocks.h"
 
 
 class CInFileStream;
+class CInFilePrefetcher;
+class COutFileStream;
 
 Z7_PURE_INTERFACES_BEGIN
 DECLARE_INTERFACE(IInFileStream_Callback)
@@ -66,6 +69,17 @@ public:
 
 private:
   NWindows::NFile::NIO::CInFile File;
+  CInFilePrefetcher *_prefetcher;
+  void Prefetch_Free();
+
+  // sparse mode: Read() returns zeros for holes from (_extents) without reading of file
+  bool _sparse;
+  unsigned _extentIndex; // the extent of previous Read()
+  UInt64 _sparsePos;     // the position of stream. The position of file is not used.
+  CRecordVector<CSeekExtent> _extents;
+  void Sparse_Free();
+  HRESULT ReadSparse(void *data, UInt32 size, UInt32 *processedSize);
+  HRESULT GetReadError_HRESULT();
 public:
 
   #ifdef Z7_FILE_STREAMS_USE_WIN_FILE
@@ -116,15 +130,57 @@ public:
   
   bool Open(CFSTR fileName)
   {
+    Prefetch_Free();
+    Sparse_Free();
     _info_WasLoaded = false;
     return File.Open(fileName);
   }
   
   bool OpenShared(CFSTR fileName, bool shareForWrite)
   {
+    Prefetch_Free();
+    Sparse_Free();
     _info_WasLoaded = false;
     return File.OpenShared(fileName, shareForWrite);
   }
+
+  /* Set_Prefetch() enables background read-ahead for opened file:
+     the thread reads next (numBufs) blocks of (bufSize) bytes.
+     It must be called after Open(). (numBufs == 0) disables prefetching.
+     It returns S_FALSE, if prefetching is not supported for that file.
+     In linux the thread submits the reads of all free blocks with one io_uring call,
+     if (useIoUring) and io_uring is available. Otherwise it uses pread(). */
+  HRESULT Set_Prefetch(unsigned numBufs, size_t bufSize = (size_t)1 << 20, bool useIoUring = true);
+  const CInFilePrefetcher *Get_Prefetcher() const { return _prefetcher; }
+  /* Prefetch_Start() seeks to (pos) and starts prefetching from there without
+     waiting for sequential reads. It returns S_FALSE, if prefetching is not enabled. */
+  HRESULT Prefetch_Start(UInt64 pos);
+
+  /* Set_Sparse() reads the map of data ranges and holes of opened file (SEEK_DATA / SEEK_HOLE).
+     Then Read() returns zeros for holes from memory and reads only data ranges.
+     The map is created once: the file must not be changed while it's read.
+     It disables prefetching.
+     It returns S_FALSE, if file has no holes, or if it's not supported (Windows). */
+  HRESULT Set_Sparse(bool enable);
+  bool IsSparse() const { return _sparse; }
+  /* the map in CExtentsStream format: the holes are zero-fill extents,
+     the last item is end marker with (Virt == fileSize). */
+  const CRecordVector<CSeekExtent> &Get_Extents() const { return _extents; }
+  UInt64 Get_HoleSize() const;
+
+  /* CopyRangeTo() copies (size) bytes from (pos) of file to (dest) in kernel.
+     It doesn't change the position of stream.
+     It returns S_FALSE, if it's not supported. (processed) bytes were copied before. */
+  HRESULT CopyRangeTo(UInt64 pos, UInt64 size, COutFileStream *dest, UInt64 &processed);
+
+  /* Set_DirectIO() enables direct I/O (O_DIRECT) mode for opened file:
+     the data is not stored in page cache. It disables prefetching.
+     It returns false, if it's not supported. Then the file is read through page cache. */
+  bool Set_DirectIO(bool enable, size_t bufSize = (size_t)1 << 20)
+  {
+    Prefetch_Free();
+    return File.Set_DirectIO(enable, bufSize);
+  }
 };
 
 // bool CreateStdInStream(CMyComPtr<ISequentialInStream> &str);
@@ -141,10 +197,23 @@ Z7_CLASS_IMP_COM_1(
   , IOutStream
 )
   Z7_IFACE_COM7_IMP(ISequentialOutStream)
+
+  bool _sparse;
+  UInt64 _sparsePos;      // logical position in stream
+  UInt64 _sparsePhySize;  // size of file on disk
+  UInt64 _sparseVirtSize; // size of stream including the skipped zeros at the end
+  UInt64 _sparseSkip;     // the size of zeros skipped after last write
+
+  HRESULT WriteToFile(const void *data, UInt32 size, UInt32 *processedSize);
+  HRESULT SeekInFile(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
+  HRESULT Sparse_Skip(UInt64 size);
+  HRESULT Sparse_Flush();
 public:
 
   NWindows::NFile::NIO::COutFile File;
 
+  COutFileStream(): _sparse(false), SparseSkippedSize(0), CopyRangeSize(0) {}
+
   bool Create_NEW(CFSTR fileName)
   {
     ProcessedSize = 0;
@@ -172,6 +241,37 @@ public:
   HRESULT Close();
   
   UInt64 ProcessedSize;
+  UInt64 SparseSkippedSize; // the size of all-zero blocks that were not written in sparse mode
+  UInt64 CopyRangeSize; // the size of data that was copied by CopyFromFile()
+
+  /* Set_Sparse() enables sparse mode for opened file:
+     Write() doesn't write the all-zero blocks past end of file, but seeks over them.
+     The holes are finished by SetLength(), when the stream is closed or the position is changed. */
+  HRESULT Set_Sparse(bool enable);
+  bool IsSparse() const { return _sparse; }
+
+  // WriteZeros() writes (size) zero bytes. In sparse mode it seeks over them past end of file.
+  HRESULT WriteZeros(UInt64 size);
+
+  /* CopyFromFile() copies (size) bytes from (srcPos) of (src) file to current position
+     without the copy to user space (copy_file_range, reflink).
+     It returns S_FALSE, if it's not supported. Then the caller writes the rest after (processed) bytes. */
+  HRESULT CopyFromFile(NWindows::NFile::NIO::CInFile &src, UInt64 srcPos, UInt64 size, UInt64 &processed);
+
+  /* Set_WriteQueue() enables asynchronous writes (io_uring in linux) for created file.
+     It returns false, if it's not supported. Then Write() uses write(). */
+  bool Set_WriteQueue(unsigned numBufs, size_t bufSize = (size_t)1 << 20)
+  {
+    return File.WriteQueue_Create(numBufs, bufSize);
+  }
+
+  /* Set_DirectIO() enables direct I/O (O_DIRECT) mode for created file:
+     the data is not stored in page cache. It can't be used with Set_WriteQueue().
+     It returns false, if it's not supported. Then Write() uses page cache. */
+  bool Set_DirectIO(bool enable, size_t bufSize = (size_t)1 << 20)
+  {
+    return File.Set_DirectIO(enable, bufSize);
+  }
 
   bool SetTime(const CFiTime *cTime, const CFiTime *aTime, const CFiTime *mTime)
   {
@@ -191,6 +291,16 @@ public:
   HRESULT GetSize(UInt64 *size);
 };
 
+/* CopyExtentsStream() copies (size) bytes from (pos) of (src) stream to (dest) from current position of (dest).
+   The zero-fill extents of (src) are written with dest->WriteZeros(): they are not read.
+   So in sparse mode of (dest) the holes of source are seeks and SetLength() instead of writes. */
+HRESULT CopyExtentsStream(CExtentsStream *src, UInt64 pos, UInt64 size, COutFileStream *dest);
+
+/* CopyLimitedStream() copies the rest of data of (src) to (dest) from current positions.
+   (src) must be CLimitedInStream over (srcFile). The data is copied in kernel, if possible.
+   Otherwise it's copied via buffer. The position of (srcFile) can be changed. */
+HRESULT CopyLimitedStream(CLimitedInStream *src, CInFileStream *srcFile, COutFileStream *dest);
+
 
 Z7_CLASS_IMP_NOQIB_1(
   CStdOutFileStream
@@ -0,0 +1,60 @@
+// GrowBufOutStream.cpp
+
+#include "StdAfx.h"
+
+#include <string.h>
+
+#include "GrowBufOutStream.h"
+
+static const size_t kGrowStep_Min = (size_t)1 << 16;
+
+bool CGrowBufOutStream::Init(UInt64 reserveSize)
+{
+  _size = 0;
+  if (reserveSize != (size_t)reserveSize)
+    return false;
+  if (_buf.Size() != (size_t)reserveSize)
+    _buf.Alloc((size_t)reserveSize);
+  return true;
+}
+
+void CGrowBufOutStream::MoveTo(CByteBuffer &dest, size_t &size)
+{
+  dest.Free();
+  dest.Swap(_buf);
+  size = _size;
+  _size = 0;
+}
+
+Z7_COM7F_IMF(CGrowBufOutStream::Write(const void *data, UInt32 size, UInt32 *processedSize))
+{
+  if (processedSize)
+    *processedSize = 0;
+  if (size == 0)
+    return S_OK;
+  const size_t rem = _buf.Size() - _size;
+  if (size > rem)
+  {
+    const size_t need = _size + size;
+    if (need < _size)
+      return E_OUTOFMEMORY;
+    size_t newSize = _buf.Size() + (_buf.Size() >> 1);
+    if (newSize < _buf.Size() + kGrowStep_Min)
+      newSize = _buf.Size() + kGrowStep_Min;
+    if (newSize < need || newSize < _buf.Size())
+      newSize = need;
+    try
+    {
+      _buf.ChangeSize_KeepData(newSize, _size);
+    }
+    catch(...)
+    {
+      return E_OUTOFMEMORY;
+    }
+  }
+  memcpy(_buf + _size, data, size);
+  _size += size;
+  if (processedSize)
+    *processedSize = size;
+  return S_OK;
+}
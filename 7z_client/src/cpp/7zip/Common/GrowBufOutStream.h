@@ -0,0 +1,41 @@
+// GrowBufOutStream.h
+
+#ifndef ZIP7_INC_GROW_BUF_OUT_STREAM_H
+#define ZIP7_INC_GROW_BUF_OUT_STREAM_H
+
+#include "../../Common/MyBuffer.h"
+#include "../../Common/MyCom.h"
+
+#include "../IStream.h"
+
+/*
+CGrowBufOutStream writes data to memory buffer.
+Init(reserveSize) allocates the buffer for the expected size of data,
+so the buffer is not reallocated, if that size is correct.
+If more data is written, the buffer grows by 1.5x.
+The data can be moved to another CByteBuffer without copying.
+*/
+
+Z7_CLASS_IMP_COM_1(
+  CGrowBufOutStream
+  , ISequentialOutStream
+)
+  CByteBuffer _buf;
+  size_t _size;
+public:
+  CGrowBufOutStream(): _size(0) {}
+
+  // it returns false, if (reserveSize) is larger than address space
+  bool Init(UInt64 reserveSize);
+
+  const Byte *GetData() const { return _buf; }
+  size_t GetSize() const { return _size; }
+  size_t GetCapacity() const { return _buf.Size(); }
+
+  /* it moves the buffer to (dest) without copying.
+     (dest.Size()) can be larger than (size) of data.
+     The stream is empty after that call. */
+  void MoveTo(CByteBuffer &dest, size_t &size);
+};
+
+#endif
@@ -0,0 +1,505 @@
+// InFilePrefetcher.cpp
+
+#include "StdAfx.h"
+
+#include <string.h>
+
+#include "../IStream.h"
+
+#include "InFilePrefetcher.h"
+
+// the number of sequential direct reads after which we resume prefetching
+static const unsigned kNumSeqReadsToResume = 2;
+
+CInFilePrefetcher::CInFilePrefetcher():
+    _file(NULL),
+    _threadWasCreated(false),
+    _stop(false),
+    _active(false),
+    _disabled(false),
+    _eof(false),
+    _generation(0),
+    _fillPos(0),
+    _blocksStart(0),
+    _numBlocks(0),
+    _bufSize(0),
+    _lastDirectEnd(0),
+    _numSeqReads(0),
+   #ifdef Z7_USE_IO_URING
+    _useRing(false),
+    _ringFailed(false),
+   #endif
+    VirtPos(0),
+    NumPrefetchedBytes(0),
+    NumDirectBytes(0),
+    NumInvalidations(0)
+    {}
+
+CInFilePrefetcher::~CInFilePrefetcher()
+{
+  Destroy();
+}
+
+HRESULT CInFilePrefetcher::Create(NWindows::NFile::NIO::CInFile *file, UInt64 startPos,
+    unsigned numBufs, size_t bufSize, bool useIoUring)
+{
+  Destroy();
+  if (numBufs == 0 || bufSize == 0)
+    return E_INVALIDARG;
+  _file = file;
+  _bufSize = bufSize;
+  _bufs.Clear();
+  for (unsigned i = 0; i < numBufs; i++)
+    _bufs.AddNew().Alloc(bufSize);
+  _blocks.ClearAndSetSize(numBufs);
+  _blocksStart = 0;
+  _numBlocks = 0;
+  _active = false;
+  _disabled = false;
+  _eof = false;
+  _stop = false;
+  _fillPos = startPos;
+  VirtPos = startPos;
+  _lastDirectEnd = startPos;
+  _numSeqReads = 0;
+  NumPrefetchedBytes = 0;
+  NumDirectBytes = 0;
+  NumInvalidations = 0;
+
+  // it's only hint for kernel. We ignore the error.
+  _file->AdviseSequential();
+
+ #ifdef Z7_USE_IO_URING
+  _useRing = false;
+  _ringFailed = false;
+  if (useIoUring && bufSize <= ((UInt32)1 << 31))
+  {
+    CRecordVector<void *> bufs;
+    for (unsigned i = 0; i < numBufs; i++)
+      bufs.Add((Byte *)_bufs[i]);
+    _claimed.ClearAndReserve(numBufs);
+    // if io_uring is not available, we use pread()
+    if (_ring.Create(numBufs) && _ring.RegisterBuffers(bufs.ConstData(), numBufs, bufSize))
+      _useRing = true;
+    else
+      _ring.Close();
+  }
+ #else
+  UNUSED_VAR(useIoUring)
+ #endif
+
+  try
+  {
+    _thread = std::thread(&CInFilePrefetcher::ThreadFunc, this);
+  }
+  catch(...)
+  {
+    return E_FAIL;
+  }
+  _threadWasCreated = true;
+  return S_OK;
+}
+
+void CInFilePrefetcher::Destroy()
+{
+  if (!_threadWasCreated)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cond.notify_all();
+  _thread.join();
+  _threadWasCreated = false;
+ #ifdef Z7_USE_IO_URING
+  _ring.Close();
+  _useRing = false;
+ #endif
+}
+
+bool CInFilePrefetcher::ReadAtPos(UInt64 pos, void *data, size_t size, size_t &processed)
+{
+  processed = 0;
+  while (size != 0)
+  {
+    size_t cur;
+   #ifdef _WIN32
+    UInt32 curLoc = 0;
+    const UInt32 sizeLoc = (size > ((UInt32)1 << 30) ? ((UInt32)1 << 30) : (UInt32)size);
+    if (!_file->ReadPart_AtPos(pos, data, sizeLoc, curLoc))
+      return false;
+    cur = curLoc;
+   #else
+    const ssize_t res = _file->pread_part(data, size, pos);
+    if (res < 0)
+      return false;
+    cur = (size_t)res;
+   #endif
+    if (cur == 0)
+      break;
+    data = (void *)((Byte *)data + cur);
+    size -= cur;
+    pos += cur;
+    processed += cur;
+  }
+  return true;
+}
+
+void CInFilePrefetcher::SetBlockResult_Locked(unsigned index, UInt32 generation,
+    bool res, size_t processed, DWORD error)
+{
+  // if Read() has reset the ring, the block was removed already
+  if (generation != _generation)
+    return;
+  CBlock &block = _blocks[index];
+  block.Size = processed;
+  block.Error = error;
+  block.ReadError = !res;
+  block.Ready = true;
+  const UInt64 end = block.Pos + processed;
+  if (!res || processed != _bufSize)
+  {
+    // the blocks after end of file can be finished before the last block
+    if (!_eof || _fillPos > end)
+      _fillPos = end;
+    _eof = true;
+  }
+  else if (!_eof && _fillPos < end)
+    _fillPos = end;
+  NumPrefetchedBytes += processed;
+}
+
+#ifdef Z7_USE_IO_URING
+
+static const unsigned kFinishedBlock = (unsigned)(int)-1;
+
+void CInFilePrefetcher::ReadBlocks_Ring(std::unique_lock<std::mutex> &lock)
+{
+  const UInt32 generation = _generation;
+  _claimed.Clear();
+  UInt64 pos = _fillPos;
+  while (_numBlocks < _blocks.Size())
+  {
+    unsigned index = _blocksStart + _numBlocks;
+    if (index >= _blocks.Size())
+      index -= _blocks.Size();
+    CBlock &block = _blocks[index];
+    block.Pos = pos;
+    block.Size = 0;
+    block.Error = 0;
+    block.ReadError = false;
+    block.Ready = false;
+    if (!_ring.Add_Read(_file->GetHandle(), _bufs[index], _bufSize, pos, index, index))
+      break;
+    _numBlocks++;
+    _claimed.AddInReserved(index);
+    pos += _bufSize;
+  }
+  lock.unlock();
+
+  const unsigned numClaimed = _claimed.Size();
+  unsigned numSubmitted = numClaimed;
+  if (!_ring.Submit())
+  {
+    // the blocks that were not sent to kernel are read with pread() below
+    _ringFailed = true;
+    numSubmitted -= _ring.Remove_NotSubmitted();
+  }
+  /* The kernel can write to buffers of submitted blocks until the completion.
+     So we wait for completions of all submitted blocks, before pread() to these buffers. */
+  bool ringOk = true;
+  DWORD ringError = 0;
+  for (unsigned numDone = 0; numDone < numClaimed; numDone++)
+  {
+    unsigned index;
+    size_t processed = 0;
+    bool res;
+    DWORD error = 0;
+    UInt64 userData;
+    Int32 result;
+    bool completed = false;
+    if (ringOk && numDone < numSubmitted)
+    {
+      completed = _ring.GetCompletion(userData, result, true);
+      if (!completed)
+      {
+        /* We can't wait for submitted requests. We close the ring, so the kernel cancels them.
+           The buffers of unfinished blocks are not used anymore, and prefetching is stopped. */
+        ringOk = false;
+        _ringFailed = true;
+        ringError = ::GetLastError();
+        if (ringError == 0)
+          ringError = EIO;
+        _ring.Close();
+        lock.lock();
+        _disabled = true;
+        lock.unlock();
+      }
+    }
+    if (completed)
+    {
+      index = (unsigned)userData;
+      // we mark the finished block for the case of io_uring failure
+      FOR_VECTOR (i, _claimed)
+        if (_claimed[i] == index)
+          _claimed[i] = kFinishedBlock;
+      res = (result >= 0);
+      if (res)
+        processed = (size_t)result;
+      else
+        error = (DWORD)-result;
+      // the read can be short before the end of file. We read the rest directly.
+      if (res && processed != 0 && processed != _bufSize)
+      {
+        size_t rem = 0;
+        res = ReadAtPos(_blocks[index].Pos + processed, _bufs[index] + processed, _bufSize - processed, rem);
+        processed += rem;
+        if (!res)
+          error = ::GetLastError();
+      }
+    }
+    else
+    {
+      unsigned k = 0;
+      while (_claimed[k] == kFinishedBlock)
+        k++;
+      index = _claimed[k];
+      _claimed[k] = kFinishedBlock;
+      if (k < numSubmitted)
+      {
+        // the request is still in kernel
+        res = false;
+        error = ringError;
+      }
+      else
+      {
+        // the request was not submitted
+        res = ReadAtPos(_blocks[index].Pos, _bufs[index], _bufSize, processed);
+        if (!res)
+          error = ::GetLastError();
+      }
+    }
+    lock.lock();
+    SetBlockResult_Locked(index, generation, res, processed, error);
+    lock.unlock();
+    _cond.notify_all();
+  }
+  lock.lock();
+}
+
+#endif
+
+void CInFilePrefetcher::ThreadFunc()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  for (;;)
+  {
+    _cond.wait(lock, [this] { return _stop || (_active && !_disabled && !_eof && _numBlocks < _blocks.Size()); });
+    if (_stop)
+      return;
+   #ifdef Z7_USE_IO_URING
+    if (_useRing && !_ringFailed)
+    {
+      ReadBlocks_Ring(lock);
+      continue;
+    }
+   #endif
+    unsigned index = _blocksStart + _numBlocks;
+    if (index >= _blocks.Size())
+      index -= _blocks.Size();
+    CBlock &block = _blocks[index];
+    block.Pos = _fillPos;
+    block.Size = 0;
+    block.Error = 0;
+    block.ReadError = false;
+    block.Ready = false;
+    _numBlocks++;
+    const UInt32 generation = _generation;
+    const UInt64 pos = _fillPos;
+    lock.unlock();
+
+    // the kernel can read next block, while we are reading current block
+    _file->ReadAhead(pos + _bufSize, _bufSize);
+    size_t processed = 0;
+    const bool res = ReadAtPos(pos, _bufs[index], _bufSize, processed);
+    const DWORD error = res ? 0 : ::GetLastError();
+
+    lock.lock();
+    SetBlockResult_Locked(index, generation, res, processed, error);
+    _cond.notify_all();
+  }
+}
+
+void CInFilePrefetcher::Reset_Locked()
+{
+  _generation++;
+  _blocksStart = 0;
+  _numBlocks = 0;
+  _eof = false;
+  _active = false;
+  _numSeqReads = 0;
+  _lastDirectEnd = (UInt64)(Int64)-1;
+  NumInvalidations++;
+}
+
+void CInFilePrefetcher::Restart_Locked(UInt64 pos)
+{
+  Reset_Locked();
+  // the buffers can't be used after failure of io_uring
+  _active = !_disabled;
+  _fillPos = pos;
+  _cond.notify_all();
+}
+
+void CInFilePrefetcher::Start(UInt64 pos)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  VirtPos = pos;
+  Restart_Locked(pos);
+}
+
+bool CInFilePrefetcher::IsInWindow_Locked() const
+{
+  const UInt64 start = _blocks[_blocksStart].Pos;
+  return VirtPos >= start && VirtPos - start < (UInt64)_numBlocks * _bufSize;
+}
+
+bool CInFilePrefetcher::DirectRead(void *data, UInt32 size, UInt32 &processedSize)
+{
+  const UInt64 pos = VirtPos;
+  size_t processed = 0;
+  const bool res = ReadAtPos(pos, data, size, processed);
+  processedSize = (UInt32)processed;
+  VirtPos += processed;
+  NumDirectBytes += processed;
+  if (!res)
+    return false;
+  if (pos == _lastDirectEnd)
+    _numSeqReads++;
+  else
+    _numSeqReads = 0;
+  _lastDirectEnd = VirtPos;
+  if (_numSeqReads >= kNumSeqReadsToResume && processed == size)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      // the buffers can't be used after failure of io_uring
+      if (!_disabled)
+        _active = true;
+      _fillPos = VirtPos;
+    }
+    _cond.notify_all();
+  }
+  return true;
+}
+
+bool CInFilePrefetcher::Read(void *data, UInt32 size, UInt32 &processedSize)
+{
+  processedSize = 0;
+  if (size == 0)
+    return true;
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_active)
+    {
+      /* if (VirtPos) is out of the window of blocks claimed by thread (after Seek()),
+         we don't wait for these blocks. After forward jump (selective extraction)
+         we restart prefetching from (VirtPos). After backward jump (archive header)
+         prefetching is paused, and we read directly. */
+      if (_numBlocks == 0 ? (VirtPos != _fillPos) : !IsInWindow_Locked())
+      {
+        const UInt64 start = (_numBlocks == 0 ? _fillPos : _blocks[_blocksStart].Pos);
+        if (VirtPos < start)
+          break;
+        Restart_Locked(VirtPos);
+        if (!_active)
+          break;
+      }
+      if (_numBlocks == 0)
+      {
+        if (_eof)
+          break;
+        _cond.wait(lock, [this] { return _numBlocks != 0; });
+        continue;
+      }
+      const unsigned index = _blocksStart;
+      const CBlock &block = _blocks[index];
+      if (!block.Ready)
+      {
+        _cond.wait(lock, [&block] { return block.Ready; });
+        continue;
+      }
+      const UInt64 end = block.Pos + block.Size;
+      if (VirtPos < end)
+      {
+        // the thread doesn't change ready block, so we can copy it without lock
+        lock.unlock();
+        const size_t offset = (size_t)(VirtPos - block.Pos);
+        size_t rem = block.Size - offset;
+        if (rem > size)
+          rem = size;
+        memcpy(data, _bufs[index] + offset, rem);
+        VirtPos += rem;
+        processedSize = (UInt32)rem;
+        if (VirtPos == end && block.Size == _bufSize)
+        {
+          lock.lock();
+          if (++_blocksStart == _blocks.Size())
+            _blocksStart = 0;
+          _numBlocks--;
+          lock.unlock();
+          _cond.notify_all();
+        }
+        return true;
+      }
+      if (block.Size != _bufSize)
+      {
+        // it's last block
+        if (VirtPos != end)
+          break;
+        if (block.ReadError)
+        {
+          // the block was not read after failure of io_uring. We read it directly.
+          if (_disabled)
+            break;
+          ::SetLastError(block.Error);
+          return false;
+        }
+        return true;
+      }
+      // VirtPos is after the end of block. We skip that block.
+      if (++_blocksStart == _blocks.Size())
+        _blocksStart = 0;
+      _numBlocks--;
+      _cond.notify_all();
+    }
+    if (_active)
+      Reset_Locked();
+  }
+  return DirectRead(data, size, processedSize);
+}
+
+HRESULT CInFilePrefetcher::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
+{
+  // we don't change the ring here. Read() checks the new position and restarts prefetching, if required.
+  switch (seekOrigin)
+  {
+    case STREAM_SEEK_SET: break;
+    case STREAM_SEEK_CUR: offset += VirtPos; break;
+    case STREAM_SEEK_END:
+    {
+      UInt64 length = 0;
+      if (!_file->GetLength(length))
+        return GetLastError_noZero_HRESULT();
+      offset += length;
+      break;
+    }
+    default: return STG_E_INVALIDFUNCTION;
+  }
+  if (offset < 0)
+    return HRESULT_WIN32_ERROR_NEGATIVE_SEEK;
+  VirtPos = (UInt64)offset;
+  if (newPosition)
+    *newPosition = VirtPos;
+  return S_OK;
+}
@@ -0,0 +1,124 @@
+// InFilePrefetcher.h
+
+#ifndef ZIP7_INC_IN_FILE_PREFETCHER_H
+#define ZIP7_INC_IN_FILE_PREFETCHER_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "../../Common/MyBuffer.h"
+#include "../../Common/MyVector.h"
+
+#include "../../Windows/FileIO.h"
+
+/*
+CInFilePrefetcher reads the file in background thread to ring of (numBufs)
+buffers of (bufSize) bytes, while the consumer (decoder) processes
+previous buffers. All reads use explicit file position (pread / OVERLAPPED),
+so the file pointer of CInFile is not used.
+
+The blocks before new position are not read after any jump out of
+the buffered window (Seek()). Prefetching is restarted from new position
+after forward jump, and it's paused after backward jump,
+so small random reads of archive header go directly to file.
+Prefetching is resumed after (kNumSeqReadsToResume) sequential direct reads.
+The generation counter discards the block that the thread was reading
+at the moment of invalidation.
+
+In linux the buffers are registered in io_uring (if it's available), and
+the thread submits the reads of all free blocks with one io_uring_enter() call.
+So the kernel has several requests in queue, and the blocks are ready in any order.
+If io_uring fails, the thread waits for the requests that were submitted already,
+and then it reads the blocks with pread(). If it can't wait for these requests,
+prefetching is stopped, and all reads go directly to file.
+
+Read() and Seek() must be called from one thread.
+Read() returns false and sets LastError in case of read error.
+*/
+
+class CInFilePrefetcher
+{
+  Z7_CLASS_NO_COPY(CInFilePrefetcher)
+
+  struct CBlock
+  {
+    UInt64 Pos;
+    size_t Size;
+    DWORD Error;
+    bool ReadError;
+    bool Ready;
+  };
+
+  NWindows::NFile::NIO::CInFile *_file;
+
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::thread _thread;
+  bool _threadWasCreated;
+  bool _stop;
+
+  // these members are protected by mutex
+  bool _active;
+  bool _disabled;    // prefetching is stopped, because the kernel can still write to buffers
+  bool _eof;         // the thread has read the last block (short block or error)
+  UInt32 _generation;
+  UInt64 _fillPos;   // the position of next block that thread will read
+  unsigned _blocksStart;
+  unsigned _numBlocks; // including the block that is being read by thread
+
+  size_t _bufSize;
+  CObjectVector<CByteBuffer> _bufs; // _bufs[i] is buffer of _blocks[i]
+  CRecordVector<CBlock> _blocks;
+
+  UInt64 _lastDirectEnd;
+  unsigned _numSeqReads;
+
+ #ifdef Z7_USE_IO_URING
+  NWindows::NFile::NIO::CIoUring _ring;
+  bool _useRing;     // it's set in Create()
+  bool _ringFailed;  // it's used only by thread
+  CUIntVector _claimed; // the blocks that were submitted by thread
+  void ReadBlocks_Ring(std::unique_lock<std::mutex> &lock);
+ #endif
+
+  void SetBlockResult_Locked(unsigned index, UInt32 generation, bool res, size_t processed, DWORD error);
+  void ThreadFunc();
+  bool ReadAtPos(UInt64 pos, void *data, size_t size, size_t &processed);
+  void Reset_Locked();
+  void Restart_Locked(UInt64 pos);
+  bool IsInWindow_Locked() const;
+  bool DirectRead(void *data, UInt32 size, UInt32 &processedSize);
+public:
+  UInt64 VirtPos;
+
+  // statistics
+  UInt64 NumPrefetchedBytes;
+  UInt64 NumDirectBytes;
+  UInt32 NumInvalidations;
+
+  CInFilePrefetcher();
+  ~CInFilePrefetcher();
+
+  // (startPos) is current position of file
+  HRESULT Create(NWindows::NFile::NIO::CInFile *file, UInt64 startPos,
+      unsigned numBufs = 4, size_t bufSize = (size_t)1 << 20, bool useIoUring = true);
+  bool IsIoUringUsed() const
+  {
+   #ifdef Z7_USE_IO_URING
+    return _useRing;
+   #else
+    return false;
+   #endif
+  }
+  void Destroy();
+
+  /* Start() sets the position and starts prefetching from that position at once.
+     So the caller can start reading of file that will be read later (next volume). */
+  void Start(UInt64 pos);
+
+  bool Read(void *data, UInt32 size, UInt32 &processedSize);
+  HRESULT Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
+};
+
+#endif
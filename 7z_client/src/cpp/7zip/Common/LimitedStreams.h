@@ -54,6 +54,12 @@ public:
     return SeekToPhys();
   }
   HRESULT SeekToStart() { return Seek(0, STREAM_SEEK_SET, NULL); }
+
+  // the range of (Stream) that is available via that stream
+  IInStream *GetStream() const { return _stream; }
+  UInt64 GetStartOffset() const { return _startOffset; }
+  UInt64 GetSize() const { return _size; }
+  UInt64 GetPos() const { return _virtPos; }
 };
 
 HRESULT CreateLimitedInStream(IInStream *inStream, UInt64 pos, UInt64 size, ISequentialInStream **resStream);
@@ -0,0 +1,199 @@
+// MappedInStream.cpp
+
+#include "StdAfx.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "../../Windows/FileFind.h"
+
+#include "FileStreams.h"
+#include "MappedInStream.h"
+
+CMappedInFileStream::CMappedInFileStream():
+   #ifdef _WIN32
+    _mapping(NULL),
+   #endif
+    _data(NULL),
+    _size(0),
+    _pos(0),
+    SupportHardLinks(false)
+{
+  memset(&_info, 0, sizeof(_info));
+}
+
+CMappedInFileStream::~CMappedInFileStream()
+{
+  Unmap();
+}
+
+void CMappedInFileStream::Unmap()
+{
+ #ifdef _WIN32
+  if (_data)
+    ::UnmapViewOfFile(_data);
+  if (_mapping)
+    ::CloseHandle(_mapping);
+  _mapping = NULL;
+ #else
+  if (_data)
+    ::munmap((void *)_data, (size_t)_size);
+ #endif
+  _data = NULL;
+  _size = 0;
+  _pos = 0;
+}
+
+bool CMappedInFileStream::Open(CFSTR fileName)
+{
+  Unmap();
+  File.Close();
+  if (!File.Open(fileName))
+    return false;
+
+ #ifdef _WIN32
+
+  if (::GetFileType(File.GetHandle()) != FILE_TYPE_DISK
+      || !File.GetFileInformation(&_info))
+    return false;
+  const UInt64 size = (((UInt64)_info.nFileSizeHigh) << 32) + _info.nFileSizeLow;
+  if (size == 0 || size != (size_t)size)
+    return false;
+  _mapping = ::CreateFileMapping(File.GetHandle(), NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!_mapping)
+    return false;
+  _data = (const Byte *)::MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!_data)
+  {
+    Unmap();
+    return false;
+  }
+
+ #else
+
+  if (File.my_fstat(&_info) != 0 || !S_ISREG(_info.st_mode))
+    return false;
+  const UInt64 size = (UInt64)_info.st_size;
+  if (size == 0 || size != (size_t)size)
+    return false;
+  void *p = ::mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, File.GetHandle(), 0);
+  if (p == MAP_FAILED)
+    return false;
+  _data = (const Byte *)p;
+
+ #endif
+
+  _size = size;
+  _pos = 0;
+  return true;
+}
+
+Z7_COM7F_IMF(CMappedInFileStream::Read(void *data, UInt32 size, UInt32 *processedSize))
+{
+  if (processedSize)
+    *processedSize = 0;
+  if (size == 0 || _pos >= _size)
+    return S_OK;
+  {
+    const UInt64 rem = _size - _pos;
+    if (size > rem)
+      size = (UInt32)rem;
+  }
+ #if defined(_WIN32) && defined(_MSC_VER)
+  __try
+  {
+    memcpy(data, _data + (size_t)_pos, size);
+  }
+  __except(GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ?
+      EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+  {
+    return HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+  }
+ #else
+  memcpy(data, _data + (size_t)_pos, size);
+ #endif
+  _pos += size;
+  if (processedSize)
+    *processedSize = size;
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CMappedInFileStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition))
+{
+  switch (seekOrigin)
+  {
+    case STREAM_SEEK_SET: break;
+    case STREAM_SEEK_CUR: offset += _pos; break;
+    case STREAM_SEEK_END: offset += _size; break;
+    default: return STG_E_INVALIDFUNCTION;
+  }
+  if (offset < 0)
+    return HRESULT_WIN32_ERROR_NEGATIVE_SEEK;
+  _pos = (UInt64)offset;
+  if (newPosition)
+    *newPosition = (UInt64)offset;
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CMappedInFileStream::GetSize(UInt64 *size))
+{
+  *size = _size;
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CMappedInFileStream::GetProps2(CStreamFileProps *props))
+{
+  // _info was loaded in Open()
+ #ifdef _WIN32
+  const BY_HANDLE_FILE_INFORMATION &info = _info;
+  props->Size = _size;
+  props->VolID = info.dwVolumeSerialNumber;
+  props->FileID_Low = (((UInt64)info.nFileIndexHigh) << 32) + info.nFileIndexLow;
+  props->FileID_High = 0;
+  props->NumLinks = SupportHardLinks ? info.nNumberOfLinks : 1;
+  props->Attrib = info.dwFileAttributes;
+  props->CTime = info.ftCreationTime;
+  props->ATime = info.ftLastAccessTime;
+  props->MTime = info.ftLastWriteTime;
+ #else
+  const struct stat &st = _info;
+  props->Size = _size;
+  props->VolID = (UInt64)(Int64)st.st_dev;
+  props->FileID_Low = st.st_ino;
+  props->FileID_High = 0;
+  props->NumLinks = (UInt32)st.st_nlink;
+  props->Attrib = NWindows::NFile::NFind::Get_WinAttribPosix_From_PosixMode(st.st_mode);
+  FiTime_To_FILETIME (ST_CTIME(st), props->CTime);
+  FiTime_To_FILETIME (ST_ATIME(st), props->ATime);
+  FiTime_To_FILETIME (ST_MTIME(st), props->MTime);
+ #endif
+  return S_OK;
+}
+
+
+HRESULT OpenInStream_Mapped_or_File(CFSTR fileName, CMyComPtr<IInStream> &stream, bool *isMapped)
+{
+  stream.Release();
+  if (isMapped)
+    *isMapped = false;
+  {
+    CMappedInFileStream *mappedSpec = new CMappedInFileStream;
+    CMyComPtr<IInStream> mapped = mappedSpec;
+    if (mappedSpec->Open(fileName))
+    {
+      if (isMapped)
+        *isMapped = true;
+      stream = mapped;
+      return S_OK;
+    }
+  }
+  CInFileStream *fileSpec = new CInFileStream;
+  CMyComPtr<IInStream> file = fileSpec;
+  if (!fileSpec->Open(fileName))
+    return GetLastError_noZero_HRESULT();
+  stream = file;
+  return S_OK;
+}
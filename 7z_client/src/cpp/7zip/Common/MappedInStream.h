@@ -0,0 +1,73 @@
+// MappedInStream.h
+
+#ifndef ZIP7_INC_MAPPED_IN_STREAM_H
+#define ZIP7_INC_MAPPED_IN_STREAM_H
+
+#include "../../Common/MyCom.h"
+
+#include "../../Windows/FileIO.h"
+
+#include "../IStream.h"
+
+/*
+CMappedInFileStream maps whole file to memory.
+Read() is memcpy from the mapping and Seek() changes only the position.
+So small reads and seeks of IInArchive::Open() don't require system calls.
+
+Open() returns false, if the file can't be mapped:
+  pipes, devices, empty files, or the file is larger than address space.
+Use OpenInStream_Mapped_or_File() to get CInFileStream in such cases.
+
+If the file is truncated by another process, the access to mapping
+can raise exception (SIGBUS). In Windows we catch EXCEPTION_IN_PAGE_ERROR
+and return read error.
+*/
+
+Z7_class_final(CMappedInFileStream) :
+  public IInStream,
+  public IStreamGetSize,
+  public IStreamGetProps2,
+  public CMyUnknownImp
+{
+  Z7_COM_UNKNOWN_IMP_4(
+      IInStream,
+      ISequentialInStream,
+      IStreamGetSize,
+      IStreamGetProps2)
+
+  Z7_IFACE_COM7_IMP(ISequentialInStream)
+  Z7_IFACE_COM7_IMP(IInStream)
+public:
+  Z7_IFACE_COM7_IMP(IStreamGetSize)
+  Z7_IFACE_COM7_IMP(IStreamGetProps2)
+
+private:
+  NWindows::NFile::NIO::CInFile File;
+ #ifdef _WIN32
+  HANDLE _mapping;
+ #endif
+  const Byte *_data;
+  UInt64 _size;
+  UInt64 _pos;
+ #ifdef _WIN32
+  BY_HANDLE_FILE_INFORMATION _info;
+ #else
+  struct stat _info;
+ #endif
+
+  void Unmap();
+public:
+  bool SupportHardLinks;
+
+  CMappedInFileStream();
+  ~CMappedInFileStream();
+
+  bool Open(CFSTR fileName);
+  UInt64 GetMappedSize() const { return _size; }
+};
+
+/* it tries to open file as CMappedInFileStream.
+   If mapping is not possible, it opens CInFileStream. */
+HRESULT OpenInStream_Mapped_or_File(CFSTR fileName, CMyComPtr<IInStream> &stream, bool *isMapped = NULL);
+
+#endif
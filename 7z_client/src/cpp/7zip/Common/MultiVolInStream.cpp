@@ -0,0 +1,202 @@
+// MultiVolInStream.cpp
+
+#include "StdAfx.h"
+
+#include "../../Common/IntToString.h"
+
+#include "../../Windows/FileFind.h"
+
+#include "MultiVolInStream.h"
+
+using namespace NWindows;
+using namespace NFile;
+
+static unsigned GetNumDigitsAtEnd(const FString &path, unsigned &dotPos)
+{
+  unsigned i = path.Len();
+  while (i != 0 && path[i - 1] >= '0' && path[i - 1] <= '9')
+    i--;
+  dotPos = i;
+  if (i == 0 || path[i - 1] != '.')
+    return 0;
+  dotPos = i - 1;
+  return path.Len() - i;
+}
+
+bool CMultiVolInStream::IsFirstVolumeName(const FString &path)
+{
+  unsigned dotPos;
+  const unsigned numDigits = GetNumDigitsAtEnd(path, dotPos);
+  if (numDigits < 2)
+    return false;
+  for (unsigned i = dotPos + 1; i < path.Len() - 1; i++)
+    if (path[i] != '0')
+      return false;
+  return path.Back() == '1';
+}
+
+HRESULT CMultiVolInStream::Init(const FString &firstVolumePath)
+{
+  _volumes.Clear();
+  _pos = 0;
+  _totalSize = 0;
+  _useCounter = 0;
+  _numOpen = 0;
+  _prefetchedIndex = -1;
+  if (!IsFirstVolumeName(firstVolumePath))
+    return S_FALSE;
+  unsigned dotPos;
+  const unsigned numDigits = GetNumDigitsAtEnd(firstVolumePath, dotPos);
+  const FString prefix = firstVolumePath.Left(dotPos + 1);
+
+  for (UInt32 volIndex = 1;; volIndex++)
+  {
+    char temp[16];
+    ConvertUInt32ToString(volIndex, temp);
+    AString num (temp);
+    while (num.Len() < numDigits)
+      num.InsertAtFront('0');
+    FString name = prefix;
+    name += num;
+    NFind::CFileInfo fi;
+    if (!fi.Find(name) || fi.IsDir())
+    {
+      if (volIndex == 1)
+        return GetLastError_noZero_HRESULT();
+      break;
+    }
+    CVolume &vol = _volumes.AddNew();
+    vol.Name = name;
+    vol.StartPos = _totalSize;
+    vol.Size = fi.Size;
+    vol.StreamSpec = NULL;
+    vol.StreamPos = 0;
+    vol.LastUse = 0;
+    _totalSize += fi.Size;
+  }
+  return S_OK;
+}
+
+unsigned CMultiVolInStream::FindVolume(UInt64 pos) const
+{
+  unsigned left = 0, right = _volumes.Size();
+  // binary search: the last volume with (StartPos <= pos)
+  while (right - left > 1)
+  {
+    const unsigned mid = (left + right) / 2;
+    if (_volumes[mid].StartPos <= pos)
+      left = mid;
+    else
+      right = mid;
+  }
+  return left;
+}
+
+void CMultiVolInStream::CloseLruVolume(unsigned exceptIndex)
+{
+  int lru = -1;
+  FOR_VECTOR (i, _volumes)
+  {
+    const CVolume &vol = _volumes[i];
+    if (!vol.Stream || i == exceptIndex)
+      continue;
+    if (lru < 0 || vol.LastUse < _volumes[(unsigned)lru].LastUse)
+      lru = (int)i;
+  }
+  if (lru < 0)
+    return;
+  CVolume &vol = _volumes[(unsigned)lru];
+  vol.Stream.Release();
+  vol.StreamSpec = NULL;
+  _numOpen--;
+}
+
+HRESULT CMultiVolInStream::OpenVolume(unsigned index)
+{
+  CVolume &vol = _volumes[index];
+  vol.LastUse = ++_useCounter;
+  if (vol.Stream)
+    return S_OK;
+  while (_numOpen != 0 && _numOpen >= MaxOpenVolumes)
+    CloseLruVolume(index);
+  CInFileStream *streamSpec = new CInFileStream;
+  CMyComPtr<IInStream> stream = streamSpec;
+  if (!streamSpec->Open(vol.Name))
+    return GetLastError_noZero_HRESULT();
+  if (NumPrefetchBufs != 0)
+  {
+    // if prefetching is not supported, we use direct reading
+    streamSpec->Set_Prefetch(NumPrefetchBufs);
+  }
+  vol.StreamSpec = streamSpec;
+  vol.Stream = stream;
+  vol.StreamPos = 0;
+  _numOpen++;
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CMultiVolInStream::Read(void *data, UInt32 size, UInt32 *processedSize))
+{
+  if (processedSize)
+    *processedSize = 0;
+  if (_pos >= _totalSize || size == 0)
+    return S_OK;
+  const unsigned index = FindVolume(_pos);
+  RINOK(OpenVolume(index))
+  CVolume &vol = _volumes[index];
+  const UInt64 offset = _pos - vol.StartPos;
+  if (vol.StreamPos != offset)
+  {
+    RINOK(vol.Stream->Seek((Int64)offset, STREAM_SEEK_SET, NULL))
+    vol.StreamPos = offset;
+  }
+  const UInt64 rem = vol.Size - offset;
+  if (size > rem)
+    size = (UInt32)rem;
+  UInt32 realProcessed = 0;
+  const HRESULT res = vol.Stream->Read(data, size, &realProcessed);
+  vol.StreamPos += realProcessed;
+  _pos += realProcessed;
+  if (processedSize)
+    *processedSize = realProcessed;
+  RINOK(res)
+
+  // sequential reading in second half of volume: we start reading of next volume
+  if (NumPrefetchBufs != 0
+      && index + 1 < _volumes.Size()
+      && _prefetchedIndex != (int)index + 1
+      && vol.StreamPos >= vol.Size / 2)
+  {
+    _prefetchedIndex = (int)index + 1;
+    if (MaxOpenVolumes > 1)
+    {
+      // the error will be reported, when the data of that volume is requested
+      if (OpenVolume(index + 1) == S_OK)
+      {
+        // the prefetcher of new file waits for sequential reads. So we start it here.
+        CVolume &next = _volumes[index + 1];
+        if (next.StreamSpec->Prefetch_Start(0) == S_OK)
+          next.StreamPos = 0;
+      }
+      vol.LastUse = ++_useCounter;
+    }
+  }
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CMultiVolInStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition))
+{
+  switch (seekOrigin)
+  {
+    case STREAM_SEEK_SET: break;
+    case STREAM_SEEK_CUR: offset += _pos; break;
+    case STREAM_SEEK_END: offset += _totalSize; break;
+    default: return STG_E_INVALIDFUNCTION;
+  }
+  if (offset < 0)
+    return HRESULT_WIN32_ERROR_NEGATIVE_SEEK;
+  _pos = (UInt64)offset;
+  if (newPosition)
+    *newPosition = _pos;
+  return S_OK;
+}
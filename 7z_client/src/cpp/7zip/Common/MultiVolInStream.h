@@ -0,0 +1,78 @@
+// MultiVolInStream.h
+
+#ifndef ZIP7_INC_MULTI_VOL_IN_STREAM_H
+#define ZIP7_INC_MULTI_VOL_IN_STREAM_H
+
+#include "../../Common/MyCom.h"
+#include "../../Common/MyString.h"
+#include "../../Common/MyVector.h"
+
+#include "../IStream.h"
+
+#include "FileStreams.h"
+
+/*
+CMultiVolInStream reads the volumes (name.001, name.002, ...) as one stream.
+Init() gets the sizes of volumes with stat(). The volumes are opened
+when the data of volume is requested first time.
+
+  - not more than (MaxOpenVolumes) volumes are open at same time:
+    the least recently used volume is closed, when new volume is opened.
+  - if (NumPrefetchBufs != 0), each open volume uses CInFilePrefetcher.
+    When sequential reading passes the middle of volume, the next volume
+    is opened, so its prefetcher reads the first blocks before the decoder needs them.
+*/
+
+Z7_CLASS_IMP_COM_1(
+  CMultiVolInStream
+  , IInStream
+)
+  Z7_IFACE_COM7_IMP(ISequentialInStream)
+
+  struct CVolume
+  {
+    FString Name;
+    UInt64 StartPos;
+    UInt64 Size;
+    CInFileStream *StreamSpec;
+    CMyComPtr<IInStream> Stream;
+    UInt64 StreamPos;  // the position in (Stream)
+    UInt64 LastUse;    // for LRU
+  };
+
+  CObjectVector<CVolume> _volumes;
+  UInt64 _pos;
+  UInt64 _totalSize;
+  UInt64 _useCounter;
+  unsigned _numOpen;
+  int _prefetchedIndex;  // the volume that was opened for prefetching
+
+  unsigned FindVolume(UInt64 pos) const;
+  HRESULT OpenVolume(unsigned index);
+  void CloseLruVolume(unsigned exceptIndex);
+public:
+  unsigned MaxOpenVolumes;
+  unsigned NumPrefetchBufs;
+
+  CMultiVolInStream():
+      _pos(0),
+      _totalSize(0),
+      _useCounter(0),
+      _numOpen(0),
+      _prefetchedIndex(-1),
+      MaxOpenVolumes(4),
+      NumPrefetchBufs(0)
+      {}
+
+  // it returns true for the names like (name.001)
+  static bool IsFirstVolumeName(const FString &path);
+
+  /* it finds all volumes of set by the name of first volume.
+     It returns S_FALSE, if (path) is not the name of first volume. */
+  HRESULT Init(const FString &firstVolumePath);
+
+  unsigned GetNumVolumes() const { return _volumes.Size(); }
+  unsigned GetNumOpenVolumes() const { return _numOpen; }
+};
+
+#endif
@@ -0,0 +1,327 @@
+// MultiVolOutStream.cpp
+
+#include "StdAfx.h"
+
+#include "../../Common/IntToString.h"
+
+#include "../../Windows/FileDir.h"
+
+#include "MultiVolOutStream.h"
+
+using namespace NWindows;
+using namespace NFile;
+
+CMultiVolOutStream::CMultiVolOutStream():
+    _absPos(0),
+    _length(0),
+    _threadWasCreated(false),
+    _stop(false),
+    _flushRes(S_OK),
+    Preallocate(true),
+    SyncVolumes(true)
+{
+}
+
+CMultiVolOutStream::~CMultiVolOutStream()
+{
+  Close();
+  if (_threadWasCreated)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _cond.notify_all();
+    _thread.join();
+    _threadWasCreated = false;
+  }
+}
+
+FString CMultiVolOutStream::GetVolumeName(const FString &prefix, unsigned index)
+{
+  char temp[16];
+  ConvertUInt32ToString(index + 1, temp);
+  AString num (temp);
+  while (num.Len() < 3)
+    num.InsertAtFront('0');
+  FString name = prefix;
+  name.Add_Dot();
+  name += num;
+  return name;
+}
+
+void CMultiVolOutStream::ThreadFunc()
+{
+  for (;;)
+  {
+    CVolume *vol;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cond.wait(lock, [this] { return _stop || !_flushQueue.IsEmpty(); });
+      if (_flushQueue.IsEmpty())
+        return;
+      vol = _flushQueue[0];
+      _flushQueue.Delete(0);
+    }
+    HRESULT res = S_OK;
+    if (SyncVolumes && !vol->File.Sync())
+      res = GetLastError_noZero_HRESULT();
+    if (!vol->File.Close() && res == S_OK)
+      res = GetLastError_noZero_HRESULT();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      vol->IsOpen = false;
+      vol->IsFlushing = false;
+      if (_flushRes == S_OK)
+        _flushRes = res;
+    }
+    _cond.notify_all();
+  }
+}
+
+HRESULT CMultiVolOutStream::GetFlushResult()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _flushRes;
+}
+
+void CMultiVolOutStream::WaitFlush(CVolume &vol)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cond.wait(lock, [&vol] { return !vol.IsFlushing; });
+}
+
+void CMultiVolOutStream::SubmitFlush(CVolume &vol)
+{
+  if (_threadWasCreated)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      vol.IsFlushing = true;
+      _flushQueue.Add(&vol);
+    }
+    _cond.notify_all();
+    return;
+  }
+  // there is no background thread: we close the volume here
+  bool res = true;
+  if (SyncVolumes)
+    res = vol.File.Sync();
+  if (!vol.File.Close())
+    res = false;
+  vol.IsOpen = false;
+  if (!res && _flushRes == S_OK)
+    _flushRes = GetLastError_noZero_HRESULT();
+}
+
+HRESULT CMultiVolOutStream::Init(const FString &prefix, const CRecordVector<UInt64> &sizes)
+{
+  RINOK(Close())
+  _volumes.Clear();
+  _prefix = prefix;
+  _sizes = sizes;
+  _absPos = 0;
+  _length = 0;
+  _flushRes = S_OK;
+  if (_sizes.IsEmpty())
+    return E_INVALIDARG;
+  FOR_VECTOR (i, _sizes)
+    if (_sizes[i] == 0)
+      return E_INVALIDARG;
+  if (!_threadWasCreated)
+  {
+    _stop = false;
+    try
+    {
+      _thread = std::thread(&CMultiVolOutStream::ThreadFunc, this);
+      _threadWasCreated = true;
+    }
+    catch(...)
+    {
+      // we close volumes in the calling thread
+    }
+  }
+  return S_OK;
+}
+
+HRESULT CMultiVolOutStream::OpenVolume(unsigned index)
+{
+  while (_volumes.Size() <= index)
+  {
+    // the volumes are created in order. So the gaps are volumes of zero size.
+    const unsigned volIndex = _volumes.Size();
+    CVolume &vol = _volumes.AddNew();
+    vol.Name = GetVolumeName(_prefix, volIndex);
+    vol.Size = GetVolSize(volIndex);
+    vol.RealSize = 0;
+    vol.FilePos = 0;
+    vol.IsOpen = false;
+    vol.IsFlushing = false;
+    if (!vol.File.Create_NEW(vol.Name))
+      return GetLastError_noZero_HRESULT();
+    vol.IsOpen = true;
+    if (Preallocate)
+    {
+      // it's optimization only. So we ignore the error.
+      vol.File.Preallocate(vol.Size);
+    }
+  }
+  CVolume &vol = _volumes[index];
+  // the background thread doesn't use the volume after WaitFlush()
+  WaitFlush(vol);
+  if (vol.IsOpen)
+    return S_OK;
+  if (!vol.File.Open_EXISTING(vol.Name))
+    return GetLastError_noZero_HRESULT();
+  vol.FilePos = 0;
+  vol.IsOpen = true;
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CMultiVolOutStream::Write(const void *data, UInt32 size, UInt32 *processedSize))
+{
+  if (processedSize)
+    *processedSize = 0;
+  RINOK(GetFlushResult())
+  while (size != 0)
+  {
+    // the volume that contains (_absPos)
+    unsigned index = 0;
+    UInt64 offset = _absPos;
+    for (;;)
+    {
+      const UInt64 volSize = GetVolSize(index);
+      if (offset < volSize)
+        break;
+      offset -= volSize;
+      index++;
+    }
+    RINOK(OpenVolume(index))
+    CVolume &vol = _volumes[index];
+    if (vol.FilePos != offset)
+    {
+     #ifdef _WIN32
+      UInt64 newPos;
+      if (!vol.File.Seek(offset, newPos) || newPos != offset)
+        return GetLastError_noZero_HRESULT();
+     #else
+      if (vol.File.seek((off_t)offset, SEEK_SET) != (off_t)offset)
+        return GetLastError_noZero_HRESULT();
+     #endif
+      vol.FilePos = offset;
+    }
+    UInt32 cur = size;
+    const UInt64 rem = vol.Size - offset;
+    if (cur > rem)
+      cur = (UInt32)rem;
+    if (!vol.File.WriteFull(data, cur))
+      return GetLastError_noZero_HRESULT();
+    vol.FilePos += cur;
+    if (vol.RealSize < vol.FilePos)
+      vol.RealSize = vol.FilePos;
+    _absPos += cur;
+    if (_length < _absPos)
+      _length = _absPos;
+    data = (const void *)((const Byte *)data + cur);
+    size -= cur;
+    if (processedSize)
+      *processedSize += cur;
+    // the filled volume is not needed for sequential writing
+    if (vol.FilePos == vol.Size)
+      SubmitFlush(vol);
+  }
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CMultiVolOutStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition))
+{
+  if (newPosition)
+    *newPosition = _absPos;
+  switch (seekOrigin)
+  {
+    case STREAM_SEEK_SET: break;
+    case STREAM_SEEK_CUR: offset += _absPos; break;
+    case STREAM_SEEK_END: offset += _length; break;
+    default: return STG_E_INVALIDFUNCTION;
+  }
+  if (offset < 0)
+    return HRESULT_WIN32_ERROR_NEGATIVE_SEEK;
+  _absPos = (UInt64)offset;
+  if (newPosition)
+    *newPosition = _absPos;
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CMultiVolOutStream::SetSize(UInt64 newSize))
+{
+  RINOK(GetFlushResult())
+  UInt64 volStart = 0;
+  FOR_VECTOR (i, _volumes)
+  {
+    CVolume &vol = _volumes[i];
+    if (newSize >= volStart + vol.Size)
+    {
+      volStart += vol.Size;
+      continue;
+    }
+    // the volumes after (newSize) are deleted
+    for (unsigned k = _volumes.Size(); k > i;)
+    {
+      k--;
+      CVolume &v = _volumes[k];
+      WaitFlush(v);
+      const UInt64 newVolSize = (k == i) ? newSize - volStart : 0;
+      if (k == i && newVolSize != 0)
+      {
+        RINOK(OpenVolume(k))
+        if (!v.File.SetLength(newVolSize))
+          return GetLastError_noZero_HRESULT();
+        v.RealSize = newVolSize;
+        break;
+      }
+      if (v.IsOpen)
+        v.File.Close();
+      if (!NDir::DeleteFileAlways(v.Name))
+        return GetLastError_noZero_HRESULT();
+      _volumes.Delete(k);
+    }
+    break;
+  }
+  _length = newSize;
+  return S_OK;
+}
+
+HRESULT CMultiVolOutStream::CloseVolumes()
+{
+  HRESULT res = S_OK;
+  FOR_VECTOR (i, _volumes)
+  {
+    CVolume &vol = _volumes[i];
+    WaitFlush(vol);
+    if (!vol.IsOpen)
+      continue;
+    // it releases the preallocated space of last volume
+    if (vol.RealSize != vol.Size && !vol.File.SetLength(vol.RealSize) && res == S_OK)
+      res = GetLastError_noZero_HRESULT();
+    if (SyncVolumes && !vol.File.Sync() && res == S_OK)
+      res = GetLastError_noZero_HRESULT();
+    if (!vol.File.Close() && res == S_OK)
+      res = GetLastError_noZero_HRESULT();
+    vol.IsOpen = false;
+  }
+  return res;
+}
+
+HRESULT CMultiVolOutStream::Close()
+{
+  const HRESULT res = CloseVolumes();
+  const HRESULT flushRes = GetFlushResult();
+  _volumes.Clear();
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _flushRes = S_OK;
+  }
+  if (flushRes != S_OK)
+    return flushRes;
+  return res;
+}
@@ -0,0 +1,86 @@
+// MultiVolOutStream.h
+
+#ifndef ZIP7_INC_MULTI_VOL_OUT_STREAM_H
+#define ZIP7_INC_MULTI_VOL_OUT_STREAM_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "../../Common/MyCom.h"
+#include "../../Common/MyString.h"
+#include "../../Common/MyVector.h"
+
+#include "../../Windows/FileIO.h"
+
+#include "../IStream.h"
+
+/*
+CMultiVolOutStream writes archive to volumes (Prefix.001, Prefix.002, ...).
+(VolumeSizes[i]) is the size of volume (i). The last size is used for next volumes.
+
+  - each new volume is preallocated to its size, so the file system
+    can place it contiguously and the writes don't extend the file.
+  - when a volume is filled, it's passed to background thread that
+    calls fsync() and closes it, while the encoder writes next volume.
+  - Seek() to previous volume is allowed (7z writes the start header at the end):
+    the stream waits for the flush of that volume and reopens it.
+  - Close() truncates the last volume to written size (it releases
+    the preallocated space) and waits for all background flushes.
+*/
+
+Z7_CLASS_IMP_COM_1(
+  CMultiVolOutStream
+  , IOutStream
+)
+  Z7_IFACE_COM7_IMP(ISequentialOutStream)
+
+  struct CVolume
+  {
+    NWindows::NFile::NIO::COutFile File;
+    FString Name;
+    UInt64 Size;      // the maximum size of volume
+    UInt64 RealSize;  // the written size of volume
+    UInt64 FilePos;   // the position of file pointer
+    bool IsOpen;
+    bool IsFlushing;  // it's protected by (_mutex)
+  };
+
+  CObjectVector<CVolume> _volumes;
+  CRecordVector<UInt64> _sizes;
+  FString _prefix;
+  UInt64 _absPos;
+  UInt64 _length;
+
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::thread _thread;
+  bool _threadWasCreated;
+  bool _stop;
+  CRecordVector<CVolume *> _flushQueue;
+  HRESULT _flushRes;
+
+  UInt64 GetVolSize(unsigned index) const
+    { return _sizes[index < _sizes.Size() ? index : _sizes.Size() - 1]; }
+  void ThreadFunc();
+  HRESULT GetFlushResult();
+  void WaitFlush(CVolume &vol);
+  void SubmitFlush(CVolume &vol);
+  HRESULT OpenVolume(unsigned index);
+  HRESULT CloseVolumes();
+public:
+  bool Preallocate;
+  bool SyncVolumes;  // fsync() before close of each volume
+
+  CMultiVolOutStream();
+  ~CMultiVolOutStream();
+
+  // it returns E_INVALIDARG, if (sizes) is empty or contains zero size.
+  HRESULT Init(const FString &prefix, const CRecordVector<UInt64> &sizes);
+  HRESULT Close();
+
+  unsigned GetNumVolumes() const { return _volumes.Size(); }
+  static FString GetVolumeName(const FString &prefix, unsigned index);
+};
+
+#endif
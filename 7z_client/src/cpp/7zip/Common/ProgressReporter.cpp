@@ -0,0 +1,265 @@
+// ProgressReporter.cpp
+
+#include "StdAfx.h"
+
+#include <stdio.h>
+
+#include "ProgressReporter.h"
+
+static const UInt64 kEtaUnknown = (UInt64)(Int64)-1;
+
+CProgressReporter::CProgressReporter():
+    _total(0),
+    _completed(0),
+    _outSize(0),
+    _totalDefined(false),
+    _outSizeDefined(false),
+    _stop(false),
+    _started(false),
+    _textLen(0),
+    _feedIsOpen(false),
+    MaxUpdatesPerSec(4),
+    ShowText(true)
+{
+}
+
+void CProgressReporter::GetSnapshot(CProgressSnapshot &s) const
+{
+  s.Total = _total.load(std::memory_order_relaxed);
+  s.Completed = _completed.load(std::memory_order_relaxed);
+  s.OutSize = _outSize.load(std::memory_order_relaxed);
+  s.TotalDefined = _totalDefined.load(std::memory_order_relaxed);
+  s.OutSizeDefined = _outSizeDefined.load(std::memory_order_relaxed);
+  s.Finished = false;
+  s.Elapsed_ms = (UInt64)std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - _startTime).count();
+
+  s.Speed = 0;
+  if (s.Elapsed_ms != 0)
+    s.Speed = s.Completed * 1000 / s.Elapsed_ms;
+
+  s.Percents = 0;
+  s.Eta_ms = kEtaUnknown;
+  if (s.TotalDefined && s.Total != 0)
+  {
+    const UInt64 completed = s.Completed < s.Total ? s.Completed : s.Total;
+    s.Percents = (UInt32)(completed * 100 / s.Total);
+    if (completed != 0 && s.Elapsed_ms != 0)
+    {
+      // (elapsed * rem / completed) without overflow for big sizes
+      const double eta = (double)s.Elapsed_ms * (double)(s.Total - completed) / (double)completed;
+      s.Eta_ms = (UInt64)eta;
+    }
+  }
+
+  s.Ratio = 0;
+  if (s.OutSizeDefined && s.Completed != 0)
+    s.Ratio = (UInt32)((double)s.OutSize * 100 / (double)s.Completed);
+}
+
+static void AddTime(AString &s, UInt64 ms)
+{
+  const UInt64 sec = ms / 1000;
+  s.Add_UInt64(sec / 3600);
+  const UInt32 m = (UInt32)(sec / 60 % 60);
+  const UInt32 ss = (UInt32)(sec % 60);
+  s.Add_Char(':');
+  s.Add_Char((char)('0' + m / 10));
+  s.Add_Char((char)('0' + m % 10));
+  s.Add_Char(':');
+  s.Add_Char((char)('0' + ss / 10));
+  s.Add_Char((char)('0' + ss % 10));
+}
+
+void CProgressReporter::RenderText(const CProgressSnapshot &s)
+{
+  AString line;
+  line.Add_Char('\r');
+  if (s.TotalDefined)
+  {
+    if (s.Percents < 100) line.Add_Space();
+    if (s.Percents < 10) line.Add_Space();
+    line.Add_UInt32(s.Percents);
+    line += "%  ";
+  }
+  line.Add_UInt64(s.Completed >> 20);
+  line += " MB  ";
+  line.Add_UInt64(s.Speed >> 20);
+  line += " MB/s";
+  if (!s.Finished && s.Eta_ms != kEtaUnknown)
+  {
+    line += "  ETA ";
+    AddTime(line, s.Eta_ms);
+  }
+  else if (s.Finished)
+  {
+    line += "  time ";
+    AddTime(line, s.Elapsed_ms);
+  }
+  if (s.OutSizeDefined && s.Completed != 0)
+  {
+    line += "  ratio ";
+    line.Add_UInt32(s.Ratio);
+    line.Add_Char('%');
+  }
+  // the spaces clear the end of previous longer line
+  const unsigned len = line.Len();
+  while (line.Len() < _textLen)
+    line.Add_Space();
+  _textLen = len;
+  if (s.Finished)
+    line.Add_LF();
+  fputs(line, stderr);
+  fflush(stderr);
+}
+
+void CProgressReporter::WriteFeed(const CProgressSnapshot &s)
+{
+  AString line;
+  line += "{\"op\":\"";
+  line += Operation;
+  line += "\",\"completed\":";
+  line.Add_UInt64(s.Completed);
+  if (s.TotalDefined)
+  {
+    line += ",\"total\":";
+    line.Add_UInt64(s.Total);
+    line += ",\"percents\":";
+    line.Add_UInt32(s.Percents);
+  }
+  if (s.OutSizeDefined)
+  {
+    line += ",\"out\":";
+    line.Add_UInt64(s.OutSize);
+    line += ",\"ratio\":";
+    line.Add_UInt32(s.Ratio);
+  }
+  line += ",\"speed\":";
+  line.Add_UInt64(s.Speed);
+  line += ",\"elapsed_ms\":";
+  line.Add_UInt64(s.Elapsed_ms);
+  if (s.Eta_ms != kEtaUnknown && !s.Finished)
+  {
+    line += ",\"eta_ms\":";
+    line.Add_UInt64(s.Eta_ms);
+  }
+  line += ",\"done\":";
+  line += (s.Finished ? "true" : "false");
+  line += "}\n";
+  // the scheduler reads whole lines, so the line is written with one call
+  _feedFile.WriteFull(line.Ptr(), line.Len());
+}
+
+void CProgressReporter::Render(bool finished)
+{
+  CProgressSnapshot s;
+  GetSnapshot(s);
+  s.Finished = finished;
+  if (ShowText)
+    RenderText(s);
+  if (_feedIsOpen)
+    WriteFeed(s);
+}
+
+void CProgressReporter::ThreadFunc()
+{
+  const std::chrono::milliseconds interval(1000 / (MaxUpdatesPerSec == 0 ? 1 : MaxUpdatesPerSec));
+  std::unique_lock<std::mutex> lock(_mutex);
+  for (;;)
+  {
+    if (_cond.wait_for(lock, interval, [this] { return _stop; }))
+      return;
+    lock.unlock();
+    Render(false);
+    lock.lock();
+  }
+}
+
+bool CProgressReporter::Start()
+{
+  Stop();
+  _total = 0;
+  _completed = 0;
+  _outSize = 0;
+  _totalDefined = false;
+  _outSizeDefined = false;
+  _textLen = 0;
+  _startTime = std::chrono::steady_clock::now();
+  if (!FeedPath.IsEmpty())
+  {
+    if (!_feedFile.Create_ALWAYS(FeedPath))
+      return false;
+    _feedIsOpen = true;
+  }
+  _stop = false;
+  try
+  {
+    _thread = std::thread(&CProgressReporter::ThreadFunc, this);
+  }
+  catch(...)
+  {
+    // the progress is not critical: we show only the final state
+  }
+  _started = true;
+  return true;
+}
+
+void CProgressReporter::Stop()
+{
+  if (!_started)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cond.notify_all();
+  if (_thread.joinable())
+    _thread.join();
+  Render(true);
+  if (_feedIsOpen)
+  {
+    _feedFile.Close();
+    _feedIsOpen = false;
+  }
+  _started = false;
+}
+
+
+Z7_COM7F_IMF(CProgressOutStream::Write(const void *data, UInt32 size, UInt32 *processedSize))
+{
+  UInt32 realProcessed = 0;
+  const HRESULT res = _stream->Write(data, size, &realProcessed);
+  _pos += realProcessed;
+  if (_size < _pos)
+  {
+    _size = _pos;
+    if (_progress)
+      _progress->SetOutSize(_size);
+  }
+  if (processedSize)
+    *processedSize = realProcessed;
+  return res;
+}
+
+Z7_COM7F_IMF(CProgressOutStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition))
+{
+  UInt64 newPos = 0;
+  const HRESULT res = _stream->Seek(offset, seekOrigin, &newPos);
+  if (res == S_OK)
+    _pos = newPos;
+  if (newPosition)
+    *newPosition = newPos;
+  return res;
+}
+
+Z7_COM7F_IMF(CProgressOutStream::SetSize(UInt64 newSize))
+{
+  const HRESULT res = _stream->SetSize(newSize);
+  if (res == S_OK)
+  {
+    _size = newSize;
+    if (_progress)
+      _progress->SetOutSize(_size);
+  }
+  return res;
+}
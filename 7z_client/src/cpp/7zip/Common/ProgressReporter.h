@@ -0,0 +1,130 @@
+// ProgressReporter.h
+
+#ifndef ZIP7_INC_PROGRESS_REPORTER_H
+#define ZIP7_INC_PROGRESS_REPORTER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "../../Common/MyCom.h"
+#include "../../Common/MyString.h"
+
+#include "../../Windows/FileIO.h"
+
+#include "../IStream.h"
+
+/*
+CProgressReporter collects the progress of archive operation and
+renders it from its own thread, not more than (MaxUpdatesPerSec) times per second.
+IProgress::SetTotal() / SetCompleted() of callbacks only store the values
+to atomic variables, so the codec threads don't wait for console output.
+
+Outputs:
+  - text line in stderr: percents, speed (MB/s), ETA and ratio.
+    The line is rewritten with '\r'.
+  - feed file (if FeedPath is not empty): one JSON object per line
+    for job scheduler. The last line has "done":true.
+
+The ratio is (OutSize / Completed). OutSize is reported by CProgressOutStream,
+or it's not shown, if OutSize is not reported.
+*/
+
+struct CProgressSnapshot
+{
+  UInt64 Total;
+  UInt64 Completed;
+  UInt64 OutSize;
+  UInt64 Elapsed_ms;
+  UInt64 Speed;    // bytes per second
+  UInt64 Eta_ms;   // (UInt64)(Int64)-1, if unknown
+  UInt32 Percents;
+  UInt32 Ratio;    // percents
+  bool TotalDefined;
+  bool OutSizeDefined;
+  bool Finished;
+};
+
+class CProgressReporter
+{
+  Z7_CLASS_NO_COPY(CProgressReporter)
+
+  std::atomic<UInt64> _total;
+  std::atomic<UInt64> _completed;
+  std::atomic<UInt64> _outSize;
+  std::atomic<bool> _totalDefined;
+  std::atomic<bool> _outSizeDefined;
+
+  std::chrono::steady_clock::time_point _startTime;
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  bool _stop;
+  bool _started;
+
+  unsigned _textLen;
+  NWindows::NFile::NIO::COutFile _feedFile;
+  bool _feedIsOpen;
+
+  void ThreadFunc();
+  void Render(bool finished);
+  void RenderText(const CProgressSnapshot &s);
+  void WriteFeed(const CProgressSnapshot &s);
+public:
+  unsigned MaxUpdatesPerSec;
+  bool ShowText;
+  FString FeedPath;
+  AString Operation;  // the name of operation for feed : "update", "extract"
+
+  CProgressReporter();
+  ~CProgressReporter() { Stop(); }
+
+  void SetTotal(UInt64 total)
+  {
+    _total.store(total, std::memory_order_relaxed);
+    _totalDefined.store(true, std::memory_order_relaxed);
+  }
+  void SetCompleted(UInt64 completed) { _completed.store(completed, std::memory_order_relaxed); }
+  void SetOutSize(UInt64 outSize)
+  {
+    _outSize.store(outSize, std::memory_order_relaxed);
+    _outSizeDefined.store(true, std::memory_order_relaxed);
+  }
+
+  // it returns false, if the feed file can't be created.
+  bool Start();
+  // it renders the final state. It can be called several times.
+  void Stop();
+
+  void GetSnapshot(CProgressSnapshot &s) const;
+};
+
+/*
+CProgressOutStream passes the data to another IOutStream and
+reports the size of written data (the maximum written position) to CProgressReporter.
+*/
+
+Z7_CLASS_IMP_COM_1(
+  CProgressOutStream
+  , IOutStream
+)
+  Z7_IFACE_COM7_IMP(ISequentialOutStream)
+
+  CMyComPtr<IOutStream> _stream;
+  CProgressReporter *_progress;
+  UInt64 _pos;
+  UInt64 _size;
+public:
+  CProgressOutStream(): _progress(NULL), _pos(0), _size(0) {}
+  void Init(IOutStream *stream, CProgressReporter *progress)
+  {
+    _stream = stream;
+    _progress = progress;
+    _pos = 0;
+    _size = 0;
+  }
+};
+
+#endif
@@ -0,0 +1,290 @@
+// UniqFiles.cpp
+
+#include "StdAfx.h"
+
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "../../../C/7zCrc.h"
+
+#include "../../Common/MyBuffer.h"
+
+#include "../../Windows/FileIO.h"
+
+#include "UniqFiles.h"
+
+using namespace NWindows;
+using namespace NFile;
+
+static const size_t kReadBufSize = (size_t)1 << 18;
+
+void CUniqFiles::ClearStat()
+{
+  NumHashedFiles = 0;
+  HashedBytes = 0;
+  NumDupFiles = 0;
+  DupBytes = 0;
+  NumReadErrors = 0;
+}
+
+// it returns false, if the file can't be read or if its size is not (size)
+static bool CalcFileCrc(const FString &path, UInt64 size, Byte *buf, UInt32 &crc)
+{
+  NIO::CInFile file;
+  if (!file.Open(path))
+    return false;
+  UInt32 v = CRC_INIT_VAL;
+  UInt64 total = 0;
+  for (;;)
+  {
+    size_t processed;
+    if (!file.ReadFull(buf, kReadBufSize, processed))
+      return false;
+    if (processed == 0)
+      break;
+    v = CrcUpdate(v, buf, processed);
+    total += processed;
+  }
+  crc = CRC_GET_DIGEST(v);
+  return total == size;
+}
+
+static bool AreFilesEqual(const FString &path1, const FString &path2, Byte *buf1, Byte *buf2)
+{
+  NIO::CInFile file1, file2;
+  if (!file1.Open(path1) || !file2.Open(path2))
+    return false;
+  for (;;)
+  {
+    size_t processed1, processed2;
+    if (!file1.ReadFull(buf1, kReadBufSize, processed1)
+        || !file2.ReadFull(buf2, kReadBufSize, processed2))
+      return false;
+    if (processed1 != processed2)
+      return false;
+    if (processed1 == 0)
+      return true;
+    if (memcmp(buf1, buf2, processed1) != 0)
+      return false;
+  }
+}
+
+/* it calls (func(taskIndex, buf1, buf2)) for all tasks in (numThreads) threads.
+   The threads get the tasks from atomic counter, so they don't use locks. */
+template <class F>
+static void RunTasks(unsigned numThreads, unsigned numTasks, F &func)
+{
+  std::atomic<unsigned> next(0);
+  auto threadFunc = [&]()
+  {
+    CByteBuffer buf1(kReadBufSize);
+    CByteBuffer buf2(kReadBufSize);
+    for (;;)
+    {
+      const unsigned i = next++;
+      if (i >= numTasks)
+        return;
+      func(i, (Byte *)buf1, (Byte *)buf2);
+    }
+  };
+  if (numThreads > numTasks)
+    numThreads = numTasks;
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < numThreads; i++)
+  {
+    try
+    {
+      threads.push_back(std::thread(threadFunc));
+    }
+    catch(...)
+    {
+      break;
+    }
+  }
+  threadFunc();
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+}
+
+struct CCandidate
+{
+  UInt64 Size;
+  UInt32 Crc;
+  unsigned Index;
+  bool Ok;
+};
+
+static int CompareIndicesBySize(const unsigned *p1, const unsigned *p2, void *param)
+{
+  const UInt64 *sizes = (const UInt64 *)param;
+  const UInt64 s1 = sizes[*p1];
+  const UInt64 s2 = sizes[*p2];
+  if (s1 != s2)
+    return MyCompare(s1, s2);
+  return MyCompare(*p1, *p2);
+}
+
+static int CompareCandidates(const CCandidate *c1, const CCandidate *c2, void * /* param */)
+{
+  // the candidates with read errors are at the end
+  if (c1->Ok != c2->Ok)
+    return c1->Ok ? -1 : 1;
+  if (c1->Size != c2->Size)
+    return MyCompare(c1->Size, c2->Size);
+  if (c1->Crc != c2->Crc)
+    return MyCompare(c1->Crc, c2->Crc);
+  return MyCompare(c1->Index, c2->Index);
+}
+
+HRESULT CUniqFiles::Find(const FStringVector &paths, const CRecordVector<UInt64> &sizes)
+{
+  ClearStat();
+  const unsigned numFiles = paths.Size();
+  UniqIndex.ClearAndSetSize(numFiles);
+  for (unsigned i = 0; i < numFiles; i++)
+    UniqIndex[i] = i;
+  if (numFiles < 2)
+    return S_OK;
+
+  CRecordVector<CCandidate> cands;
+  {
+    // only the files of same size can be identical
+    CUIntVector bySize;
+    bySize.ClearAndSetSize(numFiles);
+    for (unsigned i = 0; i < numFiles; i++)
+      bySize[i] = i;
+    bySize.Sort(CompareIndicesBySize, (void *)sizes.ConstData());
+    for (unsigned i = 0; i < numFiles;)
+    {
+      const UInt64 size = sizes[bySize[i]];
+      unsigned k = i + 1;
+      while (k < numFiles && sizes[bySize[k]] == size)
+        k++;
+      if (size != 0 && k - i > 1)
+        for (; i < k; i++)
+        {
+          CCandidate c;
+          c.Size = size;
+          c.Crc = 0;
+          c.Index = bySize[i];
+          c.Ok = false;
+          cands.Add(c);
+        }
+      i = k;
+    }
+  }
+  if (cands.IsEmpty())
+    return S_OK;
+
+  {
+    CCandidate *c = cands.NonConstData();
+    auto hashFunc = [&](unsigned i, Byte *buf, Byte * /* buf2 */)
+    {
+      c[i].Ok = CalcFileCrc(paths[c[i].Index], c[i].Size, buf, c[i].Crc);
+    };
+    RunTasks(NumThreads, cands.Size(), hashFunc);
+  }
+
+  FOR_VECTOR (i, cands)
+  {
+    const CCandidate &c = cands[i];
+    if (c.Ok)
+    {
+      NumHashedFiles++;
+      HashedBytes += c.Size;
+    }
+    else
+      NumReadErrors++;
+  }
+
+  cands.Sort(CompareCandidates, NULL);
+
+  // the runs of candidates with same (size, CRC)
+  CUIntVector runs;
+  {
+    for (unsigned i = 0; i < cands.Size();)
+    {
+      const CCandidate &c = cands[i];
+      if (!c.Ok)
+        break;
+      unsigned k = i + 1;
+      while (k < cands.Size() && cands[k].Ok
+          && cands[k].Size == c.Size
+          && cands[k].Crc == c.Crc)
+        k++;
+      if (k - i > 1)
+      {
+        runs.Add(i);
+        runs.Add(k);
+      }
+      i = k;
+    }
+  }
+
+  {
+    const CCandidate *c = cands.ConstData();
+    const unsigned *r = runs.ConstData();
+    unsigned *uniq = UniqIndex.NonConstData();
+    // each task writes (UniqIndex) only for the files of its run
+    auto compareFunc = [&](unsigned runIndex, Byte *buf1, Byte *buf2)
+    {
+      const unsigned start = r[(size_t)runIndex * 2];
+      const unsigned end = r[(size_t)runIndex * 2 + 1];
+      // the candidates in run are sorted by index. So the first file of group is representative.
+      CUIntVector reps;
+      for (unsigned i = start; i < end; i++)
+      {
+        const unsigned index = c[i].Index;
+        unsigned k;
+        for (k = 0; k < reps.Size(); k++)
+          if (AreFilesEqual(paths[reps[k]], paths[index], buf1, buf2))
+            break;
+        if (k == reps.Size())
+          reps.Add(index);
+        else
+          uniq[index] = reps[k];
+      }
+    };
+    RunTasks(NumThreads, runs.Size() / 2, compareFunc);
+  }
+
+  for (unsigned i = 0; i < numFiles; i++)
+    if (UniqIndex[i] != i)
+    {
+      NumDupFiles++;
+      DupBytes += sizes[i];
+    }
+  return S_OK;
+}
+
+void CUniqFiles::GetAdjacentOrder(CUIntVector &order) const
+{
+  const unsigned numFiles = UniqIndex.Size();
+  order.ClearAndReserve(numFiles);
+  // the linked lists of groups: (next[i]) is the next file in group of (i)
+  CUIntVector next;
+  CUIntVector last;
+  next.ClearAndSetSize(numFiles);
+  last.ClearAndSetSize(numFiles);
+  for (unsigned i = 0; i < numFiles; i++)
+  {
+    next[i] = (unsigned)(int)-1;
+    last[i] = i;
+  }
+  for (unsigned i = 0; i < numFiles; i++)
+  {
+    const unsigned rep = UniqIndex[i];
+    if (rep != i)
+    {
+      next[last[rep]] = i;
+      last[rep] = i;
+    }
+  }
+  for (unsigned i = 0; i < numFiles; i++)
+    if (UniqIndex[i] == i)
+      for (unsigned k = i; k != (unsigned)(int)-1; k = next[k])
+        order.AddInReserved(k);
+}
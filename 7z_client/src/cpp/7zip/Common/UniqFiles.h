@@ -0,0 +1,47 @@
+// UniqFiles.h
+
+#ifndef ZIP7_INC_UNIQ_FILES_H
+#define ZIP7_INC_UNIQ_FILES_H
+
+#include "../../Common/MyString.h"
+#include "../../Common/MyVector.h"
+
+/*
+CUniqFiles finds the files with identical content. It's like CUniqBlocks,
+but for whole files that are not loaded to memory:
+  1) only the files of same size can be identical. Other files are not read.
+  2) the candidates are hashed (CRC32) in several threads.
+  3) the files with same (size, CRC) are compared byte by byte with
+     the first file of group. So CRC collision can't join different files.
+Empty files and the files that can't be read are unique.
+CrcGenerateTable() must be called before Find().
+*/
+
+class CUniqFiles
+{
+  Z7_CLASS_NO_COPY(CUniqFiles)
+public:
+  unsigned NumThreads;
+
+  // (UniqIndex[i]) is the index of first file that has the same content as file (i).
+  // (UniqIndex[i] == i) for unique file and for first file of group.
+  CUIntVector UniqIndex;
+
+  // statistics
+  UInt64 NumHashedFiles;
+  UInt64 HashedBytes;
+  UInt64 NumDupFiles;  // the files that are not first in group
+  UInt64 DupBytes;
+  UInt32 NumReadErrors;
+
+  CUniqFiles(): NumThreads(4) { ClearStat(); }
+  void ClearStat();
+
+  HRESULT Find(const FStringVector &paths, const CRecordVector<UInt64> &sizes);
+
+  /* it returns the order, where each file of group follows
+     the first file of group, and other files keep source order. */
+  void GetAdjacentOrder(CUIntVector &order) const;
+};
+
+#endif
@@ -0,0 +1,230 @@
+// WriteBehindStream.cpp
+
+#include "StdAfx.h"
+
+#include <string.h>
+
+#include "StreamUtils.h"
+#include "WriteBehindStream.h"
+
+CWriteBehindWriter::CWriteBehindWriter():
+    _threadWasCreated(false),
+    _stop(false),
+    _bufSize(0),
+    _blocksStart(0),
+    _numBlocks(0)
+    {}
+
+CWriteBehindWriter::~CWriteBehindWriter()
+{
+  Destroy();
+}
+
+HRESULT CWriteBehindWriter::Create(unsigned numBufs, size_t bufSize)
+{
+  Destroy();
+  if (numBufs == 0 || bufSize == 0)
+    return E_INVALIDARG;
+  _bufSize = bufSize;
+  _bufs.Clear();
+  _freeBufs.Clear();
+  for (unsigned i = 0; i < numBufs; i++)
+  {
+    _bufs.AddNew().Alloc(bufSize);
+    _freeBufs.Add(i);
+  }
+  _blocks.ClearAndSetSize(numBufs);
+  _blocksStart = 0;
+  _numBlocks = 0;
+  _stop = false;
+  try
+  {
+    _thread = std::thread(&CWriteBehindWriter::ThreadFunc, this);
+  }
+  catch(...)
+  {
+    return E_FAIL;
+  }
+  _threadWasCreated = true;
+  return S_OK;
+}
+
+void CWriteBehindWriter::Destroy()
+{
+  if (!_threadWasCreated)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cond.notify_all();
+  // the thread writes all remaining blocks before exit
+  _thread.join();
+  _threadWasCreated = false;
+}
+
+void CWriteBehindWriter::ThreadFunc()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  for (;;)
+  {
+    _cond.wait(lock, [this] { return _numBlocks != 0 || _stop; });
+    if (_numBlocks == 0)
+      return;
+    // the block stays in ring until it's written, so the order of blocks is kept
+    const CBlock block = _blocks[_blocksStart];
+    CWriteBehindOutStream *stream = block.Stream;
+    HRESULT res = stream->_writeRes;
+    lock.unlock();
+
+    // if there was error for that stream, we skip all its next blocks
+    if (res == S_OK)
+      res = WriteStream(stream->_file, _bufs[block.BufIndex], block.Size);
+
+    lock.lock();
+    if (res != S_OK && stream->_writeRes == S_OK)
+      stream->_writeRes = res;
+    if (++_blocksStart == _blocks.Size())
+      _blocksStart = 0;
+    _numBlocks--;
+    _freeBufs.Add(block.BufIndex);
+    stream->_numPending--;
+    _cond.notify_all();
+  }
+}
+
+unsigned CWriteBehindWriter::AllocBuf()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cond.wait(lock, [this] { return !_freeBufs.IsEmpty(); });
+  const unsigned bufIndex = _freeBufs.Back();
+  _freeBufs.DeleteBack();
+  return bufIndex;
+}
+
+void CWriteBehindWriter::FreeBuf(unsigned bufIndex)
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _freeBufs.Add(bufIndex);
+  }
+  _cond.notify_all();
+}
+
+HRESULT CWriteBehindWriter::SubmitBuf(CWriteBehindOutStream *stream, unsigned bufIndex, size_t size)
+{
+  HRESULT res;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    unsigned pos = _blocksStart + _numBlocks;
+    if (pos >= _blocks.Size())
+      pos -= _blocks.Size();
+    CBlock &block = _blocks[pos];
+    block.Stream = stream;
+    block.BufIndex = bufIndex;
+    block.Size = size;
+    _numBlocks++;
+    stream->_numPending++;
+    res = stream->_writeRes;
+  }
+  _cond.notify_all();
+  return res;
+}
+
+HRESULT CWriteBehindWriter::WaitStream(CWriteBehindOutStream *stream)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cond.wait(lock, [stream] { return stream->_numPending == 0; });
+  return stream->_writeRes;
+}
+
+
+CWriteBehindOutStream::~CWriteBehindOutStream()
+{
+  // background thread can't use the stream after destruction
+  Flush();
+}
+
+void CWriteBehindOutStream::Init(CWriteBehindWriter *writer, COutFileStream *fileSpec)
+{
+  _writer = writer;
+  _fileSpec = fileSpec;
+  _file = fileSpec;
+  _bufIndex = -1;
+  _bufPos = 0;
+  _numPending = 0;
+  _writeRes = S_OK;
+  _mTimeDefined = false;
+  ProcessedSize = 0;
+}
+
+HRESULT CWriteBehindOutStream::SubmitCurBuf()
+{
+  if (_bufIndex < 0)
+    return S_OK;
+  const unsigned bufIndex = (unsigned)_bufIndex;
+  _bufIndex = -1;
+  if (_bufPos == 0)
+  {
+    _writer->FreeBuf(bufIndex);
+    return S_OK;
+  }
+  return _writer->SubmitBuf(this, bufIndex, _bufPos);
+}
+
+Z7_COM7F_IMF(CWriteBehindOutStream::Write(const void *data, UInt32 size, UInt32 *processedSize))
+{
+  if (processedSize)
+    *processedSize = 0;
+  if (!_writer)
+    return E_FAIL;
+  const size_t bufSize = _writer->GetBufSize();
+  while (size != 0)
+  {
+    if (_bufIndex < 0)
+    {
+      _bufIndex = (int)_writer->AllocBuf();
+      _bufPos = 0;
+    }
+    size_t cur = bufSize - _bufPos;
+    if (cur > size)
+      cur = size;
+    memcpy(_writer->GetBuf((unsigned)_bufIndex) + _bufPos, data, cur);
+    _bufPos += cur;
+    data = (const void *)((const Byte *)data + cur);
+    size -= (UInt32)cur;
+    ProcessedSize += cur;
+    if (processedSize)
+      *processedSize += (UInt32)cur;
+    if (_bufPos == bufSize)
+    {
+      RINOK(SubmitCurBuf())
+    }
+  }
+  return S_OK;
+}
+
+HRESULT CWriteBehindOutStream::Flush()
+{
+  if (!_writer)
+    return S_OK;
+  // we must wait for all pending blocks even after error
+  SubmitCurBuf();
+  return _writer->WaitStream(this);
+}
+
+HRESULT CWriteBehindOutStream::Close()
+{
+  if (!_fileSpec)
+    return S_OK;
+  HRESULT res = Flush();
+  _writer = NULL;
+  if (_mTimeDefined)
+    _fileSpec->SetMTime(&_mTime);
+  const HRESULT res2 = _fileSpec->Close();
+  _fileSpec = NULL;
+  _file.Release();
+  if (res == S_OK)
+    res = res2;
+  return res;
+}
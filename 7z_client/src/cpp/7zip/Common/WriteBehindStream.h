@@ -0,0 +1,131 @@
+// WriteBehindStream.h
+
+#ifndef ZIP7_INC_WRITE_BEHIND_STREAM_H
+#define ZIP7_INC_WRITE_BEHIND_STREAM_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "../../Common/MyBuffer.h"
+#include "../../Common/MyCom.h"
+#include "../../Common/MyVector.h"
+
+#include "FileStreams.h"
+
+class CWriteBehindOutStream;
+
+/*
+CWriteBehindWriter contains fixed pool of (numBufs) buffers of (bufSize) bytes
+and one I/O thread that writes filled buffers to files.
+The decoder thread copies data to free buffer and continues decoding,
+while I/O thread writes previous buffers to disk.
+One writer can be used by many CWriteBehindOutStream objects sequentially
+(one stream for each extracted file).
+*/
+
+class CWriteBehindWriter
+{
+  Z7_CLASS_NO_COPY(CWriteBehindWriter)
+
+  friend class CWriteBehindOutStream;
+
+  struct CBlock
+  {
+    CWriteBehindOutStream *Stream;
+    unsigned BufIndex;
+    size_t Size;
+  };
+
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::thread _thread;
+  bool _threadWasCreated;
+  bool _stop;
+
+  size_t _bufSize;
+  CObjectVector<CByteBuffer> _bufs;
+  CRecordVector<unsigned> _freeBufs;
+  // FIFO ring of filled buffers. The number of filled buffers can't be larger than (_bufs.Size())
+  CRecordVector<CBlock> _blocks;
+  unsigned _blocksStart;
+  unsigned _numBlocks;
+
+  void ThreadFunc();
+
+  unsigned AllocBuf();
+  HRESULT SubmitBuf(CWriteBehindOutStream *stream, unsigned bufIndex, size_t size);
+  void FreeBuf(unsigned bufIndex);
+  HRESULT WaitStream(CWriteBehindOutStream *stream);
+  Byte *GetBuf(unsigned bufIndex) { return _bufs[bufIndex]; }
+public:
+  CWriteBehindWriter();
+  ~CWriteBehindWriter();
+
+  bool IsCreated() const { return _threadWasCreated; }
+  size_t GetBufSize() const { return _bufSize; }
+  HRESULT Create(unsigned numBufs = 4, size_t bufSize = (size_t)1 << 22);
+  void Destroy();
+};
+
+
+/*
+CWriteBehindOutStream keeps semantics of COutFileStream:
+  ProcessedSize : the number of bytes accepted by Write().
+      All these bytes are written to file, if Close() returns S_OK.
+  SetMTime()    : the time is set after all data was written.
+  Close()       : waits for all data of the stream, sets time and closes file.
+  Write() returns the error of previous background write operation.
+*/
+
+Z7_CLASS_IMP_COM_1(
+  CWriteBehindOutStream
+  , ISequentialOutStream
+)
+  friend class CWriteBehindWriter;
+
+  CWriteBehindWriter *_writer;
+  COutFileStream *_fileSpec;
+  CMyComPtr<IOutStream> _file;
+
+  int _bufIndex;
+  size_t _bufPos;
+
+  // these members are protected by writer's mutex
+  unsigned _numPending;
+  HRESULT _writeRes;
+
+  bool _mTimeDefined;
+  CFiTime _mTime;
+
+  HRESULT SubmitCurBuf();
+public:
+  UInt64 ProcessedSize;
+
+  CWriteBehindOutStream():
+      _writer(NULL),
+      _fileSpec(NULL),
+      _bufIndex(-1),
+      _bufPos(0),
+      _numPending(0),
+      _writeRes(S_OK),
+      _mTimeDefined(false),
+      ProcessedSize(0)
+      {}
+  ~CWriteBehindOutStream();
+
+  void Init(CWriteBehindWriter *writer, COutFileStream *fileSpec);
+
+  bool SetMTime(const CFiTime *mTime)
+  {
+    _mTimeDefined = (mTime != NULL);
+    if (mTime)
+      _mTime = *mTime;
+    return true;
+  }
+
+  HRESULT Flush();
+  HRESULT Close();
+};
+
+#endif
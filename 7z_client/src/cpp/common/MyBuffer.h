@@ -113,6 +113,17 @@ public:
       memset(_items, 0, _size * sizeof(T));
   }
 
+  // it exchanges the memory blocks without copying of data
+  void Swap(CBuffer &buffer)
+  {
+    T *items = _items;
+    _items = buffer._items;
+    buffer._items = items;
+    const size_t size = _size;
+    _size = buffer._size;
+    buffer._size = size;
+  }
+
   CBuffer& operator=(const CBuffer &buffer)
   {
     if (&buffer != this)
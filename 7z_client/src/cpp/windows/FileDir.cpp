@@ -262,6 +262,34 @@ bool MyMoveFile(CFSTR oldFile, CFSTR newFile)
   return false;
 }
 
+bool MyReplaceFile(CFSTR oldFile, CFSTR newFile)
+{
+  #ifndef _UNICODE
+  if (!g_IsNT)
+  {
+    if (::MoveFileEx(fs2fas(oldFile), fs2fas(newFile), MOVEFILE_REPLACE_EXISTING))
+      return true;
+  }
+  else
+  #endif
+  {
+    IF_USE_MAIN_PATH_2(oldFile, newFile)
+    {
+      if (::MoveFileExW(fs2us(oldFile), fs2us(newFile), MOVEFILE_REPLACE_EXISTING))
+        return true;
+    }
+    #ifdef Z7_LONG_PATH
+    if (USE_SUPER_PATH_2)
+    {
+      UString d1, d2;
+      if (GetSuperPaths(oldFile, newFile, d1, d2, USE_MAIN_PATH_2))
+        return BOOLToBool(::MoveFileExW(d1, d2, MOVEFILE_REPLACE_EXISTING));
+    }
+    #endif
+  }
+  return false;
+}
+
 #if defined(Z7_WIN32_WINNT_MIN) && Z7_WIN32_WINNT_MIN >= 0x0500
 static DWORD WINAPI CopyProgressRoutine_to_ICopyFileProgress(
   LARGE_INTEGER TotalFileSize,          // file size
@@ -1114,6 +1142,12 @@ bool MyMoveFile(CFSTR oldFile, CFSTR newFile)
   return MyMoveFile_with_Progress(oldFile, newFile, NULL);
 }
 
+bool MyReplaceFile(CFSTR oldFile, CFSTR newFile)
+{
+  // rename() replaces existing (newFile) atomically
+  return (rename(oldFile, newFile) == 0);
+}
+
 
 bool CreateDir(CFSTR path)
 {
@@ -68,6 +68,10 @@ DECLARE_INTERFACE(ICopyFileProgress)
 Z7_PURE_INTERFACES_END
 
 bool MyMoveFile(CFSTR existFileName, CFSTR newFileName);
+/* MyReplaceFile() renames (oldFile) to (newFile) that can exist.
+   The old (newFile) is replaced in one operation: it's not deleted before.
+   Both files must be on same volume. */
+bool MyReplaceFile(CFSTR oldFile, CFSTR newFile);
 // (progress == NULL) is allowed
 bool MyMoveFile_with_Progress(CFSTR oldFile, CFSTR newFile,
     ICopyFileProgress *progress);
@@ -106,6 +106,7 @@ void CFileInfoBase::ClearBase() throw()
   uid = 0;
   gid = 0;
   rdev = 0;
+  blocks = 0;
  #endif
 }
 
@@ -1179,6 +1180,7 @@ void CFileInfoBase::SetFrom_stat(const struct stat &st)
   uid = st.st_uid;
   gid = st.st_gid;
   rdev = st.st_rdev;
+  blocks = st.st_blocks;
 
   /*
   printf("\n sizeof timespec = %d", (int)sizeof(timespec));
@@ -94,6 +94,7 @@ public:
   uid_t uid;     /* user ID of owner */
   gid_t gid;     /* group ID of owner */
   dev_t rdev;    /* device ID (defined, if S_ISCHR(mode) || S_ISBLK(mode)) */
+  blkcnt_t blocks; /* number of 512-byte blocks allocated: it's smaller than (Size) for sparse file */
   // bool Use_lstat;
  #endif
 
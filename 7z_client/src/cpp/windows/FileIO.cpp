@@ -508,6 +508,48 @@ bool CInFile::Read(void *data, UInt32 size, UInt32 &processedSize) throw()
   return true;
 }
 
+bool CInFile::ReadPart_AtPos(UInt64 position, void *data, UInt32 size, UInt32 &processedSize) throw()
+{
+  if (size > kChunkSizeMax)
+    size = kChunkSizeMax;
+  OVERLAPPED overlapped;
+  memset(&overlapped, 0, sizeof(overlapped));
+  overlapped.Offset = (DWORD)position;
+  overlapped.OffsetHigh = (DWORD)(position >> 32);
+  DWORD processedLoc = 0;
+  const bool res = BOOLToBool(::ReadFile(_handle, data, size, &processedLoc, &overlapped));
+  processedSize = (UInt32)processedLoc;
+  if (!res && ::GetLastError() == ERROR_HANDLE_EOF)
+    return true;
+  return res;
+}
+
+bool CInFile::GetPhysicalOffset(UInt64 &offset) const throw()
+{
+  offset = 0;
+ #ifdef UNDER_CE
+  return false;
+ #else
+  STARTING_VCN_INPUT_BUFFER in;
+  in.StartingVcn.QuadPart = 0;
+  // we need only first extent. So ERROR_MORE_DATA is OK.
+  RETRIEVAL_POINTERS_BUFFER out;
+  memset(&out, 0, sizeof(out));
+  DWORD bytesReturned = 0;
+  if (!DeviceIoControl(FSCTL_GET_RETRIEVAL_POINTERS, &in, sizeof(in), &out, sizeof(out), &bytesReturned))
+    if (::GetLastError() != ERROR_MORE_DATA)
+      return false;
+  if (out.ExtentCount == 0)
+    return false;
+  // (Lcn == -1) for compressed and sparse ranges
+  const LONGLONG lcn = out.Extents[0].Lcn.QuadPart;
+  if (lcn < 0)
+    return false;
+  offset = (UInt64)lcn;
+  return true;
+ #endif
+}
+
 bool CInFile::ReadFull(void *data, size_t size, size_t &processedSize) throw()
 {
   processedSize = 0;
@@ -618,6 +660,18 @@ bool COutFile::SetLength_KeepPosition(UInt64 length) throw()
   return (result && result2);
 }
 
+bool COutFile::Preallocate(UInt64 size) throw()
+{
+  FILE_ALLOCATION_INFO info;
+  info.AllocationSize.QuadPart = (LONGLONG)size;
+  return BOOLToBool(::SetFileInformationByHandle(_handle, FileAllocationInfo, &info, sizeof(info)));
+}
+
+bool COutFile::Sync() throw()
+{
+  return BOOLToBool(::FlushFileBuffers(_handle));
+}
+
 }}}
 
 #else // _WIN32
@@ -625,9 +679,28 @@ bool COutFile::SetLength_KeepPosition(UInt64 length) throw()
 
 // POSIX
 
+#include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#endif
+
+#ifdef Z7_USE_IO_URING
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
 namespace NWindows {
 namespace NFile {
 
@@ -740,6 +813,7 @@ bool CFileBase::SeekToBegin() const throw()
 
 bool CInFile::Open(const char *name)
 {
+  Set_DirectIO(false);
   return CFileBase::OpenBinary(name, O_RDONLY);
 }
 
@@ -778,10 +852,353 @@ read(), write() (and similar system calls) will transfer at most
 
 static const size_t kChunkSizeMax = ((size_t)1 << 22);
 
+#ifdef Z7_USE_IO_URING
+
+/////////////////////////
+// CIoUring
+
+CIoUring::CIoUring():
+    _fd(-1),
+    _numEntries(0),
+    _numToSubmit(0),
+    _numInFlight(0),
+    _sqRing(NULL),
+    _cqRing(NULL),
+    _sqes(NULL),
+    _sqRingSize(0),
+    _cqRingSize(0),
+    _sqesSize(0),
+    _sqHead(NULL),
+    _sqTail(NULL),
+    _sqMask(NULL),
+    _sqArray(NULL),
+    _cqHead(NULL),
+    _cqTail(NULL),
+    _cqMask(NULL),
+    _cqes(NULL)
+    {}
+
+static void *MapRing(int fd, size_t size, off_t offset)
+{
+  void *p = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+bool CIoUring::Create(unsigned numEntries) throw()
+{
+  Close();
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  const int fd = (int)::syscall(__NR_io_uring_setup, numEntries, &p);
+  if (fd < 0)
+    return false;
+  _fd = fd;
+  _numEntries = p.sq_entries;
+
+  _sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  _cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  // new kernels map both rings with one mmap() call
+  const bool singleMmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (singleMmap)
+  {
+    if (_sqRingSize < _cqRingSize)
+      _sqRingSize = _cqRingSize;
+    _cqRingSize = _sqRingSize;
+  }
+  _sqRing = MapRing(fd, _sqRingSize, IORING_OFF_SQ_RING);
+  if (_sqRing)
+    _cqRing = singleMmap ? _sqRing : MapRing(fd, _cqRingSize, IORING_OFF_CQ_RING);
+  _sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+  if (_cqRing)
+    _sqes = MapRing(fd, _sqesSize, IORING_OFF_SQES);
+  if (!_sqes)
+  {
+    Close();
+    return false;
+  }
+
+  Byte *sq = (Byte *)_sqRing;
+  _sqHead  = (unsigned *)(void *)(sq + p.sq_off.head);
+  _sqTail  = (unsigned *)(void *)(sq + p.sq_off.tail);
+  _sqMask  = (unsigned *)(void *)(sq + p.sq_off.ring_mask);
+  _sqArray = (unsigned *)(void *)(sq + p.sq_off.array);
+  Byte *cq = (Byte *)_cqRing;
+  _cqHead  = (unsigned *)(void *)(cq + p.cq_off.head);
+  _cqTail  = (unsigned *)(void *)(cq + p.cq_off.tail);
+  _cqMask  = (unsigned *)(void *)(cq + p.cq_off.ring_mask);
+  _cqes    = (void *)(cq + p.cq_off.cqes);
+  return true;
+}
+
+void CIoUring::Close() throw()
+{
+  if (_fd == -1)
+    return;
+  // Close() can be called after error. So we keep (errno) of that error.
+  const int error = errno;
+  if (_sqes)
+    ::munmap(_sqes, _sqesSize);
+  if (_cqRing && _cqRing != _sqRing)
+    ::munmap(_cqRing, _cqRingSize);
+  if (_sqRing)
+    ::munmap(_sqRing, _sqRingSize);
+  ::close(_fd);
+  _fd = -1;
+  _sqRing = NULL;
+  _cqRing = NULL;
+  _sqes = NULL;
+  _numEntries = 0;
+  _numToSubmit = 0;
+  _numInFlight = 0;
+  errno = error;
+}
+
+bool CIoUring::RegisterBuffers(void * const *bufs, unsigned numBufs, size_t bufSize) throw()
+{
+  CRecordVector<struct iovec> iovecs;
+  try
+  {
+    iovecs.ClearAndSetSize(numBufs);
+  }
+  catch(...)
+  {
+    SetLastError(ENOMEM);
+    return false;
+  }
+  for (unsigned i = 0; i < numBufs; i++)
+  {
+    iovecs[i].iov_base = bufs[i];
+    iovecs[i].iov_len = bufSize;
+  }
+  return ::syscall(__NR_io_uring_register, _fd, IORING_REGISTER_BUFFERS, iovecs.ConstData(), numBufs) == 0;
+}
+
+bool CIoUring::Add(Byte opCode, int fd, void *buf, size_t size, UInt64 pos, unsigned bufIndex, UInt64 userData) throw()
+{
+  // the number of requests in flight is limited by (_numEntries). So the completion ring can't overflow.
+  const unsigned tail = *_sqTail;
+  const unsigned head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+  if (tail - head >= _numEntries || _numInFlight >= _numEntries)
+    return false;
+  const unsigned index = tail & *_sqMask;
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *)_sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opCode;
+  sqe->fd = fd;
+  sqe->addr = (UInt64)(uintptr_t)buf;
+  sqe->len = (UInt32)size;
+  sqe->off = pos;
+  sqe->buf_index = (UInt16)bufIndex;
+  sqe->user_data = userData;
+  _sqArray[index] = index;
+  __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+  _numToSubmit++;
+  _numInFlight++;
+  return true;
+}
+
+bool CIoUring::Add_Read(int fd, void *buf, size_t size, UInt64 pos, unsigned bufIndex, UInt64 userData) throw()
+{
+  return Add(IORING_OP_READ_FIXED, fd, buf, size, pos, bufIndex, userData);
+}
+
+bool CIoUring::Add_Write(int fd, const void *buf, size_t size, UInt64 pos, unsigned bufIndex, UInt64 userData) throw()
+{
+  return Add(IORING_OP_WRITE_FIXED, fd, (void *)buf, size, pos, bufIndex, userData);
+}
+
+int CIoUring::Enter(unsigned numToSubmit, unsigned minComplete) throw()
+{
+  for (;;)
+  {
+    // the kernel returns EINTR only, if no request was submitted
+    const int res = (int)::syscall(__NR_io_uring_enter, _fd, numToSubmit, minComplete,
+        minComplete != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (res >= 0 || errno != EINTR)
+      return res;
+  }
+}
+
+bool CIoUring::Submit() throw()
+{
+  while (_numToSubmit != 0)
+  {
+    const int res = Enter(_numToSubmit, 0);
+    if (res < 0)
+      return false;
+    if (res == 0)
+    {
+      SetLastError(EAGAIN);
+      return false;
+    }
+    _numToSubmit -= (unsigned)res;
+  }
+  return true;
+}
+
+unsigned CIoUring::Remove_NotSubmitted() throw()
+{
+  // the kernel reads the submission ring only in io_uring_enter(). So we can move the tail back.
+  const unsigned num = _numToSubmit;
+  __atomic_store_n(_sqTail, *_sqTail - num, __ATOMIC_RELEASE);
+  _numToSubmit = 0;
+  _numInFlight -= num;
+  return num;
+}
+
+bool CIoUring::GetCompletion(UInt64 &userData, Int32 &result, bool wait) throw()
+{
+  for (;;)
+  {
+    const unsigned head = *_cqHead;
+    const unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    if (head != tail)
+    {
+      const struct io_uring_cqe *cqe = (const struct io_uring_cqe *)_cqes + (head & *_cqMask);
+      userData = cqe->user_data;
+      result = cqe->res;
+      __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+      _numInFlight--;
+      return true;
+    }
+    if (!wait || _numInFlight == 0)
+    {
+      SetLastError(0);
+      return false;
+    }
+    const int res = Enter(_numToSubmit, 1);
+    if (res < 0)
+      return false;
+    _numToSubmit -= (unsigned)res;
+  }
+}
+
+#endif // Z7_USE_IO_URING
+
+
+// it changes O_DIRECT and other status flags of opened file
+static bool SetStatusFlag(int fd, int flag, bool enable)
+{
+  const int flags = ::fcntl(fd, F_GETFL);
+  if (flags == -1)
+    return false;
+  const int newFlags = enable ? (flags | flag) : (flags & ~flag);
+  return newFlags == flags || ::fcntl(fd, F_SETFL, newFlags) != -1;
+}
+
+static Byte *AllocDirectBuf(size_t &size)
+{
+  size = (size + kDirectIoAlign - 1) & ~(kDirectIoAlign - 1);
+  if (size == 0)
+    size = kDirectIoAlign;
+  void *p = NULL;
+  if (::posix_memalign(&p, kDirectIoAlign, size) != 0)
+  {
+    SetLastError(ENOMEM);
+    return NULL;
+  }
+  return (Byte *)p;
+}
+
+bool CInFile::Set_DirectIO(bool enable, size_t bufSize) throw()
+{
+  if (!enable)
+  {
+    if (!_directBuf)
+      return true;
+    ::free(_directBuf);
+    _directBuf = NULL;
+    _directBufFilled = 0;
+   #ifdef O_DIRECT
+    if (_handle != -1)
+      return SetStatusFlag(_handle, O_DIRECT, false);
+   #endif
+    return true;
+  }
+ #ifdef O_DIRECT
+  if (_handle == -1)
+  {
+    SetLastError(EBADF);
+    return false;
+  }
+  Set_DirectIO(false);
+  Byte *buf = AllocDirectBuf(bufSize);
+  if (!buf)
+    return false;
+  // some file systems (tmpfs) don't support O_DIRECT: fcntl() returns EINVAL
+  if (!SetStatusFlag(_handle, O_DIRECT, true))
+  {
+    ::free(buf);
+    return false;
+  }
+  _directBuf = buf;
+  _directBufSize = bufSize;
+  _directBufFilled = 0;
+  _directBufPos = 0;
+  return true;
+ #else
+  UNUSED_VAR(bufSize)
+  SetLastError(ENOTSUP);
+  return false;
+ #endif
+}
+
+ssize_t CInFile::pread_direct(void *data, size_t size, UInt64 position) throw()
+{
+  const size_t mask = kDirectIoAlign - 1;
+  if (_directBufFilled == 0
+      || position < _directBufPos
+      || position >= _directBufPos + _directBufFilled)
+  {
+    if ((position & mask) == 0 && ((size_t)(uintptr_t)data & mask) == 0 && size >= kDirectIoAlign)
+    {
+      // the aligned read goes to the buffer of caller
+      size &= ~mask;
+      ssize_t res;
+      do
+      {
+        res = ::pread(_handle, data, size, (off_t)position);
+      }
+      while (res < 0 && errno == EINTR);
+      return res;
+    }
+    const UInt64 alignedPos = position & ~(UInt64)mask;
+    ssize_t res;
+    do
+    {
+      res = ::pread(_handle, _directBuf, _directBufSize, (off_t)alignedPos);
+    }
+    while (res < 0 && errno == EINTR);
+    _directBufFilled = 0;
+    if (res < 0)
+      return res;
+    _directBufPos = alignedPos;
+    _directBufFilled = (size_t)res;
+    if (position >= alignedPos + (size_t)res)
+      return 0;
+  }
+  size_t rem = (size_t)(_directBufPos + _directBufFilled - position);
+  if (rem > size)
+    rem = size;
+  memcpy(data, _directBuf + (size_t)(position - _directBufPos), rem);
+  return (ssize_t)rem;
+}
+
 ssize_t CInFile::read_part(void *data, size_t size) throw()
 {
   if (size > kChunkSizeMax)
     size = kChunkSizeMax;
+  if (_directBuf)
+  {
+    // pread_direct() doesn't change the file pointer. So we move it here.
+    const off_t pos = ::lseek(_handle, 0, SEEK_CUR);
+    if (pos == -1)
+      return -1;
+    const ssize_t res = pread_direct(data, size, (UInt64)pos);
+    if (res > 0 && ::lseek(_handle, pos + (off_t)res, SEEK_SET) == -1)
+      return -1;
+    return res;
+  }
   return ::read(_handle, data, size);
 }
 
@@ -803,12 +1220,115 @@ bool CInFile::ReadFull(void *data, size_t size, size_t &processed) throw()
   return true;
 }
 
+ssize_t CInFile::pread_part(void *data, size_t size, UInt64 position) throw()
+{
+  if (size > kChunkSizeMax)
+    size = kChunkSizeMax;
+  if (_directBuf)
+    return pread_direct(data, size, position);
+  ssize_t res;
+  do
+  {
+    res = ::pread(_handle, data, size, (off_t)position);
+  }
+  while (res < 0 && errno == EINTR);
+  return res;
+}
+
+bool CInFile::AdviseSequential() throw()
+{
+ #ifdef POSIX_FADV_SEQUENTIAL
+  return ::posix_fadvise(_handle, 0, 0, POSIX_FADV_SEQUENTIAL) == 0;
+ #else
+  return true;
+ #endif
+}
+
+bool CInFile::ReadAhead(UInt64 position, UInt64 size) throw()
+{
+ #if defined(__linux__) && defined(_GNU_SOURCE)
+  return ::readahead(_handle, (off64_t)position, (size_t)size) == 0;
+ #elif defined(POSIX_FADV_WILLNEED)
+  return ::posix_fadvise(_handle, (off_t)position, (off_t)size, POSIX_FADV_WILLNEED) == 0;
+ #else
+  UNUSED_VAR(position)
+  UNUSED_VAR(size)
+  return true;
+ #endif
+}
+
+bool CInFile::GetPhysicalOffset(UInt64 &offset) const throw()
+{
+  offset = 0;
+ #if defined(__linux__) && defined(FS_IOC_FIEMAP)
+  // we need only first extent: (struct fiemap) is followed by one (struct fiemap_extent)
+  UInt64 buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / 8 + 1];
+  memset(buf, 0, sizeof(buf));
+  struct fiemap *fm = (struct fiemap *)(void *)buf;
+  fm->fm_start = 0;
+  fm->fm_length = ~(__u64)0;
+  fm->fm_flags = 0;
+  fm->fm_extent_count = 1;
+  if (::ioctl(_handle, FS_IOC_FIEMAP, fm) != 0)
+    return false;
+  if (fm->fm_mapped_extents == 0
+      || (fm->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN) != 0)
+    return false;
+  offset = fm->fm_extents[0].fe_physical;
+  return true;
+ #else
+  return false;
+ #endif
+}
+
+bool CInFile::GetDataRange(UInt64 position, UInt64 &dataStart, UInt64 &dataEnd) throw()
+{
+  dataStart = position;
+  dataEnd = position;
+ #ifdef SEEK_DATA
+  // lseek(SEEK_DATA) changes the position of file. So we restore it.
+  const off_t cur = ::lseek(_handle, 0, SEEK_CUR);
+  if (cur == -1)
+    return false;
+  bool res = true;
+  const off_t start = ::lseek(_handle, (off_t)position, SEEK_DATA);
+  if (start == -1)
+  {
+    // ENXIO : there is no data after (position)
+    if (errno != ENXIO)
+      res = false;
+  }
+  else
+  {
+    const off_t end = ::lseek(_handle, start, SEEK_HOLE);
+    if (end == -1)
+      res = false;
+    else
+    {
+      dataStart = (UInt64)start;
+      dataEnd = (UInt64)end;
+    }
+  }
+  const int err = errno;
+  if (::lseek(_handle, cur, SEEK_SET) == -1)
+    return false;
+  errno = err;
+  return res;
+ #else
+  errno = ENOTSUP;
+  return false;
+ #endif
+}
+
 
 /////////////////////////
 // COutFile
 
 bool COutFile::OpenBinary_forWrite_oflag(const char *name, int oflag)
 {
+  // the buffered data is written to old file
+  WriteQueue_Free();
+  Set_DirectIO(false);
   Path = name; // change it : set it only if open is success.
   return OpenBinary(name, oflag, mode_for_Create);
 }
@@ -872,8 +1392,428 @@ ssize_t COutFile::write_part(const void *data, size_t size) throw()
   return ::write(_handle, data, size);
 }
 
+#ifdef Z7_USE_IO_URING
+
+struct COutFile::CWriteQueue
+{
+  CIoUring Ring;
+  CObjectVector<CByteBuffer> Bufs;
+  CRecordVector<UInt64> BufPos;
+  CRecordVector<size_t> BufSizes;
+  CRecordVector<bool> BufIsBusy;
+  size_t BufSize;
+  unsigned CurBuf;  // the buffer that is being filled
+  size_t CurSize;
+  UInt64 Pos;       // the file position of (CurBuf)
+  bool PosDefined;
+  int Error;        // the first error of asynchronous writes
+};
+
+bool COutFile::WriteQueue_Create(unsigned numBufs, size_t bufSize) throw()
+{
+  WriteQueue_Free();
+  if (_handle == -1 || _directBuf || numBufs == 0 || bufSize == 0 || bufSize > ((UInt32)1 << 31))
+  {
+    SetLastError(EINVAL);
+    return false;
+  }
+  CWriteQueue *q = NULL;
+  try
+  {
+    q = new CWriteQueue;
+    q->BufSize = bufSize;
+    q->CurBuf = 0;
+    q->CurSize = 0;
+    q->Pos = 0;
+    q->PosDefined = false;
+    q->Error = 0;
+    for (unsigned i = 0; i < numBufs; i++)
+    {
+      q->Bufs.AddNew().Alloc(bufSize);
+      q->BufPos.Add(0);
+      q->BufSizes.Add(0);
+      q->BufIsBusy.Add(false);
+    }
+  }
+  catch(...)
+  {
+    delete q;
+    SetLastError(ENOMEM);
+    return false;
+  }
+  CRecordVector<void *> bufs;
+  bool res = q->Ring.Create(numBufs);
+  if (res)
+  {
+    for (unsigned i = 0; i < numBufs; i++)
+      bufs.Add((Byte *)q->Bufs[i]);
+    res = q->Ring.RegisterBuffers(bufs.ConstData(), numBufs, bufSize);
+  }
+  if (!res)
+  {
+    delete q;
+    return false;
+  }
+  _writeQueue = q;
+  return true;
+}
+
+// it handles one finished write. The short write is completed with pwrite().
+static void WriteQueue_OnCompletion(int handle, CRecordVector<bool> &isBusy,
+    const CObjectVector<CByteBuffer> &bufs, const CRecordVector<UInt64> &bufPos,
+    const CRecordVector<size_t> &bufSizes, UInt64 userData, Int32 result, int &error)
+{
+  const unsigned index = (unsigned)userData;
+  isBusy[index] = false;
+  if (result < 0)
+  {
+    if (error == 0)
+      error = -result;
+    return;
+  }
+  size_t done = (size_t)result;
+  while (done < bufSizes[index])
+  {
+    const ssize_t res = ::pwrite(handle, bufs[index] + done, bufSizes[index] - done, (off_t)(bufPos[index] + done));
+    if (res <= 0)
+    {
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (error == 0)
+        error = (res < 0) ? errno : EIO;
+      return;
+    }
+    done += (size_t)res;
+  }
+}
+
+ssize_t COutFile::WriteQueue_Write(const void *data, size_t size, size_t &processed) throw()
+{
+  CWriteQueue &q = *_writeQueue;
+  processed = 0;
+  if (q.Error != 0)
+  {
+    SetLastError((DWORD)q.Error);
+    return -1;
+  }
+  if (!q.PosDefined)
+  {
+    const off_t pos = ::lseek(_handle, 0, SEEK_CUR);
+    if (pos == -1)
+      return -1;
+    q.Pos = (UInt64)pos;
+    q.PosDefined = true;
+  }
+  while (size != 0)
+  {
+    if (q.CurSize == 0)
+    {
+      // we wait until the kernel has finished the write from that buffer
+      while (q.BufIsBusy[q.CurBuf])
+      {
+        UInt64 userData;
+        Int32 result;
+        if (!q.Ring.GetCompletion(userData, result, true))
+          return -1;
+        WriteQueue_OnCompletion(_handle, q.BufIsBusy, q.Bufs, q.BufPos, q.BufSizes, userData, result, q.Error);
+      }
+    }
+    size_t cur = q.BufSize - q.CurSize;
+    if (cur > size)
+      cur = size;
+    memcpy(q.Bufs[q.CurBuf] + q.CurSize, data, cur);
+    q.CurSize += cur;
+    data = (const void *)((const Byte *)data + cur);
+    size -= cur;
+    processed += cur;
+    if (q.CurSize == q.BufSize)
+    {
+      const unsigned index = q.CurBuf;
+      q.BufPos[index] = q.Pos;
+      q.BufSizes[index] = q.CurSize;
+      if (!q.Ring.Add_Write(_handle, q.Bufs[index], q.CurSize, q.Pos, index, index)
+          || !q.Ring.Submit())
+        return -1;
+      q.BufIsBusy[index] = true;
+      q.Pos += q.CurSize;
+      q.CurSize = 0;
+      if (++q.CurBuf == q.Bufs.Size())
+        q.CurBuf = 0;
+    }
+  }
+  return (ssize_t)processed;
+}
+
+bool COutFile::WriteQueue_Flush() throw()
+{
+  if (!_writeQueue)
+    return true;
+  CWriteQueue &q = *_writeQueue;
+  bool res = true;
+  if (q.CurSize != 0)
+  {
+    // the last part is written directly. The kernel writes other buffers at the same time.
+    const Byte *p = q.Bufs[q.CurBuf];
+    size_t rem = q.CurSize;
+    UInt64 pos = q.Pos;
+    while (rem != 0)
+    {
+      const ssize_t w = ::pwrite(_handle, p, rem, (off_t)pos);
+      if (w <= 0)
+      {
+        if (w < 0 && errno == EINTR)
+          continue;
+        if (q.Error == 0)
+          q.Error = (w < 0) ? errno : EIO;
+        break;
+      }
+      p += (size_t)w;
+      rem -= (size_t)w;
+      pos += (size_t)w;
+    }
+    q.Pos += q.CurSize;
+    q.CurSize = 0;
+  }
+  while (q.Ring.GetNumInFlight() != 0)
+  {
+    UInt64 userData;
+    Int32 result;
+    if (!q.Ring.GetCompletion(userData, result, true))
+    {
+      res = false;
+      break;
+    }
+    WriteQueue_OnCompletion(_handle, q.BufIsBusy, q.Bufs, q.BufPos, q.BufSizes, userData, result, q.Error);
+  }
+  if (q.PosDefined)
+  {
+    // seek() and write() of caller continue from the end of queued data
+    if (::lseek(_handle, (off_t)q.Pos, SEEK_SET) == -1)
+      res = false;
+    q.PosDefined = false;
+  }
+  if (q.Error != 0)
+  {
+    SetLastError((DWORD)q.Error);
+    q.Error = 0;
+    res = false;
+  }
+  return res;
+}
+
+void COutFile::WriteQueue_Free() throw()
+{
+  if (!_writeQueue)
+    return;
+  WriteQueue_Flush();
+  delete _writeQueue;
+  _writeQueue = NULL;
+}
+
+#else
+
+bool COutFile::WriteQueue_Create(unsigned /* numBufs */, size_t /* bufSize */) throw()
+{
+  SetLastError(ENOSYS);
+  return false;
+}
+
+bool COutFile::WriteQueue_Flush() throw() { return true; }
+void COutFile::WriteQueue_Free() throw() {}
+
+#endif // Z7_USE_IO_URING
+
+static bool pwrite_full(int handle, const Byte *data, size_t size, UInt64 pos)
+{
+  while (size != 0)
+  {
+    const ssize_t res = ::pwrite(handle, data, size, (off_t)pos);
+    if (res <= 0)
+    {
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res == 0)
+        SetLastError(EIO);
+      return false;
+    }
+    data += (size_t)res;
+    size -= (size_t)res;
+    pos += (size_t)res;
+  }
+  return true;
+}
+
+bool COutFile::Set_DirectIO(bool enable, size_t bufSize) throw()
+{
+  if (!enable)
+  {
+    if (!_directBuf)
+      return true;
+    bool res = DirectIO_Flush();
+    ::free(_directBuf);
+    _directBuf = NULL;
+   #ifdef O_DIRECT
+    if (_handle != -1 && !SetStatusFlag(_handle, O_DIRECT, false))
+      res = false;
+   #endif
+    return res;
+  }
+ #ifdef O_DIRECT
+  if (_handle == -1 || WriteQueue_IsEnabled())
+  {
+    SetLastError(_handle == -1 ? EBADF : EINVAL);
+    return false;
+  }
+  if (!Set_DirectIO(false))
+    return false;
+  // the tail of file is padded only after the end of file
+  struct stat st;
+  if (my_fstat(&st) != 0)
+    return false;
+  Byte *buf = AllocDirectBuf(bufSize);
+  if (!buf)
+    return false;
+  // some file systems (tmpfs) don't support O_DIRECT: fcntl() returns EINVAL
+  if (!SetStatusFlag(_handle, O_DIRECT, true))
+  {
+    ::free(buf);
+    return false;
+  }
+  _directBuf = buf;
+  _directBufSize = bufSize;
+  _directPosDefined = false;
+  _directFileSize = (UInt64)st.st_size;
+  return true;
+ #else
+  UNUSED_VAR(bufSize)
+  SetLastError(ENOTSUP);
+  return false;
+ #endif
+}
+
+// it writes the data from bounce buffer. The buffer is not changed except zero padding.
+bool COutFile::WriteDirectBuf() throw()
+{
+ #ifdef O_DIRECT
+  const size_t mask = kDirectIoAlign - 1;
+  const size_t end = _directEnd;
+  size_t cur = _directStart;
+  const UInt64 base = _directBufPos;
+  bool res = true;
+  if ((cur & mask) != 0)
+  {
+    // the first sector contains old data of file. So we write that part through page cache.
+    size_t headEnd = (cur | mask) + 1;
+    if (headEnd > end)
+      headEnd = end;
+    if (!SetStatusFlag(_handle, O_DIRECT, false))
+      return false;
+    res = pwrite_full(_handle, _directBuf + cur, headEnd - cur, base + cur);
+    if (!SetStatusFlag(_handle, O_DIRECT, true))
+      res = false;
+    cur = headEnd;
+  }
+  const size_t alignedEnd = end & ~mask;
+  if (res && cur < alignedEnd)
+  {
+    res = pwrite_full(_handle, _directBuf + cur, alignedEnd - cur, base + cur);
+    cur = alignedEnd;
+  }
+  if (res && cur < end)
+  {
+    if (base + end >= _directFileSize)
+    {
+      // the tail is at the end of file: we write full sector with zero padding,
+      // and then we truncate the file to real size.
+      const size_t paddedEnd = (end + mask) & ~mask;
+      memset(_directBuf + end, 0, paddedEnd - end);
+      res = pwrite_full(_handle, _directBuf + cur, paddedEnd - cur, base + cur);
+      if (res)
+        res = (ftruncate(_handle, (off_t)(base + end)) == 0);
+    }
+    else
+    {
+      if (!SetStatusFlag(_handle, O_DIRECT, false))
+        return false;
+      res = pwrite_full(_handle, _directBuf + cur, end - cur, base + cur);
+      if (!SetStatusFlag(_handle, O_DIRECT, true))
+        res = false;
+    }
+  }
+  if (res && _directFileSize < base + end)
+    _directFileSize = base + end;
+  return res;
+ #else
+  return false;
+ #endif
+}
+
+ssize_t COutFile::write_direct(const void *data, size_t size, size_t &processed) throw()
+{
+  processed = 0;
+  if (!_directPosDefined)
+  {
+    const off_t pos = ::lseek(_handle, 0, SEEK_CUR);
+    if (pos == -1)
+      return -1;
+    const size_t mask = kDirectIoAlign - 1;
+    _directBufPos = (UInt64)pos & ~(UInt64)mask;
+    _directStart = (size_t)pos & mask;
+    _directEnd = _directStart;
+    _directPosDefined = true;
+  }
+  while (size != 0)
+  {
+    if (_directEnd == _directBufSize)
+    {
+      // full buffer is aligned at the end. So only the start can be written through page cache.
+      if (!WriteDirectBuf())
+        return -1;
+      _directBufPos += _directBufSize;
+      _directStart = 0;
+      _directEnd = 0;
+    }
+    size_t cur = _directBufSize - _directEnd;
+    if (cur > size)
+      cur = size;
+    memcpy(_directBuf + _directEnd, data, cur);
+    _directEnd += cur;
+    data = (const void *)((const Byte *)data + cur);
+    size -= cur;
+    processed += cur;
+  }
+  return (ssize_t)processed;
+}
+
+bool COutFile::DirectIO_Flush() throw()
+{
+  if (!_directBuf || !_directPosDefined)
+    return true;
+  const UInt64 end = _directBufPos + _directEnd;
+  bool res = WriteDirectBuf();
+  _directPosDefined = false;
+  // seek() and write() of caller continue from the end of buffered data
+  if (::lseek(_handle, (off_t)end, SEEK_SET) == -1)
+    res = false;
+  return res;
+}
+
+bool COutFile::FlushBuffers() throw()
+{
+  bool res = DirectIO_Flush();
+  if (!WriteQueue_Flush())
+    res = false;
+  return res;
+}
+
 ssize_t COutFile::write_full(const void *data, size_t size, size_t &processed) throw()
 {
+  if (_directBuf)
+    return write_direct(data, size, processed);
+ #ifdef Z7_USE_IO_URING
+  if (_writeQueue)
+    return WriteQueue_Write(data, size, processed);
+ #endif
   processed = 0;
   do
   {
@@ -892,6 +1832,8 @@ ssize_t COutFile::write_full(const void *data, size_t size, size_t &processed) t
 
 bool COutFile::SetLength(UInt64 length) throw()
 {
+  if (!FlushBuffers())
+    return false;
   const off_t len2 = (off_t)length;
   if ((Int64)length != len2)
   {
@@ -900,11 +1842,115 @@ bool COutFile::SetLength(UInt64 length) throw()
   }
   // The value of the seek pointer shall not be modified by a call to ftruncate().
   const int iret = ftruncate(_handle, len2);
-  return (iret == 0);
+  if (iret != 0)
+    return false;
+  _directFileSize = length;
+  return true;
+}
+
+bool COutFile::Preallocate(UInt64 size) throw()
+{
+ #ifdef __linux__
+  const off_t len2 = (off_t)size;
+  if ((Int64)size != len2)
+  {
+    SetLastError(EFBIG);
+    return false;
+  }
+  return fallocate(_handle, FALLOC_FL_KEEP_SIZE, 0, len2) == 0;
+ #else
+  UNUSED_VAR(size)
+  SetLastError(ENOTSUP);
+  return false;
+ #endif
+}
+
+// the size of reflink blocks: the positions for FICLONERANGE must be aligned for file system
+static const UInt64 kCloneAlign = (UInt64)1 << 12;
+
+bool COutFile::CopyRange(CInFile &src, UInt64 srcPos, UInt64 size, UInt64 &processed) throw()
+{
+  processed = 0;
+  if (!FlushBuffers())
+    return false;
+ #ifdef __linux__
+  const off_t destPos = ::lseek(_handle, 0, SEEK_CUR);
+  if (destPos == -1)
+    return false;
+
+ #ifdef FICLONERANGE
+  if (((srcPos | (UInt64)destPos | size) & (kCloneAlign - 1)) == 0 && size != 0)
+  {
+    struct file_clone_range range;
+    range.src_fd = src.GetHandle();
+    range.src_offset = srcPos;
+    range.src_length = size;
+    range.dest_offset = (UInt64)destPos;
+    if (::ioctl(_handle, FICLONERANGE, &range) == 0)
+    {
+      // FICLONERANGE doesn't change the position of file
+      if (::lseek(_handle, (off_t)((UInt64)destPos + size), SEEK_SET) == -1)
+        return false;
+      processed = size;
+      return true;
+    }
+    // EXDEV, EOPNOTSUPP, EINVAL: we try copy_file_range()
+  }
+ #endif
+
+ #ifdef __NR_copy_file_range
+  Int64 inPos = (Int64)srcPos;
+  while (size != 0)
+  {
+    size_t cur = (size_t)1 << 30;
+    if (cur > size)
+      cur = (size_t)size;
+    // glibc before 2.27 has no wrapper. So we call it via syscall()
+    const long res = ::syscall(__NR_copy_file_range,
+        src.GetHandle(), &inPos, _handle, (Int64 *)NULL, cur, 0u);
+    if (res < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    // end of (src) file
+    if (res == 0)
+      break;
+    processed += (UInt64)res;
+    size -= (UInt64)res;
+  }
+  return true;
+ #else
+  UNUSED_VAR(src)
+  UNUSED_VAR(srcPos)
+  UNUSED_VAR(size)
+  SetLastError(ENOTSUP);
+  return false;
+ #endif
+
+ #else
+  UNUSED_VAR(src)
+  UNUSED_VAR(srcPos)
+  UNUSED_VAR(size)
+  SetLastError(ENOTSUP);
+  return false;
+ #endif
+}
+
+bool COutFile::Sync() throw()
+{
+  if (!FlushBuffers())
+    return false;
+  return fsync(_handle) == 0;
 }
 
 bool COutFile::Close()
 {
+  const bool flushRes = FlushBuffers();
+  const DWORD flushError = flushRes ? 0 : ::GetLastError();
+  WriteQueue_Free();
+  Set_DirectIO(false);
   const bool res = CFileBase::Close();
   if (!res)
     return res;
@@ -915,6 +1961,11 @@ bool COutFile::Close()
         ATime_defined ? &ATime : NULL,
         MTime_defined ? &MTime : NULL);
   }
+  if (!flushRes)
+  {
+    SetLastError(flushError);
+    return false;
+  }
   return res;
 }
 
@@ -24,6 +24,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+// io_uring is used for batched reads and writes. Define Z7_NO_IO_URING to disable it.
+#if defined(__linux__) && !defined(Z7_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define Z7_USE_IO_URING
+#endif
+#endif
+
 #endif
 
 #include "../Common/MyString.h"
@@ -303,6 +310,33 @@ public:
   bool ReadPart(void *data, UInt32 size, UInt32 &processedSize) throw();
   bool Read(void *data, UInt32 size, UInt32 &processedSize) throw();
   bool ReadFull(void *data, size_t size, size_t &processedSize) throw();
+
+  /* ReadPart_AtPos() reads from (position) with OVERLAPPED structure.
+     It can be called from another thread, but it changes the file pointer,
+     so the caller must not mix it with ReadPart() calls. */
+  bool ReadPart_AtPos(UInt64 position, void *data, UInt32 size, UInt32 &processedSize) throw();
+  // the hints are not supported after CreateFile() call. We return true.
+  bool AdviseSequential() throw() { return true; }
+  bool ReadAhead(UInt64 /* position */, UInt64 /* size */) throw() { return true; }
+  /* GetPhysicalOffset() returns the position of first extent of file on volume
+     (LCN from FSCTL_GET_RETRIEVAL_POINTERS). It returns false for empty,
+     resident, compressed and sparse files, and if the file system doesn't support it. */
+  bool GetPhysicalOffset(UInt64 &offset) const throw();
+  // the search of holes (SEEK_DATA / SEEK_HOLE) is not supported in Windows
+  bool GetDataRange(UInt64 /* position */, UInt64 & /* dataStart */, UInt64 & /* dataEnd */) throw()
+  {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return false;
+  }
+  // direct I/O mode (O_DIRECT) is not supported in Windows
+  bool Set_DirectIO(bool enable, size_t /* bufSize */ = (size_t)1 << 20) throw()
+  {
+    if (!enable)
+      return true;
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return false;
+  }
+  bool IsDirectIO() const { return false; }
 };
 
 class COutFile: public CFileBase
@@ -331,6 +365,44 @@ public:
   bool SetEndOfFile() throw();
   bool SetLength(UInt64 length) throw();
   bool SetLength_KeepPosition(UInt64 length) throw();
+  /* Preallocate() reserves disk space for (size) bytes (FileAllocationInfo).
+     The end of file is not changed. Unused space is released, when file is closed. */
+  bool Preallocate(UInt64 size) throw();
+  // the copy of file ranges in kernel (copy_file_range / FICLONERANGE) is not supported in Windows
+  bool CopyRange(CInFile & /* src */, UInt64 /* srcPos */, UInt64 /* size */, UInt64 &processed) throw()
+  {
+    processed = 0;
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return false;
+  }
+  // Sync() writes the cached data of file to disk (FlushFileBuffers).
+  bool Sync() throw();
+  // the write queue (io_uring) is not supported in Windows
+  bool WriteQueue_Create(unsigned /* numBufs */, size_t /* bufSize */ = (size_t)1 << 20) throw()
+  {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return false;
+  }
+  bool WriteQueue_Flush() throw() { return true; }
+  bool WriteQueue_IsEnabled() const { return false; }
+  bool Set_DirectIO(bool enable, size_t /* bufSize */ = (size_t)1 << 20) throw()
+  {
+    if (!enable)
+      return true;
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return false;
+  }
+  bool IsDirectIO() const { return false; }
+  bool FlushBuffers() throw() { return true; }
+
+  /* SetSparse() sets sparse attribute (FSCTL_SET_SPARSE) for file.
+     Then the ranges that were skipped by Seek() past end of file are not allocated on disk.
+     It returns false, if file system doesn't support sparse files (FAT). */
+  bool SetSparse() throw()
+  {
+    DWORD bytesReturned;
+    return DeviceIoControl(FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytesReturned);
+  }
 };
 
 }
@@ -347,6 +419,70 @@ bool GetReparseData(CFSTR path, CByteBuffer &reparseData);
 bool SetSymLink(CFSTR from, CFSTR to);
 bool SetSymLink_UString(CFSTR from, const UString &to);
 
+#ifdef Z7_USE_IO_URING
+
+/*
+CIoUring is minimal io_uring queue (raw syscalls, liburing is not required).
+Only the reads and writes to registered buffers (READ_FIXED / WRITE_FIXED) are supported.
+Create() returns false, if io_uring is not supported by kernel or
+if it's disabled (seccomp, kernel.io_uring_disabled). Then the caller uses read() / write().
+The object must be used from one thread.
+*/
+
+class CIoUring
+{
+  Z7_CLASS_NO_COPY(CIoUring)
+
+  int _fd;
+  unsigned _numEntries;
+  unsigned _numToSubmit;
+  unsigned _numInFlight;
+  void *_sqRing;
+  void *_cqRing;
+  void *_sqes;
+  size_t _sqRingSize;
+  size_t _cqRingSize;
+  size_t _sqesSize;
+  unsigned *_sqHead;
+  unsigned *_sqTail;
+  unsigned *_sqMask;
+  unsigned *_sqArray;
+  unsigned *_cqHead;
+  unsigned *_cqTail;
+  unsigned *_cqMask;
+  void *_cqes;
+
+  bool Add(Byte opCode, int fd, void *buf, size_t size, UInt64 pos, unsigned bufIndex, UInt64 userData) throw();
+  int Enter(unsigned numToSubmit, unsigned minComplete) throw();
+public:
+  CIoUring();
+  ~CIoUring() { Close(); }
+  bool IsCreated() const { return _fd != -1; }
+  unsigned GetNumEntries() const { return _numEntries; }
+  unsigned GetNumInFlight() const { return _numInFlight; }
+
+  bool Create(unsigned numEntries) throw();
+  void Close() throw();
+  // the buffers are locked in memory, until Close() is called
+  bool RegisterBuffers(void * const *bufs, unsigned numBufs, size_t bufSize) throw();
+
+  // Add_*() return false, if the queue is full. Submit() sends all added requests to kernel.
+  bool Add_Read(int fd, void *buf, size_t size, UInt64 pos, unsigned bufIndex, UInt64 userData) throw();
+  bool Add_Write(int fd, const void *buf, size_t size, UInt64 pos, unsigned bufIndex, UInt64 userData) throw();
+  bool Submit() throw();
+  /* Remove_NotSubmitted() removes the added requests that were not sent to kernel
+     (after Submit() failure). It returns the number of removed requests.
+     These requests were added last. */
+  unsigned Remove_NotSubmitted() throw();
+
+  /* GetCompletion() returns the result of one finished request:
+     (result) is number of processed bytes or (-errno).
+     If (wait == false) and there is no finished request, it returns false and sets error 0. */
+  bool GetCompletion(UInt64 &userData, Int32 &result, bool wait) throw();
+};
+
+#endif
+
 
 class CFileBase
 {
@@ -380,6 +516,7 @@ public:
   off_t seekToCur() const throw();
   // bool SeekToBegin() throw();
   int my_fstat(struct stat *st) const  { return fstat(_handle, st); }
+  int GetHandle() const { return _handle; }
   /*
   int my_ioctl_BLKGETSIZE64(unsigned long long *val);
   int GetDeviceSize_InBytes(UInt64 &size);
@@ -387,9 +524,27 @@ public:
   */
 };
 
+/*
+Direct I/O mode (O_DIRECT) bypasses the page cache. The file position, size
+of requests and the address of buffers must be aligned for O_DIRECT.
+So CInFile and COutFile use aligned bounce buffer for unaligned requests.
+Default alignment (kDirectIoAlign) is 4 KiB, that is enough for 512-byte and 4K sectors.
+*/
+
+const size_t kDirectIoAlign = (size_t)1 << 12;
+
 class CInFile: public CFileBase
 {
+  // bounce buffer of direct I/O mode: it contains the data from (_directBufPos)
+  Byte *_directBuf;
+  size_t _directBufSize;
+  size_t _directBufFilled;
+  UInt64 _directBufPos;
+  ssize_t pread_direct(void *data, size_t size, UInt64 position) throw();
 public:
+  CInFile(): _directBuf(NULL), _directBufSize(0), _directBufFilled(0), _directBufPos(0) {}
+  ~CInFile() { Set_DirectIO(false); }
+
   bool Open(const char *name);
   bool OpenShared(const char *name, bool shareForWrite);
 #if 0
@@ -404,6 +559,31 @@ public:
   ssize_t read_part(void *data, size_t size) throw();
   // ssize_t read_full(void *data, size_t size, size_t &processed);
   bool ReadFull(void *data, size_t size, size_t &processedSize) throw();
+  // pread_part() doesn't change the file position. It can be called from another thread.
+  ssize_t pread_part(void *data, size_t size, UInt64 position) throw();
+  // posix_fadvise(POSIX_FADV_SEQUENTIAL) for whole file
+  bool AdviseSequential() throw();
+  // readahead() in linux, posix_fadvise(POSIX_FADV_WILLNEED) in another systems
+  bool ReadAhead(UInt64 position, UInt64 size) throw();
+  /* GetPhysicalOffset() returns the physical position of first extent of file
+     (FIEMAP in linux). It returns false, if it's not supported or if file is empty. */
+  bool GetPhysicalOffset(UInt64 &offset) const throw();
+  /* GetDataRange() returns the first range of data at (position) or after it
+     (SEEK_DATA / SEEK_HOLE). The ranges between data ranges are holes of sparse file.
+     If there is no data after (position), it returns (dataStart == dataEnd == position).
+     The position of file is not changed.
+     If file system doesn't support the search of holes, whole file is one data range. */
+  bool GetDataRange(UInt64 position, UInt64 &dataStart, UInt64 &dataEnd) throw();
+
+  /* Set_DirectIO() enables O_DIRECT mode for opened file.
+     Aligned reads (position, size and address) go directly to the buffer of caller.
+     Other reads use the bounce buffer of (bufSize) bytes, that also works as
+     read-ahead for small sequential reads.
+     In direct mode read_part() and pread_part() use same bounce buffer.
+     So they must not be called from different threads at the same time.
+     It returns false, if O_DIRECT is not supported by OS or by file system (tmpfs). */
+  bool Set_DirectIO(bool enable, size_t bufSize = (size_t)1 << 20) throw();
+  bool IsDirectIO() const { return _directBuf != NULL; }
 };
 
 class COutFile: public CFileBase
@@ -416,6 +596,27 @@ class COutFile: public CFileBase
   CFiTime MTime;
 
   AString Path;
+ #ifdef Z7_USE_IO_URING
+  struct CWriteQueue;
+  CWriteQueue *_writeQueue;
+  ssize_t WriteQueue_Write(const void *data, size_t size, size_t &processed) throw();
+ #endif
+
+  /* bounce buffer of direct I/O mode:
+     _directBuf[i] is the data for file position (_directBufPos + i).
+     (_directBufPos) is aligned. The data is in [_directStart, _directEnd) range.
+     (_directPosDefined == false) means empty buffer. */
+  Byte *_directBuf;
+  size_t _directBufSize;
+  size_t _directStart;
+  size_t _directEnd;
+  UInt64 _directBufPos;
+  UInt64 _directFileSize;
+  bool _directPosDefined;
+  ssize_t write_direct(const void *data, size_t size, size_t &processed) throw();
+  bool WriteDirectBuf() throw();
+  bool DirectIO_Flush() throw();
+
   ssize_t write_part(const void *data, size_t size) throw();
   bool OpenBinary_forWrite_oflag(const char *name, int oflag);
 public:
@@ -425,8 +626,56 @@ public:
       CTime_defined(false),
       ATime_defined(false),
       MTime_defined(false),
+     #ifdef Z7_USE_IO_URING
+      _writeQueue(NULL),
+     #endif
+      _directBuf(NULL),
+      _directBufSize(0),
+      _directStart(0),
+      _directEnd(0),
+      _directBufPos(0),
+      _directFileSize(0),
+      _directPosDefined(false),
       mode_for_Create(0666)
       {}
+  ~COutFile()
+  {
+    WriteQueue_Free();
+    Set_DirectIO(false);
+  }
+
+  /* WriteQueue_Create() enables asynchronous writes through io_uring for opened file:
+     write_full() copies data to one of (numBufs) registered buffers of (bufSize) bytes,
+     and full buffers are written with explicit file position, while the caller fills next buffer.
+     It returns false, if io_uring is not available. Then write() is used.
+     WriteQueue_Flush() writes all buffered data and sets the file pointer
+     to the end of written data. FlushBuffers() calls it. */
+  bool WriteQueue_Create(unsigned numBufs, size_t bufSize = (size_t)1 << 20) throw();
+  bool WriteQueue_Flush() throw();
+  void WriteQueue_Free() throw();
+  bool WriteQueue_IsEnabled() const
+  {
+   #ifdef Z7_USE_IO_URING
+    return _writeQueue != NULL;
+   #else
+    return false;
+   #endif
+  }
+
+  /* Set_DirectIO() enables O_DIRECT mode for opened file.
+     write_full() collects the data in aligned bounce buffer of (bufSize) bytes,
+     and full buffers are written with O_DIRECT.
+     The unaligned start of data is written through page cache, because that sector contains old data.
+     The unaligned tail at the end of file is written as full sector with zero padding,
+     and then the file is truncated to real size (SetLength).
+     Direct mode and write queue can't be used at the same time.
+     It returns false, if O_DIRECT is not supported by OS or by file system (tmpfs). */
+  bool Set_DirectIO(bool enable, size_t bufSize = (size_t)1 << 20) throw();
+  bool IsDirectIO() const { return _directBuf != NULL; }
+
+  /* FlushBuffers() writes the data from bounce buffer of direct mode and from write queue.
+     It must be called before seek() and GetLength(). Close(), SetLength() and Sync() call it. */
+  bool FlushBuffers() throw();
 
   bool Close();
 
@@ -453,6 +702,21 @@ public:
   {
     return SetLength(length);
   }
+  /* Preallocate() reserves disk space for (size) bytes (fallocate with FALLOC_FL_KEEP_SIZE).
+     The size of file is not changed. It returns false, if it's not supported.
+     Call SetLength(size) to release unused space. */
+  bool Preallocate(UInt64 size) throw();
+  /* CopyRange() copies (size) bytes from (src) file at (srcPos) to current position of file
+     without the copy to user space. In linux it tries FICLONERANGE (reflink: the blocks are shared),
+     if the positions and (size) are aligned for file system, and then copy_file_range().
+     The position of (src) is not changed. The position of file is moved by (processed) bytes.
+     It returns false, if it's not supported for these files (another file system, old kernel).
+     Then the caller must copy the rest of data by itself. */
+  bool CopyRange(CInFile &src, UInt64 srcPos, UInt64 size, UInt64 &processed) throw();
+  // the ranges that were skipped by seek() past end of file are holes in posix file systems.
+  bool SetSparse() throw() { return true; }
+  // Sync() writes the cached data of file to disk (fsync).
+  bool Sync() throw();
   bool SetTime(const CFiTime *cTime, const CFiTime *aTime, const CFiTime *mTime) throw();
   bool SetMTime(const CFiTime *mTime) throw();
 };
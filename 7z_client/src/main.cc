@@ -4,12 +4,20 @@
 
 #include <stdio.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "cpp/Common/MyWindows.h"
 #include "cpp/Common/MyInitGuid.h"
 
 #include "cpp/Common/Defs.h"
 #include "cpp/Common/IntToString.h"
 #include "cpp/Common/StringConvert.h"
+#include "cpp/Common/Wildcard.h"
 
 #include "cpp/Windows/DLL.h"
 #include "cpp/Windows/FileDir.h"
@@ -19,7 +27,18 @@
 #include "cpp/Windows/PropVariant.h"
 #include "cpp/Windows/PropVariantConv.h"
 
+#include "cpp/7zip/Common/ArcDetector.h"
+#include "cpp/7zip/Common/ArcLibrary.h"
 #include "cpp/7zip/Common/FileStreams.h"
+#include "cpp/7zip/Common/GrowBufOutStream.h"
+#include "cpp/7zip/Common/InFilePrefetcher.h"
+#include "cpp/7zip/Common/LimitedStreams.h"
+#include "cpp/7zip/Common/MappedInStream.h"
+#include "cpp/7zip/Common/MultiVolInStream.h"
+#include "cpp/7zip/Common/ProgressReporter.h"
+#include "cpp/7zip/Common/StreamUtils.h"
+#include "cpp/7zip/Common/UniqFiles.h"
+#include "cpp/7zip/Common/WriteBehindStream.h"
 
 #include "cpp/7zip/Archive/IArchive.h"
 
@@ -29,7 +48,9 @@
 #endif
 
 #include "cpp/7zip/IPassword.h"
+#include "C/7zCrc.h"
 #include "C/7zVersion.h"
+#include "C/CpuArch.h"
 
 #ifdef _WIN32
 extern
@@ -57,7 +78,9 @@ enum
   kId_Chm = 0xE9,
 };
 
-// use another id, if you want to support other formats (zip, Xz, ...).
+// the format of new archives in (a) command.
+// Existing archives are opened by CArcDetector that selects the handler by signature.
+// use another id, if you want to create other formats (zip, Xz, ...).
  //DEFINE_GUID_ARC (CLSID_Format, kId_Zip)
 // DEFINE_GUID_ARC (CLSID_Format, kId_BZip2)
 // DEFINE_GUID_ARC (CLSID_Format, kId_Xz)
@@ -90,7 +113,9 @@ static const char * const kHelpString =
 "Examples:\n"
 "  7zcl.exe a archive.7z f1.txt f2.txt  : compress two files to archive.7z\n"
 "  7zcl.exe l archive.7z   : List contents of archive.7z\n"
-"  7zcl.exe x archive.7z   : eXtract files from archive.7z\n";
+"  7zcl.exe x archive.7z   : eXtract files from archive.7z\n"
+"  7zcl.exe b a1.7z a2.7z  : extract several archives in parallel (batch mode)\n"
+"  7zcl.exe m archive.7z   : extract files from archive.7z to Memory\n";
 
 
 static void Convert_UString_to_AString(const UString &s, AString &temp)
@@ -187,16 +212,22 @@ static const wchar_t * const kEmptyFileAlias = L"[Content]";
 // Archive Open callback class
 
 
+/* IArchiveOpenVolumeCallback: the handlers that support volumes request
+   the name of opened file and then the streams of next volumes by name.
+   The volumes are opened only when the handler requests them. */
+
 class CArchiveOpenCallback Z7_final:
   public IArchiveOpenCallback,
+  public IArchiveOpenVolumeCallback,
   public ICryptoGetTextPassword,
   public CMyUnknownImp
 {
-  Z7_IFACES_IMP_UNK_2(IArchiveOpenCallback, ICryptoGetTextPassword)
+  Z7_IFACES_IMP_UNK_3(IArchiveOpenCallback, IArchiveOpenVolumeCallback, ICryptoGetTextPassword)
 public:
 
   bool PasswordIsDefined;
   UString Password;
+  FString ArcPath; // the path of opened file
 
   CArchiveOpenCallback() : PasswordIsDefined(false) {}
 };
@@ -227,6 +258,50 @@ Z7_COM7F_IMF(CArchiveOpenCallback::CryptoGetTextPassword(BSTR *password))
   return StringToBstr(Password, password);
 }
 
+Z7_COM7F_IMF(CArchiveOpenCallback::GetProperty(PROPID propID, PROPVARIANT *value))
+{
+  NCOM::CPropVariant prop;
+  if (propID == kpidName)
+    prop = fs2us(ArcPath.Ptr((unsigned)(ArcPath.ReverseFind_PathSepar() + 1)));
+  prop.Detach(value);
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CArchiveOpenCallback::GetStream(const wchar_t *name, IInStream **inStream))
+{
+  *inStream = NULL;
+  // the volumes are in the directory of opened file
+  FString path = ArcPath.Left((unsigned)(ArcPath.ReverseFind_PathSepar() + 1));
+  path += us2fs(name);
+  NFind::CFileInfo fi;
+  if (!fi.Find(path))
+    return S_FALSE;
+  if (fi.IsDir())
+    return S_FALSE;
+  CInFileStream *inFileSpec = new CInFileStream;
+  CMyComPtr<IInStream> inFile(inFileSpec);
+  if (!inFileSpec->Open(path))
+    return GetLastError_noZero_HRESULT();
+  *inStream = inFile.Detach();
+  return S_OK;
+}
+
+/* the set of volumes (name.7z.001, name.7z.002, ...) is opened as one stream.
+   It returns S_FALSE, if (path) is not the name of first volume. */
+
+static HRESULT OpenInStream_Volumes(const FString &path, unsigned numPrefetchBufs, CMyComPtr<IInStream> &stream)
+{
+  if (!CMultiVolInStream::IsFirstVolumeName(path))
+    return S_FALSE;
+  CMultiVolInStream *volStreamSpec = new CMultiVolInStream;
+  CMyComPtr<IInStream> volStream = volStreamSpec;
+  volStreamSpec->NumPrefetchBufs = numPrefetchBufs;
+  const HRESULT res = volStreamSpec->Init(path);
+  if (res != S_OK)
+    return res == S_FALSE ? E_FAIL : res;
+  stream = volStream;
+  return S_OK;
+}
 
 
 static const char * const kIncorrectCommand = "incorrect command";
@@ -329,277 +404,1917 @@ struct CArcTime
 
 
 
-class CArchiveExtractCallback Z7_final:
-  public IArchiveExtractCallback,
-  public ICryptoGetTextPassword,
-  public CMyUnknownImp
+//////////////////////////////////////////////////////////////
+// Snapshot of items metadata
+
+/*
+  CArcItemsSnapshot reads the metadata of all items in one pass:
+  one GetProperty() call for each property of each item.
+  Then the list command and the extract callback use that snapshot
+  instead of new GetProperty() calls.
+  The data is stored as structure of arrays.
+  All paths are stored in one buffer (arena) separated by zero characters.
+*/
+
+class CArcItemsSnapshot
 {
-  Z7_IFACES_IMP_UNK_2(IArchiveExtractCallback, ICryptoGetTextPassword)
-  Z7_IFACE_COM7_IMP(IProgress)
-
-  CMyComPtr<IInArchive> _archiveHandler;
-  FString _directoryPath;  // Output directory
-  UString _filePath;       // name inside arcvhive
-  FString _diskFilePath;   // full path to file on disk
-  bool _extractMode;
-  struct CProcessedFileInfo
-  {
-    CArcTime MTime;
-    UInt32 Attrib;
-    bool isDir;
-    bool Attrib_Defined;
-  } _processedFileInfo;
-
-  COutFileStream *_outFileStreamSpec;
-  CMyComPtr<ISequentialOutStream> _outFileStream;
+  CBuffer<wchar_t> _pathChars;
+  size_t _pathCharsSize;
+  CRecordVector<size_t> _pathOffsets; // (NumItems + 1) offsets in _pathChars
 
+  void AddPath(const wchar_t *s, unsigned len);
 public:
-  void Init(IInArchive *archiveHandler, const FString &directoryPath);
-
-  UInt64 NumErrors;
-  bool PasswordIsDefined;
-  UString Password;
-
-  CArchiveExtractCallback() : PasswordIsDefined(false) {}
+  enum
+  {
+    kFlag_Dir             = 1 << 0,
+    kFlag_SizeDefined     = 1 << 1,
+    kFlag_PackSizeDefined = 1 << 2,
+    kFlag_AttribDefined   = 1 << 3,
+    kFlag_Stored          = 1 << 4  // HeaderOffsets[i] and CRCs[i] are defined
+  };
+
+  // the mask of properties for Load()
+  enum
+  {
+    kProp_Path     = 1 << 0,
+    kProp_Size     = 1 << 1,
+    kProp_PackSize = 1 << 2,
+    kProp_MTime    = 1 << 3,
+    kProp_Attrib   = 1 << 4,
+    kProp_IsDir    = 1 << 5,
+    kProp_All      = (1 << 6) - 1
+  };
+
+  CRecordVector<UInt64> Sizes;
+  CRecordVector<UInt64> PackSizes;
+  CRecordVector<CArcTime> MTimes;
+  CRecordVector<UInt32> Attribs;
+  CRecordVector<Byte> Flags;
+  // these vectors are filled only, if Load() was called with (loadStoredItems = true)
+  CRecordVector<UInt64> HeaderOffsets; // kpidOffset : the position of local header of zip item
+  CRecordVector<UInt32> CRCs;
+
+  CArcItemsSnapshot(): _pathCharsSize(0) {}
+
+  /* Load() calls GetProperty() only for the properties from (props) mask.
+     The vectors of other properties are filled with empty values (the paths are empty strings),
+     so the indexes are the same for all vectors.
+     if (loadStoredItems == true), Load() also reads kpidEncrypted, kpidMethod, kpidOffset and kpidCRC
+     of each item, and it marks the items that are stored without compression (kFlag_Stored).
+     (kpidOffset) is used as the position of local header. So it's allowed only for zip archives.
+     It requires the size, packed size and dir flag, so these properties are added to (props). */
+  HRESULT Load(IInArchive *archive, UInt32 props = kProp_All, bool loadStoredItems = false);
+
+  unsigned Size() const { return Flags.Size(); }
+  const wchar_t *GetPath(unsigned index) const { return (const wchar_t *)_pathChars + _pathOffsets[index]; }
+  unsigned GetPathLen(unsigned index) const
+    { return (unsigned)(_pathOffsets[index + 1] - _pathOffsets[index] - 1); }
+  void GetPath(unsigned index, UString &path) const { path.SetFrom(GetPath(index), GetPathLen(index)); }
+
+  bool IsDir(unsigned index) const { return (Flags[index] & kFlag_Dir) != 0; }
+  bool SizeDefined(unsigned index) const { return (Flags[index] & kFlag_SizeDefined) != 0; }
+  bool PackSizeDefined(unsigned index) const { return (Flags[index] & kFlag_PackSizeDefined) != 0; }
+  bool AttribDefined(unsigned index) const { return (Flags[index] & kFlag_AttribDefined) != 0; }
+  bool IsStored(unsigned index) const { return (Flags[index] & kFlag_Stored) != 0; }
 };
 
-void CArchiveExtractCallback::Init(IInArchive *archiveHandler, const FString &directoryPath)
+void CArcItemsSnapshot::AddPath(const wchar_t *s, unsigned len)
 {
-  NumErrors = 0;
-  _archiveHandler = archiveHandler;
-  _directoryPath = directoryPath;
-  NName::NormalizeDirPathPrefix(_directoryPath);
+  const size_t newSize = _pathCharsSize + len + 1;
+  if (newSize > _pathChars.Size())
+  {
+    size_t newCapacity = _pathChars.Size() * 2;
+    if (newCapacity < ((size_t)1 << 16))
+      newCapacity = (size_t)1 << 16;
+    if (newCapacity < newSize)
+      newCapacity = newSize;
+    _pathChars.ChangeSize_KeepData(newCapacity, _pathCharsSize);
+  }
+  wchar_t *dest = (wchar_t *)_pathChars + _pathCharsSize;
+  memcpy(dest, s, (size_t)len * sizeof(wchar_t));
+  dest[len] = 0;
+  _pathCharsSize = newSize;
+  _pathOffsets.Add(newSize);
 }
 
-Z7_COM7F_IMF(CArchiveExtractCallback::SetTotal(UInt64 /* size */))
+/* GetStoredItemInfo() returns (stored = true), if zip item is stored without compression
+   and encryption, and the handler reports the position of local header (kpidOffset) and CRC. */
+static HRESULT GetStoredItemInfo(IInArchive *archive, UInt32 index, bool &stored, UInt64 &offset, UInt32 &crc)
 {
+  stored = false;
+  offset = 0;
+  crc = 0;
+  {
+    NCOM::CPropVariant prop;
+    RINOK(archive->GetProperty(index, kpidEncrypted, &prop))
+    if (prop.vt == VT_BOOL && VARIANT_BOOLToBool(prop.boolVal))
+      return S_OK;
+  }
+  {
+    NCOM::CPropVariant prop;
+    RINOK(archive->GetProperty(index, kpidMethod, &prop))
+    if (prop.vt != VT_BSTR || !StringsAreEqualNoCase_Ascii(prop.bstrVal, "Store"))
+      return S_OK;
+  }
+  {
+    NCOM::CPropVariant prop;
+    RINOK(archive->GetProperty(index, kpidCRC, &prop))
+    // the copied data is checked with that CRC
+    if (prop.vt != VT_UI4)
+      return S_OK;
+    crc = prop.ulVal;
+  }
+  {
+    NCOM::CPropVariant prop;
+    RINOK(archive->GetProperty(index, kpidOffset, &prop))
+    stored = ConvertPropVariantToUInt64(prop, offset);
+  }
   return S_OK;
 }
 
-Z7_COM7F_IMF(CArchiveExtractCallback::SetCompleted(const UInt64 * /* completeValue */))
+HRESULT CArcItemsSnapshot::Load(IInArchive *archive, UInt32 props, bool loadStoredItems)
 {
-  return S_OK;
-}
+  if (loadStoredItems)
+    props |= kProp_Size | kProp_PackSize | kProp_IsDir;
+
+  Sizes.Clear();
+  PackSizes.Clear();
+  MTimes.Clear();
+  Attribs.Clear();
+  Flags.Clear();
+  HeaderOffsets.Clear();
+  CRCs.Clear();
+  _pathOffsets.Clear();
+  _pathCharsSize = 0;
+
+  UInt32 numItems = 0;
+  RINOK(archive->GetNumberOfItems(&numItems))
+  Sizes.ClearAndReserve(numItems);
+  PackSizes.ClearAndReserve(numItems);
+  MTimes.ClearAndReserve(numItems);
+  Attribs.ClearAndReserve(numItems);
+  Flags.ClearAndReserve(numItems);
+  if (loadStoredItems)
+  {
+    HeaderOffsets.ClearAndReserve(numItems);
+    CRCs.ClearAndReserve(numItems);
+  }
+  _pathOffsets.ClearAndReserve(numItems + 1);
+  _pathOffsets.AddInReserved(0);
 
-Z7_COM7F_IMF(CArchiveExtractCallback::GetStream(UInt32 index,
-    ISequentialOutStream **outStream, Int32 askExtractMode))
-{
-  *outStream = NULL;
-  _outFileStream.Release();
+  const unsigned kEmptyFileAliasLen = MyStringLen(kEmptyFileAlias);
 
+  /* the offsets of items can be relative to start of archive.
+     So the items of archive with header (SFX) are not marked as stored. */
+  bool arcAtStart = true;
+  if (loadStoredItems)
   {
-    // Get Name
     NCOM::CPropVariant prop;
-    RINOK(_archiveHandler->GetProperty(index, kpidPath, &prop))
-    
-    UString fullPath;
-    if (prop.vt == VT_EMPTY)
-      fullPath = kEmptyFileAlias;
+    RINOK(archive->GetArchiveProperty(kpidOffset, &prop))
+    UInt64 arcOffset = 0;
+    if (prop.vt == VT_I8)
+      arcOffset = (UInt64)prop.hVal.QuadPart;
     else
-    {
-      if (prop.vt != VT_BSTR)
-        return E_FAIL;
-      fullPath = prop.bstrVal;
-    }
-    _filePath = fullPath;
+      ConvertPropVariantToUInt64(prop, arcOffset);
+    arcAtStart = (arcOffset == 0);
   }
 
-  if (askExtractMode != NArchive::NExtract::NAskMode::kExtract)
-    return S_OK;
-
+  for (UInt32 i = 0; i < numItems; i++)
   {
-    // Get Attrib
-    NCOM::CPropVariant prop;
-    RINOK(_archiveHandler->GetProperty(index, kpidAttrib, &prop))
-    if (prop.vt == VT_EMPTY)
+    Byte flags = 0;
+    if (!(props & kProp_Path))
+      AddPath(L"", 0);
+    else
     {
-      _processedFileInfo.Attrib = 0;
-      _processedFileInfo.Attrib_Defined = false;
+      NCOM::CPropVariant prop;
+      RINOK(archive->GetProperty(i, kpidPath, &prop))
+      if (prop.vt == VT_BSTR)
+        AddPath(prop.bstrVal, ::SysStringLen(prop.bstrVal));
+      else if (prop.vt == VT_EMPTY)
+        AddPath(kEmptyFileAlias, kEmptyFileAliasLen);
+      else
+        return E_FAIL;
     }
-    else
+    if (props & kProp_IsDir)
     {
-      if (prop.vt != VT_UI4)
+      NCOM::CPropVariant prop;
+      RINOK(archive->GetProperty(i, kpidIsDir, &prop))
+      if (prop.vt == VT_BOOL)
+      {
+        if (VARIANT_BOOLToBool(prop.boolVal))
+          flags |= kFlag_Dir;
+      }
+      else if (prop.vt != VT_EMPTY)
         return E_FAIL;
-      _processedFileInfo.Attrib = prop.ulVal;
-      _processedFileInfo.Attrib_Defined = true;
     }
+    {
+      UInt64 v = 0;
+      if (props & kProp_Size)
+      {
+        NCOM::CPropVariant prop;
+        RINOK(archive->GetProperty(i, kpidSize, &prop))
+        if (ConvertPropVariantToUInt64(prop, v))
+          flags |= kFlag_SizeDefined;
+      }
+      Sizes.AddInReserved(v);
+    }
+    {
+      UInt64 v = 0;
+      if (props & kProp_PackSize)
+      {
+        NCOM::CPropVariant prop;
+        RINOK(archive->GetProperty(i, kpidPackSize, &prop))
+        if (ConvertPropVariantToUInt64(prop, v))
+          flags |= kFlag_PackSizeDefined;
+      }
+      PackSizes.AddInReserved(v);
+    }
+    {
+      CArcTime t;
+      t.Clear();
+      if (props & kProp_MTime)
+      {
+        NCOM::CPropVariant prop;
+        RINOK(archive->GetProperty(i, kpidMTime, &prop))
+        if (prop.vt == VT_FILETIME)
+          t.Set_From_Prop(prop);
+        else if (prop.vt != VT_EMPTY)
+          return E_FAIL;
+      }
+      MTimes.AddInReserved(t);
+    }
+    {
+      UInt32 v = 0;
+      if (props & kProp_Attrib)
+      {
+        NCOM::CPropVariant prop;
+        RINOK(archive->GetProperty(i, kpidAttrib, &prop))
+        if (prop.vt == VT_UI4)
+        {
+          v = prop.ulVal;
+          flags |= kFlag_AttribDefined;
+        }
+        else if (prop.vt != VT_EMPTY)
+          return E_FAIL;
+      }
+      Attribs.AddInReserved(v);
+    }
+    if (loadStoredItems)
+    {
+      UInt64 headerOffset = 0;
+      UInt32 crc = 0;
+      if (arcAtStart
+          && (flags & (kFlag_Dir | kFlag_SizeDefined | kFlag_PackSizeDefined))
+              == (kFlag_SizeDefined | kFlag_PackSizeDefined)
+          && Sizes.Back() != 0
+          && Sizes.Back() == PackSizes.Back())
+      {
+        bool stored;
+        RINOK(GetStoredItemInfo(archive, i, stored, headerOffset, crc))
+        if (stored)
+          flags |= kFlag_Stored;
+      }
+      HeaderOffsets.AddInReserved(headerOffset);
+      CRCs.AddInReserved(crc);
+    }
+    Flags.AddInReserved(flags);
   }
+  return S_OK;
+}
+
+
+
+//////////////////////////////////////////////////////////////
+// Machine-readable listing (NDJSON / CSV)
+
+enum EListFormat
+{
+  k_ListFormat_Text,
+  k_ListFormat_NDJSON,
+  k_ListFormat_CSV
+};
 
-  RINOK(IsArchiveItemFolder(_archiveHandler, index, _processedFileInfo.isDir))
+// the order of columns in output is the order of these bits.
+// The bits are the same as in the mask of CArcItemsSnapshot::Load().
+enum
+{
+  k_ListColumn_Path     = CArcItemsSnapshot::kProp_Path,
+  k_ListColumn_Size     = CArcItemsSnapshot::kProp_Size,
+  k_ListColumn_PackSize = CArcItemsSnapshot::kProp_PackSize,
+  k_ListColumn_MTime    = CArcItemsSnapshot::kProp_MTime,
+  k_ListColumn_Attrib   = CArcItemsSnapshot::kProp_Attrib,
+  k_ListColumn_IsDir    = CArcItemsSnapshot::kProp_IsDir
+};
+
+static const unsigned k_NumListColumns = 6;
+
+static const char * const k_ListColumnNames[k_NumListColumns] =
+{
+    "path"
+  , "size"
+  , "packed"
+  , "mtime"
+  , "attrib"
+  , "dir"
+};
+
+static const UInt32 k_ListColumns_Default =
+    k_ListColumn_Path
+  | k_ListColumn_Size
+  | k_ListColumn_MTime
+  | k_ListColumn_IsDir;
 
+// (s) is comma separated list of column names: "path,size,mtime"
+static bool ParseListColumns(const char *s, UInt32 &columns)
+{
+  columns = 0;
+  AString name;
+  for (;;)
   {
-    _processedFileInfo.MTime.Clear();
-    // Get Modified Time
-    NCOM::CPropVariant prop;
-    RINOK(_archiveHandler->GetProperty(index, kpidMTime, &prop))
-    switch (prop.vt)
+    const char c = *s++;
+    if (c != ',' && c != 0)
     {
-      case VT_EMPTY:
-        // _processedFileInfo.MTime = _utcMTimeDefault;
-        break;
-      case VT_FILETIME:
-        _processedFileInfo.MTime.Set_From_Prop(prop);
-        break;
-      default:
-        return E_FAIL;
+      name += c;
+      continue;
     }
-
+    unsigned i;
+    for (i = 0; i < k_NumListColumns; i++)
+      if (StringsAreEqualNoCase_Ascii(name, k_ListColumnNames[i]))
+        break;
+    if (i == k_NumListColumns)
+      return false;
+    columns |= (UInt32)1 << i;
+    name.Empty();
+    if (c == 0)
+      return true;
   }
+}
+
+
+/*
+  CStdOutBufWriter collects the output in big buffer and calls fwrite()
+  only when the buffer is full. Unicode paths are converted to UTF-8
+  directly into that buffer with the escaping required by output format.
+  So there are no temporary strings and no code page conversion per item.
+*/
+
+class CStdOutBufWriter
+{
+  Z7_CLASS_NO_COPY(CStdOutBufWriter)
+
+  FILE *_file;
+  CByteBuffer _buf;
+  size_t _pos;
+  bool _error;
+
+  // the maximum size of one encoded character: "\u001f" or 4-byte UTF-8 sequence
+  enum { kMaxCharSize = 8 };
+
+  char *GetSpace(size_t size)
   {
-    // Get Size
-    NCOM::CPropVariant prop;
-    RINOK(_archiveHandler->GetProperty(index, kpidSize, &prop))
-    UInt64 newFileSize;
-    /* bool newFileSizeDefined = */ ConvertPropVariantToUInt64(prop, newFileSize);
+    if (_buf.Size() - _pos < size)
+      Flush();
+    return (char *)(Byte *)_buf + _pos;
   }
-
-  
+public:
+  CStdOutBufWriter(FILE *file, size_t bufSize = (size_t)1 << 20):
+      _file(file), _pos(0), _error(false)
   {
-    // Create folders for file
-    int slashPos = _filePath.ReverseFind_PathSepar();
-    if (slashPos >= 0)
-      CreateComplexDir(_directoryPath + us2fs(_filePath.Left(slashPos)));
+    if (bufSize < ((size_t)1 << 12))
+      bufSize = (size_t)1 << 12;
+    _buf.Alloc(bufSize);
   }
+  ~CStdOutBufWriter() { Flush(); }
 
-  FString fullProcessedPath = _directoryPath + us2fs(_filePath);
-  _diskFilePath = fullProcessedPath;
+  bool Flush();
+  bool IsError() const { return _error; }
 
-  if (_processedFileInfo.isDir)
+  void Write(const char *s, size_t size);
+  void WriteString(const char *s) { Write(s, strlen(s)); }
+  void WriteChar(char c)
   {
-    CreateComplexDir(fullProcessedPath);
+    if (_pos == _buf.Size())
+      Flush();
+    _buf[_pos++] = (Byte)c;
   }
-  else
+  void WriteUInt64(UInt64 v)
   {
-    NFind::CFileInfo fi;
-    if (fi.Find(fullProcessedPath))
-    {
-      if (!DeleteFileAlways(fullProcessedPath))
-      {
-        PrintError("Cannot delete output file", fullProcessedPath);
-        return E_ABORT;
-      }
-    }
-    
-    _outFileStreamSpec = new COutFileStream;
-    CMyComPtr<ISequentialOutStream> outStreamLoc(_outFileStreamSpec);
-    if (!_outFileStreamSpec->Create_ALWAYS(fullProcessedPath))
-    {
-      PrintError("Cannot open output file", fullProcessedPath);
-      return E_ABORT;
-    }
-    _outFileStream = outStreamLoc;
-    *outStream = outStreamLoc.Detach();
+    char *p = GetSpace(32);
+    _pos += (size_t)(ConvertUInt64ToString(v, p) - p);
   }
-  return S_OK;
-}
+  // it writes UTF-8 string with JSON escaping (jsonEscape) or with CSV escaping
+  void WriteQuotedPath(const wchar_t *s, unsigned len, bool jsonEscape);
+};
 
-Z7_COM7F_IMF(CArchiveExtractCallback::PrepareOperation(Int32 askExtractMode))
+bool CStdOutBufWriter::Flush()
 {
-  _extractMode = false;
-  switch (askExtractMode)
+  if (_pos != 0)
   {
-    case NArchive::NExtract::NAskMode::kExtract:  _extractMode = true; break;
+    if (!_error && fwrite(_buf, 1, _pos, _file) != _pos)
+      _error = true;
+    _pos = 0;
   }
-  switch (askExtractMode)
+  return !_error;
+}
+
+void CStdOutBufWriter::Write(const char *s, size_t size)
+{
+  if (_buf.Size() - _pos < size)
   {
-    case NArchive::NExtract::NAskMode::kExtract:  Print(kExtractingString); break;
-    case NArchive::NExtract::NAskMode::kTest:  Print(kTestingString); break;
-    case NArchive::NExtract::NAskMode::kSkip:  Print(kSkippingString); break;
-    case NArchive::NExtract::NAskMode::kReadExternal: Print(kReadingString); break;
-    default:
-      Print("??? "); break;
+    Flush();
+    if (size > _buf.Size())
+    {
+      if (!_error && fwrite(s, 1, size, _file) != size)
+        _error = true;
+      return;
+    }
   }
-  Print(_filePath);
-  return S_OK;
+  memcpy((Byte *)_buf + _pos, s, size);
+  _pos += size;
 }
 
-Z7_COM7F_IMF(CArchiveExtractCallback::SetOperationResult(Int32 operationResult))
+void CStdOutBufWriter::WriteQuotedPath(const wchar_t *s, unsigned len, bool jsonEscape)
 {
-  switch (operationResult)
+  WriteChar('\"');
+  const wchar_t *lim = s + len;
+  while (s != lim)
   {
-    case NArchive::NExtract::NOperationResult::kOK:
-      break;
-    default:
+    UInt32 c = (UInt32)*s++;
+    Byte *p = (Byte *)GetSpace(kMaxCharSize);
+    if (c < 0x80)
     {
-      NumErrors++;
-      Print("  :  ");
-      const char *s = NULL;
-      switch (operationResult)
+      if (c == '\"')
       {
-        case NArchive::NExtract::NOperationResult::kUnsupportedMethod:
-          s = kUnsupportedMethod;
-          break;
-        case NArchive::NExtract::NOperationResult::kCRCError:
-          s = kCRCFailed;
-          break;
-        case NArchive::NExtract::NOperationResult::kDataError:
-          s = kDataError;
-          break;
-        case NArchive::NExtract::NOperationResult::kUnavailable:
-          s = kUnavailableData;
-          break;
-        case NArchive::NExtract::NOperationResult::kUnexpectedEnd:
-          s = kUnexpectedEnd;
-          break;
-        case NArchive::NExtract::NOperationResult::kDataAfterEnd:
-          s = kDataAfterEnd;
-          break;
-        case NArchive::NExtract::NOperationResult::kIsNotArc:
-          s = kIsNotArc;
-          break;
-        case NArchive::NExtract::NOperationResult::kHeadersError:
-          s = kHeadersError;
-          break;
+        *p++ = (Byte)(jsonEscape ? '\\' : '\"');
+        *p++ = '\"';
       }
-      if (s)
+      else if (jsonEscape && (c == '\\' || c < 0x20))
       {
-        Print("Error : ");
-        Print(s);
+        *p++ = '\\';
+        switch (c)
+        {
+          case '\\': *p++ = '\\'; break;
+          case '\n': *p++ = 'n'; break;
+          case '\r': *p++ = 'r'; break;
+          case '\t': *p++ = 't'; break;
+          default:
+            *p++ = 'u';
+            *p++ = '0';
+            *p++ = '0';
+            *p++ = (Byte)('0' + (c >> 4));
+            *p++ = (Byte)GET_HEX_CHAR_UPPER(c & 15);
+        }
       }
+      else
+        *p++ = (Byte)c;
+      _pos = (size_t)(p - (Byte *)_buf);
+      continue;
+    }
+    if (c >= 0xd800 && c < 0xe000)
+    {
+      // surrogate pair (for 16-bit wchar_t). Lone surrogate is replaced by U+FFFD.
+      if (c < 0xdc00 && s != lim && (UInt32)*s >= 0xdc00 && (UInt32)*s < 0xe000)
+        c = 0x10000 + ((c - 0xd800) << 10) + ((UInt32)*s++ - 0xdc00);
+      else
+        c = 0xfffd;
+    }
+    else if (c > 0x10ffff)
+      c = 0xfffd;
+    if (c < 0x800)
+    {
+      *p++ = (Byte)(0xc0 | (c >> 6));
+    }
+    else
+    {
+      if (c < 0x10000)
+        *p++ = (Byte)(0xe0 | (c >> 12));
       else
       {
-        char temp[16];
-        ConvertUInt32ToString((UInt32)operationResult, temp);
-        Print("Error #");
-        Print(temp);
+        *p++ = (Byte)(0xf0 | (c >> 18));
+        *p++ = (Byte)(0x80 | ((c >> 12) & 0x3f));
       }
+      *p++ = (Byte)(0x80 | ((c >> 6) & 0x3f));
     }
+    *p++ = (Byte)(0x80 | (c & 0x3f));
+    _pos = (size_t)(p - (Byte *)_buf);
   }
+  WriteChar('\"');
+}
 
-  if (_outFileStream)
-  {
-    if (_processedFileInfo.MTime.Def)
+
+static void WriteListHeader_CSV(CStdOutBufWriter &writer, UInt32 columns)
+{
+  bool needComma = false;
+  for (unsigned i = 0; i < k_NumListColumns; i++)
+  {
+    if ((columns & ((UInt32)1 << i)) == 0)
+      continue;
+    if (needComma)
+      writer.WriteChar(',');
+    needComma = true;
+    writer.WriteString(k_ListColumnNames[i]);
+  }
+  writer.WriteChar('\n');
+}
+
+static void WriteListRow(CStdOutBufWriter &writer, EListFormat format, UInt32 columns,
+    const CArcItemsSnapshot &snapshot, unsigned index)
+{
+  const bool json = (format == k_ListFormat_NDJSON);
+  if (json)
+    writer.WriteChar('{');
+  bool needComma = false;
+  for (unsigned i = 0; i < k_NumListColumns; i++)
+  {
+    const UInt32 column = (UInt32)1 << i;
+    if ((columns & column) == 0)
+      continue;
+    if (needComma)
+      writer.WriteChar(',');
+    needComma = true;
+    if (json)
+    {
+      writer.WriteChar('\"');
+      writer.WriteString(k_ListColumnNames[i]);
+      writer.WriteString("\":");
+    }
+    // undefined value is (null) in JSON and empty field in CSV
+    const char *undefined = json ? "null" : "";
+    switch (column)
+    {
+      case k_ListColumn_Path:
+        writer.WriteQuotedPath(snapshot.GetPath(index), snapshot.GetPathLen(index), json);
+        break;
+      case k_ListColumn_Size:
+        if (snapshot.SizeDefined(index))
+          writer.WriteUInt64(snapshot.Sizes[index]);
+        else
+          writer.WriteString(undefined);
+        break;
+      case k_ListColumn_PackSize:
+        if (snapshot.PackSizeDefined(index))
+          writer.WriteUInt64(snapshot.PackSizes[index]);
+        else
+          writer.WriteString(undefined);
+        break;
+      case k_ListColumn_MTime:
+      {
+        const CArcTime &t = snapshot.MTimes[index];
+        char s[64];
+        int level = t.GetNumDigits();
+        if (level == 0)
+          level = kTimestampPrintLevel_SEC;
+        if (t.Def && ConvertUtcFileTimeToString2(t.FT, t.Ns100, s, level, kTimestampPrintFlags_Force_UTC))
+        {
+          // ISO 8601 delimiter
+          char *sp = strchr(s, ' ');
+          if (sp)
+            *sp = 'T';
+          if (json)
+            writer.WriteChar('\"');
+          writer.WriteString(s);
+          if (json)
+            writer.WriteChar('\"');
+        }
+        else
+          writer.WriteString(undefined);
+        break;
+      }
+      case k_ListColumn_Attrib:
+        if (snapshot.AttribDefined(index))
+          writer.WriteUInt64(snapshot.Attribs[index]);
+        else
+          writer.WriteString(undefined);
+        break;
+      case k_ListColumn_IsDir:
+        if (json)
+          writer.WriteString(snapshot.IsDir(index) ? "true" : "false");
+        else
+          writer.WriteChar(snapshot.IsDir(index) ? '1' : '0');
+        break;
+    }
+  }
+  if (json)
+    writer.WriteChar('}');
+  writer.WriteChar('\n');
+}
+
+static HRESULT ListItems_Machine(const CArcItemsSnapshot &snapshot, EListFormat format, UInt32 columns)
+{
+  // the data that was written with Print() must be before our data
+  fflush(stdout);
+  CStdOutBufWriter writer(stdout);
+  if (format == k_ListFormat_CSV)
+    WriteListHeader_CSV(writer, columns);
+  const unsigned numItems = snapshot.Size();
+  for (unsigned i = 0; i < numItems; i++)
+    WriteListRow(writer, format, columns, snapshot, i);
+  if (!writer.Flush() || fflush(stdout) != 0)
+    return E_FAIL;
+  return S_OK;
+}
+
+
+
+class CArchiveExtractCallback Z7_final:
+  public IArchiveExtractCallback,
+  public ICryptoGetTextPassword,
+  public CMyUnknownImp
+{
+  Z7_IFACES_IMP_UNK_2(IArchiveExtractCallback, ICryptoGetTextPassword)
+  Z7_IFACE_COM7_IMP(IProgress)
+
+  CMyComPtr<IInArchive> _archiveHandler;
+  FString _directoryPath;  // Output directory
+  UString _filePath;       // name inside arcvhive
+  FString _diskFilePath;   // full path to file on disk
+  bool _extractMode;
+  struct CProcessedFileInfo
+  {
+    CArcTime MTime;
+    UInt32 Attrib;
+    bool isDir;
+    bool Attrib_Defined;
+  } _processedFileInfo;
+
+  /* the writer is declared before the streams: so it's destroyed after them.
+     The release of last CWriteBehindOutStream flushes the buffers to the writer. */
+  CWriteBehindWriter _writeBehindWriter;
+
+  COutFileStream *_outFileStreamSpec;
+  CWriteBehindOutStream *_writeBehindStreamSpec;
+  CMyComPtr<ISequentialOutStream> _outFileStream;
+
+  // sorted paths (relative to _directoryPath) of directories that were created in current extraction
+  UStringVector _createdDirs;
+  UString _lastCreatedDir;
+  bool _outDirIsEmpty;
+
+  // the stored item was extracted in GetStream(). The calls of handler for that item are ignored.
+  bool _storedItemDone;
+  // the map of sparse archive file (ArcFileStream) for copying of stored items with holes
+  CExtentsStream *_arcExtentsStreamSpec;
+  CMyComPtr<IInStream> _arcExtentsStream;
+
+  void CreateDir_Cached(const UString &relPath);
+  HRESULT CopyStoredItem(UInt32 index, Int32 &opRes);
+  void ReportResult(Int32 operationResult);
+  HRESULT CloseOutFile();
+
+public:
+  void Init(IInArchive *archiveHandler, const FString &directoryPath);
+
+  UInt64 NumErrors;
+  UInt64 SparseSkippedSize; // the size of zero blocks that were not written to output files (Sparse)
+  bool PasswordIsDefined;
+  UString Password;
+  bool PrintItems; // false for batch mode, where items of several archives are extracted at once
+  /* WriteBehind: the decoder writes to memory buffers,
+     and separate thread writes these buffers to output files */
+  bool WriteBehind;
+  /* DirectIO: output files are written with O_DIRECT (where it's supported).
+     So big extraction doesn't push the data of other processes out of page cache. */
+  bool DirectIO;
+  /* Sparse: all-zero blocks of output files are not written.
+     So the disk images with big zero ranges are extracted as sparse files. */
+  bool Sparse;
+  /* ArcFileStream: the zip archive file. If it's set, the stored items (see CArcItemsSnapshot::IsStored)
+     are copied from archive file to output files in kernel (copy_file_range or reflink).
+     Then the copied range is read again for CRC check.
+     GetStream() returns NULL stream for such items, so the zip handler skips their data.
+     The handlers of solid formats (7z) would still decode the data to NULL stream,
+     so the snapshot marks the stored items only for zip archives. */
+  CInFileStream *ArcFileStream;
+  /* OutDirIsEmpty: the caller knows that output directory is empty.
+     So we don't check and delete existing files before creating.
+     Init() also sets that mode, if output directory doesn't exist. */
+  bool OutDirIsEmpty;
+  // if (Snapshot) is set, GetStream() doesn't call GetProperty()
+  const CArcItemsSnapshot *Snapshot;
+  // if (Progress) is set, SetTotal() / SetCompleted() are passed to it
+  CProgressReporter *Progress;
+
+  CArchiveExtractCallback():
+      _writeBehindStreamSpec(NULL),
+      _outDirIsEmpty(false),
+      _storedItemDone(false),
+      _arcExtentsStreamSpec(NULL),
+      PasswordIsDefined(false),
+      PrintItems(true),
+      WriteBehind(false),
+      DirectIO(false),
+      Sparse(false),
+      ArcFileStream(NULL),
+      OutDirIsEmpty(false),
+      Snapshot(NULL),
+      Progress(NULL)
+      {}
+};
+
+static const unsigned kZipLocalHeaderSize = 30;
+static const UInt32 kZipLocalHeaderSig = 0x04034B50;
+
+/* CopyStoredItem() copies the data of stored zip item to output file.
+   The data follows the local header: the fixed part, the name and the extra field.
+   It returns S_FALSE, if the local header doesn't match the item. Then nothing was written,
+   and the handler must extract that item.
+   (opRes) is kCRCError, if the CRC of copied data doesn't match the CRC of item. */
+HRESULT CArchiveExtractCallback::CopyStoredItem(UInt32 index, Int32 &opRes)
+{
+  opRes = NArchive::NExtract::NOperationResult::kOK;
+  // the handler continues to read archive after that call. So we restore the position of archive file.
+  IInStream *arcStream = ArcFileStream;
+  UInt64 arcPos;
+  RINOK(arcStream->Seek(0, STREAM_SEEK_CUR, &arcPos))
+
+  const UInt64 headerPos = Snapshot->HeaderOffsets[index];
+  const UInt64 size = Snapshot->Sizes[index];
+  Byte header[kZipLocalHeaderSize];
+  HRESULT res = InStream_SeekSet(arcStream, headerPos);
+  if (res == S_OK)
+    res = ReadStream_FALSE(arcStream, header, kZipLocalHeaderSize);
+  // the item must be not encrypted (bit 0 of flags) and stored (method 0)
+  if (res == S_OK
+      && (GetUi32(header) != kZipLocalHeaderSig
+        || (GetUi16(header + 6) & 1) != 0
+        || GetUi16(header + 8) != 0))
+    res = S_FALSE;
+  if (res == S_OK)
+  {
+    const UInt64 dataPos = headerPos + kZipLocalHeaderSize
+        + GetUi16(header + 26)   // name size
+        + GetUi16(header + 28);  // extra size
+    CLimitedInStream *limitedStreamSpec = new CLimitedInStream;
+    CMyComPtr<IInStream> limitedStream(limitedStreamSpec);
+    limitedStreamSpec->SetStream(ArcFileStream);
+    if (ArcFileStream->IsSparse() && _outFileStreamSpec->IsSparse())
+    {
+      // the holes of archive file are written as holes of output file: they are not read and written
+      if (!_arcExtentsStream)
+      {
+        _arcExtentsStreamSpec = new CExtentsStream;
+        _arcExtentsStream = _arcExtentsStreamSpec;
+        _arcExtentsStreamSpec->Stream = ArcFileStream;
+        _arcExtentsStreamSpec->Extents = ArcFileStream->Get_Extents();
+        _arcExtentsStreamSpec->Init();
+      }
+      res = CopyExtentsStream(_arcExtentsStreamSpec, dataPos, size, _outFileStreamSpec);
+    }
+    else
+    {
+      res = limitedStreamSpec->InitAndSeek(dataPos, size);
+      if (res == S_OK)
+        res = CopyLimitedStream(limitedStreamSpec, ArcFileStream, _outFileStreamSpec);
+    }
+    // the kernel copy doesn't check the data. So we read the copied range for CRC.
+    if (res == S_OK)
+      res = limitedStreamSpec->InitAndSeek(dataPos, size);
+    if (res == S_OK)
+    {
+      const size_t kBufSize = (size_t)1 << 20;
+      CByteBuffer buf(kBufSize);
+      UInt32 crc = CRC_INIT_VAL;
+      for (UInt64 rem = size; rem != 0;)
+      {
+        const size_t cur = rem < kBufSize ? (size_t)rem : kBufSize;
+        res = ReadStream_FALSE(limitedStream, buf, cur);
+        if (res != S_OK)
+          break;
+        crc = CrcUpdate(crc, buf, cur);
+        rem -= cur;
+      }
+      if (res == S_OK && CRC_GET_DIGEST(crc) != Snapshot->CRCs[index])
+        opRes = NArchive::NExtract::NOperationResult::kCRCError;
+    }
+    // S_FALSE : unexpected end of archive file
+    if (res == S_FALSE)
+      res = E_FAIL;
+  }
+  RINOK(InStream_SeekSet(arcStream, arcPos))
+  return res;
+}
+
+void CArchiveExtractCallback::Init(IInArchive *archiveHandler, const FString &directoryPath)
+{
+  NumErrors = 0;
+  SparseSkippedSize = 0;
+  _storedItemDone = false;
+  _archiveHandler = archiveHandler;
+  _directoryPath = directoryPath;
+  NName::NormalizeDirPathPrefix(_directoryPath);
+  _createdDirs.Clear();
+  _lastCreatedDir.Empty();
+  _outDirIsEmpty = OutDirIsEmpty;
+  if (!_outDirIsEmpty)
+  {
+    FString dir = _directoryPath;
+    if (!dir.IsEmpty() && IS_PATH_SEPAR(dir.Back()))
+      dir.DeleteBack();
+    if (!dir.IsEmpty() && !NFind::DoesFileOrDirExist(dir))
+      _outDirIsEmpty = true;
+  }
+  if (WriteBehind && !_writeBehindWriter.IsCreated())
+  {
+    // if the thread can't be created, we write directly to files
+    _writeBehindWriter.Create();
+  }
+}
+
+void CArchiveExtractCallback::CreateDir_Cached(const UString &relPath)
+{
+  // items of one folder are usually stored together. So we check last created directory first.
+  if (!_lastCreatedDir.IsEmpty() && relPath == _lastCreatedDir)
+    return;
+  if (_createdDirs.FindInSorted(relPath) < 0)
+  {
+    if (!CreateComplexDir(_directoryPath + us2fs(relPath)))
+      return;
+    _createdDirs.AddToUniqueSorted(relPath);
+  }
+  _lastCreatedDir = relPath;
+}
+
+Z7_COM7F_IMF(CArchiveExtractCallback::SetTotal(UInt64 size))
+{
+  if (Progress)
+    Progress->SetTotal(size);
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CArchiveExtractCallback::SetCompleted(const UInt64 *completeValue))
+{
+  if (Progress && completeValue)
+    Progress->SetCompleted(*completeValue);
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CArchiveExtractCallback::GetStream(UInt32 index,
+    ISequentialOutStream **outStream, Int32 askExtractMode))
+{
+  *outStream = NULL;
+  _outFileStream.Release();
+  _writeBehindStreamSpec = NULL;
+  _storedItemDone = false;
+
+  if (Snapshot)
+  {
+    // all properties were read to snapshot already
+    if (index >= Snapshot->Size())
+      return E_INVALIDARG;
+    Snapshot->GetPath(index, _filePath);
+    if (askExtractMode != NArchive::NExtract::NAskMode::kExtract)
+      return S_OK;
+    _processedFileInfo.Attrib = Snapshot->Attribs[index];
+    _processedFileInfo.Attrib_Defined = Snapshot->AttribDefined(index);
+    _processedFileInfo.isDir = Snapshot->IsDir(index);
+    _processedFileInfo.MTime = Snapshot->MTimes[index];
+  }
+  else
+  {
+    {
+      // Get Name
+      NCOM::CPropVariant prop;
+      RINOK(_archiveHandler->GetProperty(index, kpidPath, &prop))
+    
+      UString fullPath;
+      if (prop.vt == VT_EMPTY)
+        fullPath = kEmptyFileAlias;
+      else
+      {
+        if (prop.vt != VT_BSTR)
+          return E_FAIL;
+        fullPath = prop.bstrVal;
+      }
+      _filePath = fullPath;
+    }
+
+    if (askExtractMode != NArchive::NExtract::NAskMode::kExtract)
+      return S_OK;
+
+    {
+      // Get Attrib
+      NCOM::CPropVariant prop;
+      RINOK(_archiveHandler->GetProperty(index, kpidAttrib, &prop))
+      if (prop.vt == VT_EMPTY)
+      {
+        _processedFileInfo.Attrib = 0;
+        _processedFileInfo.Attrib_Defined = false;
+      }
+      else
+      {
+        if (prop.vt != VT_UI4)
+          return E_FAIL;
+        _processedFileInfo.Attrib = prop.ulVal;
+        _processedFileInfo.Attrib_Defined = true;
+      }
+    }
+
+    RINOK(IsArchiveItemFolder(_archiveHandler, index, _processedFileInfo.isDir))
+
+    {
+      _processedFileInfo.MTime.Clear();
+      // Get Modified Time
+      NCOM::CPropVariant prop;
+      RINOK(_archiveHandler->GetProperty(index, kpidMTime, &prop))
+      switch (prop.vt)
+      {
+        case VT_EMPTY:
+          // _processedFileInfo.MTime = _utcMTimeDefault;
+          break;
+        case VT_FILETIME:
+          _processedFileInfo.MTime.Set_From_Prop(prop);
+          break;
+        default:
+          return E_FAIL;
+      }
+
+    }
+    {
+      // Get Size
+      NCOM::CPropVariant prop;
+      RINOK(_archiveHandler->GetProperty(index, kpidSize, &prop))
+      UInt64 newFileSize;
+      /* bool newFileSizeDefined = */ ConvertPropVariantToUInt64(prop, newFileSize);
+    }
+  }
+
+  
+  {
+    // Create folders for file
+    int slashPos = _filePath.ReverseFind_PathSepar();
+    if (slashPos >= 0)
+      CreateDir_Cached(_filePath.Left(slashPos));
+  }
+
+  FString fullProcessedPath = _directoryPath + us2fs(_filePath);
+  _diskFilePath = fullProcessedPath;
+
+  if (_processedFileInfo.isDir)
+  {
+    CreateDir_Cached(_filePath);
+  }
+  else
+  {
+    NFind::CFileInfo fi;
+    // if output directory was empty, there is no old file that must be deleted
+    if (!_outDirIsEmpty && fi.Find(fullProcessedPath))
+    {
+      if (!DeleteFileAlways(fullProcessedPath))
+      {
+        PrintError("Cannot delete output file", fullProcessedPath);
+        return E_ABORT;
+      }
+    }
+    
+    _outFileStreamSpec = new COutFileStream;
+    CMyComPtr<ISequentialOutStream> outStreamLoc(_outFileStreamSpec);
+    if (!_outFileStreamSpec->Create_ALWAYS(fullProcessedPath))
+    {
+      PrintError("Cannot open output file", fullProcessedPath);
+      return E_ABORT;
+    }
+    // if direct mode is not supported, the file is written through page cache
+    if (DirectIO)
+      _outFileStreamSpec->Set_DirectIO(true);
+    if (Sparse)
+    {
+      const HRESULT res = _outFileStreamSpec->Set_Sparse(true);
+      if (res != S_OK)
+      {
+        PrintError("Cannot set sparse mode for output file", fullProcessedPath);
+        return res;
+      }
+    }
+    if (ArcFileStream && Snapshot && Snapshot->IsStored(index))
+    {
+      Int32 opRes;
+      const HRESULT res = CopyStoredItem(index, opRes);
+      if (res == S_OK)
+      {
+        /* (*outStream) is NULL: the zip handler skips the item without
+           PrepareOperation() / SetOperationResult() calls. So we finish the item here. */
+        _storedItemDone = true;
+        _extractMode = true;
+        _outFileStream = outStreamLoc;
+        if (PrintItems)
+        {
+          Print(kExtractingString);
+          Print(_filePath);
+        }
+        ReportResult(opRes);
+        RINOK(CloseOutFile())
+        if (PrintItems)
+          PrintNewLine();
+        return S_OK;
+      }
+      if (res != S_FALSE)
+      {
+        PrintError("Cannot copy stored data to output file", fullProcessedPath);
+        return res;
+      }
+    }
+    if (_writeBehindWriter.IsCreated())
+    {
+      _writeBehindStreamSpec = new CWriteBehindOutStream;
+      outStreamLoc = _writeBehindStreamSpec;
+      _writeBehindStreamSpec->Init(&_writeBehindWriter, _outFileStreamSpec);
+    }
+    _outFileStream = outStreamLoc;
+    *outStream = outStreamLoc.Detach();
+  }
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CArchiveExtractCallback::PrepareOperation(Int32 askExtractMode))
+{
+  if (_storedItemDone)
+    return S_OK;
+  _extractMode = false;
+  switch (askExtractMode)
+  {
+    case NArchive::NExtract::NAskMode::kExtract:  _extractMode = true; break;
+  }
+  if (!PrintItems)
+    return S_OK;
+  switch (askExtractMode)
+  {
+    case NArchive::NExtract::NAskMode::kExtract:  Print(kExtractingString); break;
+    case NArchive::NExtract::NAskMode::kTest:  Print(kTestingString); break;
+    case NArchive::NExtract::NAskMode::kSkip:  Print(kSkippingString); break;
+    case NArchive::NExtract::NAskMode::kReadExternal: Print(kReadingString); break;
+    default:
+      Print("??? "); break;
+  }
+  Print(_filePath);
+  return S_OK;
+}
+
+void CArchiveExtractCallback::ReportResult(Int32 operationResult)
+{
+  switch (operationResult)
+  {
+    case NArchive::NExtract::NOperationResult::kOK:
+      break;
+    default:
+    {
+      NumErrors++;
+      if (!PrintItems)
+        break;
+      Print("  :  ");
+      const char *s = NULL;
+      switch (operationResult)
+      {
+        case NArchive::NExtract::NOperationResult::kUnsupportedMethod:
+          s = kUnsupportedMethod;
+          break;
+        case NArchive::NExtract::NOperationResult::kCRCError:
+          s = kCRCFailed;
+          break;
+        case NArchive::NExtract::NOperationResult::kDataError:
+          s = kDataError;
+          break;
+        case NArchive::NExtract::NOperationResult::kUnavailable:
+          s = kUnavailableData;
+          break;
+        case NArchive::NExtract::NOperationResult::kUnexpectedEnd:
+          s = kUnexpectedEnd;
+          break;
+        case NArchive::NExtract::NOperationResult::kDataAfterEnd:
+          s = kDataAfterEnd;
+          break;
+        case NArchive::NExtract::NOperationResult::kIsNotArc:
+          s = kIsNotArc;
+          break;
+        case NArchive::NExtract::NOperationResult::kHeadersError:
+          s = kHeadersError;
+          break;
+      }
+      if (s)
+      {
+        Print("Error : ");
+        Print(s);
+      }
+      else
+      {
+        char temp[16];
+        ConvertUInt32ToString((UInt32)operationResult, temp);
+        Print("Error #");
+        Print(temp);
+      }
+    }
+  }
+}
+
+HRESULT CArchiveExtractCallback::CloseOutFile()
+{
+  if (_outFileStream)
+  {
+    if (_writeBehindStreamSpec)
+    {
+      if (_processedFileInfo.MTime.Def)
+      {
+        CFiTime ft;
+        _processedFileInfo.MTime.Write_To_FiTime(ft);
+        _writeBehindStreamSpec->SetMTime(&ft);
+      }
+      const HRESULT res = _writeBehindStreamSpec->Close();
+      _writeBehindStreamSpec = NULL;
+      // the writer thread has finished the writes to file
+      SparseSkippedSize += _outFileStreamSpec->SparseSkippedSize;
+      _outFileStream.Release();
+      RINOK(res)
+    }
+    else
+    {
+      if (_processedFileInfo.MTime.Def)
+      {
+        CFiTime ft;
+        _processedFileInfo.MTime.Write_To_FiTime(ft);
+        _outFileStreamSpec->SetMTime(&ft);
+      }
+      RINOK(_outFileStreamSpec->Close())
+      SparseSkippedSize += _outFileStreamSpec->SparseSkippedSize;
+    }
+  }
+  _outFileStream.Release();
+  if (_extractMode && _processedFileInfo.Attrib_Defined)
+    SetFileAttrib_PosixHighDetect(_diskFilePath, _processedFileInfo.Attrib);
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CArchiveExtractCallback::SetOperationResult(Int32 operationResult))
+{
+  // the stored item was finished in GetStream()
+  if (_storedItemDone)
+  {
+    _storedItemDone = false;
+    return S_OK;
+  }
+  ReportResult(operationResult);
+  RINOK(CloseOutFile())
+  if (PrintItems)
+    PrintNewLine();
+  return S_OK;
+}
+
+
+Z7_COM7F_IMF(CArchiveExtractCallback::CryptoGetTextPassword(BSTR *password))
+{
+  if (!PasswordIsDefined)
+  {
+#if 0
+    // You can ask real password here from user
+    RINOK(GetPassword_HRESULT(&g_StdOut, Password))
+    PasswordIsDefined = true;
+#else
+    PrintError("Password is not defined");
+    return E_ABORT;
+#endif
+  }
+  return StringToBstr(Password, password);
+}
+
+
+
+//////////////////////////////////////////////////////////////
+// Selecting of items
+
+/*
+  GetSelectedIndices() checks path of each item with (censor) rules
+  and adds (itemIndices) that are set explicitly.
+  It uses only the metadata snapshot, so no data is decoded here.
+  (indices) is sorted, so IInArchive::Extract() decodes only the folders
+  (solid blocks) that contain the selected items.
+  (censor) must contain only relative paths.
+*/
+
+static HRESULT GetSelectedIndices(const CArcItemsSnapshot &snapshot,
+    const NWildcard::CCensor &censor,
+    const CRecordVector<UInt32> &itemIndices,
+    CRecordVector<UInt32> &indices)
+{
+  indices.Clear();
+  const UInt32 numItems = snapshot.Size();
+
+  if (!censor.Pairs.IsEmpty())
+  {
+    if (!censor.AllAreRelative())
+      return E_INVALIDARG;
+    const NWildcard::CCensorNode &wildcardCensor = censor.Pairs.Front().Head;
+    UStringVector pathParts;
+    UString path;
+    for (UInt32 i = 0; i < numItems; i++)
+    {
+      snapshot.GetPath(i, path);
+      pathParts.Clear();
+      SplitPathToParts(path, pathParts);
+      bool include;
+      if (wildcardCensor.CheckPathVect(pathParts, !snapshot.IsDir(i), include) && include)
+        indices.Add(i);
+    }
+  }
+
+  FOR_VECTOR (i, itemIndices)
+  {
+    const UInt32 index = itemIndices[i];
+    if (index >= numItems)
+      return E_INVALIDARG;
+    indices.AddToUniqueSorted(index);
+  }
+  return S_OK;
+}
+
+// (recursive) : the masks are applied to items in all subfolders
+static void AddMasksToCensor(NWildcard::CCensor &censor, const UStringVector &masks, bool recursive)
+{
+  NWildcard::CCensorPathProps props;
+  props.Recursive = recursive;
+  FOR_VECTOR (i, masks)
+    censor.AddPreItem(true, masks[i], props);
+  censor.AddPathsToCensor(NWildcard::k_RelatPath);
+}
+
+
+
+//////////////////////////////////////////////////////////////
+// Extracting to memory
+
+Z7_PURE_INTERFACES_BEGIN
+DECLARE_INTERFACE(IExtractToMemHandler)
+{
+  /* it's called for each extracted file item.
+     (buf) contains the data of item in first (size) bytes.
+     The handler can take the buffer without copying with (buf.Swap()). */
+  virtual HRESULT OnItemExtracted(UInt32 index, const UString &path,
+      CByteBuffer &buf, size_t size, Int32 opRes) = 0;
+};
+Z7_PURE_INTERFACES_END
+
+/*
+  CArchiveExtractToMemCallback writes items to CGrowBufOutStream instead of files.
+  The buffer is allocated for kpidSize of item,
+  so the decoder writes the data directly to the final buffer.
+*/
+
+class CArchiveExtractToMemCallback Z7_final:
+  public IArchiveExtractCallback,
+  public ICryptoGetTextPassword,
+  public CMyUnknownImp
+{
+  Z7_IFACES_IMP_UNK_2(IArchiveExtractCallback, ICryptoGetTextPassword)
+  Z7_IFACE_COM7_IMP(IProgress)
+
+  CMyComPtr<IInArchive> _archiveHandler;
+  IExtractToMemHandler *_handler;
+  UInt32 _index;
+  UString _filePath;
+  bool _outStreamIsUsed;
+
+  CGrowBufOutStream *_outStreamSpec;
+  CMyComPtr<ISequentialOutStream> _outStream;
+
+public:
+  void Init(IInArchive *archiveHandler, IExtractToMemHandler *handler);
+
+  UInt64 NumErrors;
+  bool PasswordIsDefined;
+  UString Password;
+  // we don't preallocate more than (MaxReserveSize), if kpidSize is larger
+  UInt64 MaxReserveSize;
+
+  CArchiveExtractToMemCallback():
+      _handler(NULL),
+      _outStreamIsUsed(false),
+      NumErrors(0),
+      PasswordIsDefined(false),
+      MaxReserveSize((UInt64)1 << 30)
+  {
+    _outStreamSpec = new CGrowBufOutStream;
+    _outStream = _outStreamSpec;
+  }
+};
+
+void CArchiveExtractToMemCallback::Init(IInArchive *archiveHandler, IExtractToMemHandler *handler)
+{
+  NumErrors = 0;
+  _archiveHandler = archiveHandler;
+  _handler = handler;
+  _outStreamIsUsed = false;
+}
+
+Z7_COM7F_IMF(CArchiveExtractToMemCallback::SetTotal(UInt64 /* size */))
+{
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CArchiveExtractToMemCallback::SetCompleted(const UInt64 * /* completeValue */))
+{
+  return S_OK;
+}
+
+Z7_COM7F_IMF(CArchiveExtractToMemCallback::GetStream(UInt32 index,
+    ISequentialOutStream **outStream, Int32 askExtractMode))
+{
+  *outStream = NULL;
+  _outStreamIsUsed = false;
+  _index = index;
+
+  {
+    NCOM::CPropVariant prop;
+    RINOK(_archiveHandler->GetProperty(index, kpidPath, &prop))
+    if (prop.vt == VT_EMPTY)
+      _filePath = kEmptyFileAlias;
+    else
     {
-      CFiTime ft;
-      _processedFileInfo.MTime.Write_To_FiTime(ft);
-      _outFileStreamSpec->SetMTime(&ft);
+      if (prop.vt != VT_BSTR)
+        return E_FAIL;
+      _filePath = prop.bstrVal;
     }
-    RINOK(_outFileStreamSpec->Close())
   }
-  _outFileStream.Release();
-  if (_extractMode && _processedFileInfo.Attrib_Defined)
-    SetFileAttrib_PosixHighDetect(_diskFilePath, _processedFileInfo.Attrib);
-  PrintNewLine();
+
+  if (askExtractMode != NArchive::NExtract::NAskMode::kExtract)
+    return S_OK;
+
+  bool isDir;
+  RINOK(IsArchiveItemFolder(_archiveHandler, index, isDir))
+  if (isDir)
+    return S_OK;
+
+  UInt64 reserveSize = 0;
+  {
+    NCOM::CPropVariant prop;
+    RINOK(_archiveHandler->GetProperty(index, kpidSize, &prop))
+    if (!ConvertPropVariantToUInt64(prop, reserveSize))
+      reserveSize = 0;
+  }
+  if (reserveSize > MaxReserveSize)
+    reserveSize = MaxReserveSize;
+
+  try
+  {
+    if (!_outStreamSpec->Init(reserveSize))
+      return E_OUTOFMEMORY;
+  }
+  catch(...)
+  {
+    return E_OUTOFMEMORY;
+  }
+  _outStreamIsUsed = true;
+  CMyComPtr<ISequentialOutStream> outStreamLoc = _outStream;
+  *outStream = outStreamLoc.Detach();
   return S_OK;
 }
 
+Z7_COM7F_IMF(CArchiveExtractToMemCallback::PrepareOperation(Int32 /* askExtractMode */))
+{
+  return S_OK;
+}
 
-Z7_COM7F_IMF(CArchiveExtractCallback::CryptoGetTextPassword(BSTR *password))
+Z7_COM7F_IMF(CArchiveExtractToMemCallback::SetOperationResult(Int32 operationResult))
+{
+  if (operationResult != NArchive::NExtract::NOperationResult::kOK)
+    NumErrors++;
+  if (!_outStreamIsUsed)
+    return S_OK;
+  _outStreamIsUsed = false;
+  CByteBuffer buf;
+  size_t size;
+  _outStreamSpec->MoveTo(buf, size);
+  return _handler->OnItemExtracted(_index, _filePath, buf, size, operationResult);
+}
+
+Z7_COM7F_IMF(CArchiveExtractToMemCallback::CryptoGetTextPassword(BSTR *password))
 {
   if (!PasswordIsDefined)
   {
-#if 0
-    // You can ask real password here from user
-    RINOK(GetPassword_HRESULT(&g_StdOut, Password))
-    PasswordIsDefined = true;
-#else
     PrintError("Password is not defined");
     return E_ABORT;
-#endif
   }
   return StringToBstr(Password, password);
 }
 
+/*
+  ExtractToMemory() extracts (indices) items of opened archive to memory.
+  If (indices) is empty, it extracts all items.
+*/
+
+static HRESULT ExtractToMemory(IInArchive *archive, const CRecordVector<UInt32> &indices,
+    IExtractToMemHandler *handler,
+    bool passwordIsDefined, const UString &password, UInt64 &numErrors)
+{
+  numErrors = 0;
+  CArchiveExtractToMemCallback *extractCallbackSpec = new CArchiveExtractToMemCallback;
+  CMyComPtr<IArchiveExtractCallback> extractCallback(extractCallbackSpec);
+  extractCallbackSpec->Init(archive, handler);
+  extractCallbackSpec->PasswordIsDefined = passwordIsDefined;
+  extractCallbackSpec->Password = password;
+
+  HRESULT result;
+  if (indices.IsEmpty())
+    result = archive->Extract(NULL, (UInt32)(Int32)(-1), false, extractCallback);
+  else
+    result = archive->Extract(indices.ConstData(), indices.Size(), false, extractCallback);
+  numErrors = extractCallbackSpec->NumErrors;
+  return result;
+}
+
+// it prints the size of each item extracted to memory
+class CPrintExtractToMemHandler Z7_final: public IExtractToMemHandler
+{
+public:
+  UInt64 TotalSize;
+  CPrintExtractToMemHandler(): TotalSize(0) {}
+
+  HRESULT OnItemExtracted(UInt32 /* index */, const UString &path,
+      CByteBuffer & /* buf */, size_t size, Int32 opRes) Z7_override
+  {
+    char temp[32];
+    ConvertUInt64ToString(size, temp);
+    Print(temp);
+    Print("  ");
+    Print(path);
+    if (opRes != NArchive::NExtract::NOperationResult::kOK)
+      Print("  : Error");
+    PrintNewLine();
+    TotalSize += size;
+    return S_OK;
+  }
+};
+
+
+
+//////////////////////////////////////////////////////////////
+// Batch extraction of many archives
+
+/*
+  Each worker thread owns its own IInArchive, CInFileStream and
+  CArchiveExtractCallback objects, so no handler object is shared between threads.
+  CHandleLimiter is shared by all workers: it limits the number of file handles
+  that can be open at the same time.
+  Each archive requires (kNumHandlesPerArchive) handles:
+    the archive file and the current output file.
+*/
+
+static const unsigned kNumHandlesPerArchive = 2;
+
+class CHandleLimiter
+{
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  unsigned _numFree;
+public:
+  CHandleLimiter(unsigned maxHandles): _numFree(maxHandles) {}
+
+  void Acquire(unsigned num)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cond.wait(lock, [&] { return _numFree >= num; });
+    _numFree -= num;
+  }
+
+  void Release(unsigned num)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _numFree += num;
+    }
+    _cond.notify_all();
+  }
+};
+
+struct CBatchExtractOptions
+{
+  FString OutDir;
+  unsigned NumThreads;
+  unsigned MaxOpenFiles;
+  bool SubDirForEachArc; // extract each archive to (OutDir/arcName/)
+  bool WriteBehind;
+  bool DirectIO; // archives and output files are not stored in page cache
+  bool Sparse; // all-zero blocks of output files are not written
+  unsigned NumPrefetchBufs; // (0) : no background read-ahead for archive files
+  bool PasswordIsDefined;
+  UString Password;
+
+  CBatchExtractOptions():
+      NumThreads(0),
+      MaxOpenFiles(64),
+      SubDirForEachArc(true),
+      WriteBehind(false),
+      DirectIO(false),
+      Sparse(false),
+      NumPrefetchBufs(0),
+      PasswordIsDefined(false)
+      {}
+};
+
+struct CBatchArcResult
+{
+  HRESULT Result;
+  const char *ErrorMessage;
+  UInt32 NumItems;
+  UInt64 NumErrors;
+  UInt64 SparseSkippedSize;
+  UInt64 OpenTime_ms;
+  UInt64 ExtractTime_ms;
+
+  CBatchArcResult():
+      Result(S_OK),
+      ErrorMessage(NULL),
+      NumItems(0),
+      NumErrors(0),
+      SparseSkippedSize(0),
+      OpenTime_ms(0),
+      ExtractTime_ms(0)
+      {}
+};
+
+static UInt64 GetTimeDiff_ms(const std::chrono::steady_clock::time_point &start)
+{
+  return (UInt64)std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+/* BenchmarkArcLibrary() compares two ways to get archive handler:
+     uncached : LoadLibrary() / dlopen(), GetProcAddress(), CreateObject()
+                and FreeLibrary() for each operation.
+     cached   : GetArcLibrary() and CreateObject().
+   The uncached loop is first, so it's not affected by the library in cache. */
+
+static void BenchmarkArcLibrary(const FString &path, unsigned numIters)
+{
+  char s[32];
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  unsigned i;
+  for (i = 0; i < numIters; i++)
+  {
+    NDLL::CLibrary lib;
+    if (!lib.Load(path))
+      break;
+    const Func_CreateObject createObject = Z7_GET_PROC_ADDRESS(
+        Func_CreateObject, lib.Get_HMODULE(), "CreateObject");
+    if (!createObject)
+      break;
+    CMyComPtr<IInArchive> archive;
+    if (createObject(&CLSID_Format, &IID_IInArchive, (void **)&archive) != S_OK)
+      break;
+  }
+  const UInt64 uncached_ms = GetTimeDiff_ms(start);
+  const unsigned numUncached = i;
+
+  start = std::chrono::steady_clock::now();
+  const CArcLibrary *arcLib = NULL;
+  for (i = 0; i < numIters; i++)
+  {
+    if (GetArcLibrary(path, arcLib) != S_OK)
+      break;
+    CMyComPtr<IInArchive> archive;
+    if (arcLib->CreateObject(CLSID_Format, IID_IInArchive, (void **)&archive) != S_OK)
+      break;
+  }
+  const UInt64 cached_ms = GetTimeDiff_ms(start);
+  const unsigned numCached = i;
+
+  if (!arcLib)
+  {
+    PrintError("Cannot load 7-zip library");
+    return;
+  }
+  Print("Library load : ");
+  ConvertUInt64ToString(arcLib->LoadTime_us, s);
+  Print(s);
+  Print(" us, formats : ");
+  ConvertUInt64ToString(arcLib->FormatsTime_us, s);
+  Print(s);
+  Print(" us (");
+  ConvertUInt32ToString(arcLib->Formats.Size(), s);
+  Print(s);
+  Print(" formats)");
+  PrintNewLine();
+  Print("Uncached : ");
+  ConvertUInt32ToString(numUncached, s);
+  Print(s);
+  Print(" operations in ");
+  ConvertUInt64ToString(uncached_ms, s);
+  Print(s);
+  Print(" ms");
+  PrintNewLine();
+  Print("Cached   : ");
+  ConvertUInt32ToString(numCached, s);
+  Print(s);
+  Print(" operations in ");
+  ConvertUInt64ToString(cached_ms, s);
+  Print(s);
+  Print(" ms");
+  PrintNewLine();
+}
+
+static void PrintSpeed(const char *name, UInt64 size, UInt64 time_ms, bool ok)
+{
+  char s[32];
+  Print(name);
+  if (!ok)
+  {
+    Print(" : error");
+    PrintNewLine();
+    return;
+  }
+  Print(" : ");
+  ConvertUInt64ToString(time_ms, s);
+  Print(s);
+  Print(" ms, ");
+  ConvertUInt64ToString(time_ms == 0 ? 0 : (size >> 20) * 1000 / time_ms, s);
+  Print(s);
+  Print(" MB/s");
+  PrintNewLine();
+}
+
+/* BenchmarkFileIO() compares the syscall path (write() and pread() in prefetcher)
+   with io_uring path (write queue and batched reads in prefetcher).
+   It writes the temp file of (size) bytes in 64 KB calls like archive handler
+   and reads it back. The second read of file is from page cache, so
+   run it for the file larger than RAM to measure the disk. */
+
+static void BenchmarkFileIO(const FString &path, UInt64 size)
+{
+  const size_t kChunkSize = (size_t)1 << 16;
+  CByteBuffer buf(kChunkSize);
+  for (size_t i = 0; i < kChunkSize; i++)
+    buf[i] = (Byte)(i * 7 + (i >> 8));
+
+  for (unsigned useIoUring = 0; useIoUring < 2; useIoUring++)
+  {
+    {
+      COutFileStream *outStreamSpec = new COutFileStream;
+      CMyComPtr<IOutStream> outStream = outStreamSpec;
+      if (!outStreamSpec->Create_ALWAYS(path))
+      {
+        PrintError("Cannot create file", path);
+        return;
+      }
+      if (useIoUring && !outStreamSpec->Set_WriteQueue(4))
+      {
+        PrintError("io_uring is not available");
+        return;
+      }
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      HRESULT res = S_OK;
+      for (UInt64 pos = 0; pos < size && res == S_OK; pos += kChunkSize)
+        res = WriteStream(outStream, buf, (size_t)MyMin((UInt64)kChunkSize, size - pos));
+      if (res == S_OK)
+        res = outStreamSpec->Close();
+      PrintSpeed(useIoUring ? "write io_uring" : "write syscall ", size, GetTimeDiff_ms(start), res == S_OK);
+    }
+    {
+      CInFileStream *inStreamSpec = new CInFileStream;
+      CMyComPtr<IInStream> inStream = inStreamSpec;
+      if (!inStreamSpec->Open(path))
+      {
+        PrintError("Cannot open file", path);
+        return;
+      }
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      HRESULT res = inStreamSpec->Set_Prefetch(4, (size_t)1 << 20, useIoUring != 0);
+      UInt64 total = 0;
+      for (;;)
+      {
+        if (res != S_OK)
+          break;
+        size_t processed = kChunkSize;
+        res = ReadStream(inStream, buf, &processed);
+        total += processed;
+        if (processed != kChunkSize)
+          break;
+      }
+      if (useIoUring && res == S_OK && !inStreamSpec->Get_Prefetcher()->IsIoUringUsed())
+        PrintError("io_uring is not available for reading");
+      PrintSpeed(useIoUring ? "read  io_uring" : "read  syscall ", size, GetTimeDiff_ms(start), res == S_OK && total == size);
+    }
+  }
+  NDir::DeleteFileAlways(path);
+}
+
+/* GetBatchOutDirs() returns output directory for each archive.
+   The archives with same name from different directories (a/x.zip, b/x.zip)
+   or with different extensions (x.zip, x.7z) get the subdirs
+   x, x_2, x_3, ... in order of (arcPaths). So they don't overwrite the files of each other. */
+
+static void GetBatchOutDirs(const CBatchExtractOptions &options,
+    const CObjectVector<FString> &arcPaths, CObjectVector<FString> &outDirs)
+{
+  FString baseDir = options.OutDir;
+  NName::NormalizeDirPathPrefix(baseDir);
+  outDirs.ClearAndReserve(arcPaths.Size());
+  UStringVector usedNames; // sorted with CompareFileNames()
+  FOR_VECTOR (i, arcPaths)
+  {
+    FString outDir = baseDir;
+    if (options.SubDirForEachArc)
+    {
+      const FString &arcPath = arcPaths[i];
+      FString name (arcPath.Ptr((unsigned)(arcPath.ReverseFind_PathSepar() + 1)));
+      const int dotPos = name.ReverseFind_Dot();
+      if (dotPos > 0)
+        name.DeleteFrom((unsigned)dotPos);
+      FString uniqName = name;
+      for (UInt32 k = 2;; k++)
+      {
+        const UString u = fs2us(uniqName);
+        unsigned left = 0, right = usedNames.Size();
+        while (left != right)
+        {
+          const unsigned mid = (left + right) / 2;
+          const int comp = CompareFileNames(u, usedNames[mid]);
+          if (comp == 0)
+            break;
+          if (comp < 0)
+            right = mid;
+          else
+            left = mid + 1;
+        }
+        if (left == right)
+        {
+          usedNames.Insert(left, u);
+          break;
+        }
+        char s[16];
+        ConvertUInt32ToString(k, s);
+        uniqName = name;
+        uniqName += "_";
+        uniqName += s;
+      }
+      outDir += uniqName;
+      outDir.Add_PathSepar();
+    }
+    outDirs.AddInReserved(outDir);
+  }
+}
+
+static void ExtractArchive_InBatch(const CArcLibrary *arcLib,
+    const CBatchExtractOptions &options, const FString &arcPath, const FString &outDir,
+    CHandleLimiter &limiter, CBatchArcResult &res)
+{
+  limiter.Acquire(kNumHandlesPerArchive);
+  {
+    const std::chrono::steady_clock::time_point openStart = std::chrono::steady_clock::now();
+
+    CMyComPtr<IInArchive> archive;
+    {
+      CInFileStream *fileSpec = new CInFileStream;
+      CMyComPtr<IInStream> file = fileSpec;
+      if (!fileSpec->Open(arcPath))
+      {
+        res.Result = GetLastError_noZero_HRESULT();
+        res.ErrorMessage = "Cannot open archive file";
+      }
+      else
+      {
+        // if prefetching is not supported, we use direct reading
+        if (!options.DirectIO || !fileSpec->Set_DirectIO(true))
+          fileSpec->Set_Prefetch(options.NumPrefetchBufs);
+
+        CArchiveOpenCallback *openCallbackSpec = new CArchiveOpenCallback;
+        CMyComPtr<IArchiveOpenCallback> openCallback(openCallbackSpec);
+        openCallbackSpec->PasswordIsDefined = options.PasswordIsDefined;
+        openCallbackSpec->Password = options.Password;
+        openCallbackSpec->ArcPath = arcPath;
+
+        CArcDetector detector;
+        detector.Library = arcLib;
+        int formatIndex;
+        res.Result = detector.Open(file, arcPath, openCallback, archive, formatIndex);
+        res.OpenTime_ms = GetTimeDiff_ms(openStart);
+        if (res.Result != S_OK)
+          res.ErrorMessage = "Cannot open file as archive";
+        else
+        {
+          archive->GetNumberOfItems(&res.NumItems);
+          const std::chrono::steady_clock::time_point extractStart = std::chrono::steady_clock::now();
+          
+          CArchiveExtractCallback *extractCallbackSpec = new CArchiveExtractCallback;
+          CMyComPtr<IArchiveExtractCallback> extractCallback(extractCallbackSpec);
+          extractCallbackSpec->WriteBehind = options.WriteBehind;
+          extractCallbackSpec->DirectIO = options.DirectIO;
+          extractCallbackSpec->Sparse = options.Sparse;
+          extractCallbackSpec->Init(archive, outDir);
+          extractCallbackSpec->PasswordIsDefined = options.PasswordIsDefined;
+          extractCallbackSpec->Password = options.Password;
+          extractCallbackSpec->PrintItems = false;
+
+          res.Result = archive->Extract(NULL, (UInt32)(Int32)(-1), false, extractCallback);
+          res.NumErrors = extractCallbackSpec->NumErrors;
+          res.SparseSkippedSize = extractCallbackSpec->SparseSkippedSize;
+          res.ExtractTime_ms = GetTimeDiff_ms(extractStart);
+          if (res.Result != S_OK)
+            res.ErrorMessage = "Extract Error";
+          archive->Close();
+        }
+      }
+    }
+  }
+  limiter.Release(kNumHandlesPerArchive);
+}
+
+static void ExtractArchives_Batch(const CArcLibrary *arcLib,
+    const CBatchExtractOptions &options,
+    const CObjectVector<FString> &arcPaths,
+    CObjectVector<CBatchArcResult> &results)
+{
+  results.ClearAndReserve(arcPaths.Size());
+  FOR_VECTOR (i, arcPaths)
+    results.AddNew();
+  if (arcPaths.IsEmpty())
+    return;
+
+  // the names are assigned before extraction, so they don't depend on the order of threads
+  CObjectVector<FString> outDirs;
+  GetBatchOutDirs(options, arcPaths, outDirs);
+
+  unsigned numThreads = options.NumThreads;
+  if (numThreads == 0)
+    numThreads = std::thread::hardware_concurrency();
+  unsigned maxOpenFiles = options.MaxOpenFiles;
+  if (maxOpenFiles < kNumHandlesPerArchive)
+    maxOpenFiles = kNumHandlesPerArchive;
+  // the workers above that limit would only wait for free handles
+  numThreads = MyMin(numThreads, maxOpenFiles / kNumHandlesPerArchive);
+  numThreads = MyMin(numThreads, arcPaths.Size());
+  if (numThreads == 0)
+    numThreads = 1;
+
+  CHandleLimiter limiter(maxOpenFiles);
+  std::atomic<unsigned> nextIndex(0);
+
+  std::vector<std::thread> threads;
+  threads.reserve(numThreads);
+  for (unsigned t = 0; t < numThreads; t++)
+    threads.emplace_back([&]
+    {
+      for (;;)
+      {
+        const unsigned index = nextIndex++;
+        if (index >= arcPaths.Size())
+          break;
+        ExtractArchive_InBatch(arcLib, options, arcPaths[index], outDirs[index], limiter, results[index]);
+      }
+    });
+  for (size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+}
+
+static void PrintBatchResults(const CObjectVector<FString> &arcPaths,
+    const CObjectVector<CBatchArcResult> &results, UInt64 totalTime_ms)
+{
+  UInt64 numErrors = 0;
+  unsigned numFailedArcs = 0;
+  FOR_VECTOR (i, results)
+  {
+    const CBatchArcResult &r = results[i];
+    char s[32];
+    Print(arcPaths[i]);
+    Print("  :  items ");
+    ConvertUInt32ToString(r.NumItems, s);
+    Print(s);
+    Print("  errors ");
+    ConvertUInt64ToString(r.NumErrors, s);
+    Print(s);
+    Print("  open ");
+    ConvertUInt64ToString(r.OpenTime_ms, s);
+    Print(s);
+    Print(" ms  extract ");
+    ConvertUInt64ToString(r.ExtractTime_ms, s);
+    Print(s);
+    Print(" ms");
+    if (r.SparseSkippedSize != 0)
+    {
+      Print("  holes ");
+      ConvertUInt64ToString(r.SparseSkippedSize, s);
+      Print(s);
+    }
+    if (r.Result != S_OK)
+    {
+      numFailedArcs++;
+      Print("  :  Error : ");
+      Print(r.ErrorMessage ? r.ErrorMessage : "???");
+    }
+    numErrors += r.NumErrors;
+    PrintNewLine();
+  }
+  char s[32];
+  Print("Archives: ");
+  ConvertUInt32ToString(results.Size(), s);
+  Print(s);
+  Print("  Failed: ");
+  ConvertUInt32ToString(numFailedArcs, s);
+  Print(s);
+  Print("  Item errors: ");
+  ConvertUInt64ToString(numErrors, s);
+  Print(s);
+  Print("  Time: ");
+  ConvertUInt64ToString(totalTime_ms, s);
+  Print(s);
+  PrintStringLn(" ms");
+}
+
 
 
 //////////////////////////////////////////////////////////////
@@ -615,12 +2330,129 @@ struct CDirItem: public NWindows::NFile::NFind::CFileInfoBase
     {}
 };
 
+/*
+  CUpdateOpProfile collects the time of update phases from the reports of
+  IArchiveUpdateCallbackFile (GetStream2() and ReportOperation()).
+  The time between two reports is added to the phase of first report.
+  So (add) and (update) include the compression time of items,
+  and (replicate) is the time of copying of old packed data.
+  (kInFileChanged) is notification only: it doesn't change the phase.
+*/
+
+static const char * const k_UpdateNotifyOpNames[] =
+{
+    "add"
+  , "update"
+  , "analyze"
+  , "replicate"
+  , "repack"
+  , "skip"
+  , "delete"
+  , "header"
+  , "hash read"
+  , "file changed"
+};
+
+static const unsigned k_NumUpdateNotifyOps = Z7_ARRAY_SIZE(k_UpdateNotifyOpNames);
+
+class CUpdateOpProfile
+{
+  std::chrono::steady_clock::time_point _phaseStart;
+  int _curOp; // (-1) : preparing before first report
+
+  void FinishPhase();
+public:
+  UInt64 Counts[k_NumUpdateNotifyOps];
+  UInt64 Times_us[k_NumUpdateNotifyOps];
+  UInt64 PrepareTime_us;
+  UInt64 NumUnknownOps;
+
+  CUpdateOpProfile() { Start(); }
+  void Start();
+  void SetOp(UInt32 notifyOp);
+  void Finish() { FinishPhase(); _curOp = -1; }
+  void PrintProfile() const;
+};
+
+void CUpdateOpProfile::Start()
+{
+  for (unsigned i = 0; i < k_NumUpdateNotifyOps; i++)
+  {
+    Counts[i] = 0;
+    Times_us[i] = 0;
+  }
+  PrepareTime_us = 0;
+  NumUnknownOps = 0;
+  _curOp = -1;
+  _phaseStart = std::chrono::steady_clock::now();
+}
+
+void CUpdateOpProfile::FinishPhase()
+{
+  const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  const UInt64 t = (UInt64)std::chrono::duration_cast<std::chrono::microseconds>(now - _phaseStart).count();
+  _phaseStart = now;
+  if (_curOp < 0)
+    PrepareTime_us += t;
+  else
+    Times_us[(unsigned)_curOp] += t;
+}
+
+void CUpdateOpProfile::SetOp(UInt32 notifyOp)
+{
+  if (notifyOp >= k_NumUpdateNotifyOps)
+  {
+    NumUnknownOps++;
+    return;
+  }
+  Counts[notifyOp]++;
+  if (notifyOp == NUpdateNotifyOp::kInFileChanged)
+    return;
+  FinishPhase();
+  _curOp = (int)notifyOp;
+}
+
+void CUpdateOpProfile::PrintProfile() const
+{
+  char s[32];
+  Print("Update profile:");
+  PrintNewLine();
+  Print("  prepare       : ");
+  ConvertUInt64ToString(PrepareTime_us / 1000, s);
+  Print(s);
+  Print(" ms");
+  PrintNewLine();
+  for (unsigned i = 0; i < k_NumUpdateNotifyOps; i++)
+  {
+    if (Counts[i] == 0)
+      continue;
+    Print("  ");
+    AString name (k_UpdateNotifyOpNames[i]);
+    while (name.Len() < 12)
+      name.Add_Space();
+    Print(name);
+    Print("  : ");
+    ConvertUInt64ToString(Counts[i], s);
+    Print(s);
+    Print(" items");
+    if (i != NUpdateNotifyOp::kInFileChanged)
+    {
+      Print("  ");
+      ConvertUInt64ToString(Times_us[i] / 1000, s);
+      Print(s);
+      Print(" ms");
+    }
+    PrintNewLine();
+  }
+}
+
 class CArchiveUpdateCallback Z7_final:
   public IArchiveUpdateCallback2,
+  public IArchiveUpdateCallbackFile,
   public ICryptoGetTextPassword2,
   public CMyUnknownImp
 {
-  Z7_IFACES_IMP_UNK_2(IArchiveUpdateCallback2, ICryptoGetTextPassword2)
+  Z7_IFACES_IMP_UNK_3(IArchiveUpdateCallback2, IArchiveUpdateCallbackFile, ICryptoGetTextPassword2)
   Z7_IFACE_COM7_IMP(IProgress)
   Z7_IFACE_COM7_IMP(IArchiveUpdateCallback)
 
@@ -641,10 +2473,21 @@ public:
   FStringVector FailedFiles;
   CRecordVector<HRESULT> FailedCodes;
 
+  // incremental mode: the indices of unchanged items in old archive or (-1) for new items
+  const CRecordVector<Int32> *ArcIndices;
+
+  // the files that were changed while the handler was reading them (kInFileChanged)
+  FStringVector ChangedFiles;
+  CUpdateOpProfile Profile;
+  // if (Progress) is set, SetTotal() / SetCompleted() are passed to it
+  CProgressReporter *Progress;
+
   CArchiveUpdateCallback():
       DirItems(NULL),
       PasswordIsDefined(false),
-      AskPassword(false)
+      AskPassword(false),
+      ArcIndices(NULL),
+      Progress(NULL)
       {}
 
   ~CArchiveUpdateCallback() { Finilize(); }
@@ -656,28 +2499,38 @@ public:
     m_NeedBeClosed = false;
     FailedFiles.Clear();
     FailedCodes.Clear();
+    ChangedFiles.Clear();
+    Profile.Start();
   }
 };
 
-Z7_COM7F_IMF(CArchiveUpdateCallback::SetTotal(UInt64 /* size */))
+Z7_COM7F_IMF(CArchiveUpdateCallback::SetTotal(UInt64 size))
 {
+  if (Progress)
+    Progress->SetTotal(size);
   return S_OK;
 }
 
-Z7_COM7F_IMF(CArchiveUpdateCallback::SetCompleted(const UInt64 * /* completeValue */))
+Z7_COM7F_IMF(CArchiveUpdateCallback::SetCompleted(const UInt64 *completeValue))
 {
+  if (Progress && completeValue)
+    Progress->SetCompleted(*completeValue);
   return S_OK;
 }
 
-Z7_COM7F_IMF(CArchiveUpdateCallback::GetUpdateItemInfo(UInt32 /* index */,
+Z7_COM7F_IMF(CArchiveUpdateCallback::GetUpdateItemInfo(UInt32 index,
       Int32 *newData, Int32 *newProperties, UInt32 *indexInArchive))
 {
+  Int32 arcIndex = -1;
+  if (ArcIndices)
+    arcIndex = (*ArcIndices)[index];
+  // unchanged item: the handler copies old packed data, but it uses new properties
   if (newData)
-    *newData = BoolToInt(true);
+    *newData = BoolToInt(arcIndex < 0);
   if (newProperties)
     *newProperties = BoolToInt(true);
   if (indexInArchive)
-    *indexInArchive = (UInt32)(Int32)-1;
+    *indexInArchive = (UInt32)arcIndex;
   return S_OK;
 }
 
@@ -730,10 +2583,19 @@ static void GetStream2(const wchar_t *name)
 
 Z7_COM7F_IMF(CArchiveUpdateCallback::GetStream(UInt32 index, ISequentialInStream **inStream))
 {
+  return GetStream2(index, inStream, NUpdateNotifyOp::kAdd);
+}
+
+/* the handler calls GetStream2() instead of GetStream(), if the callback supports
+   IArchiveUpdateCallbackFile. (notifyOp) is kAdd, kUpdate or kHashRead */
+
+Z7_COM7F_IMF(CArchiveUpdateCallback::GetStream2(UInt32 index, ISequentialInStream **inStream, UInt32 notifyOp))
+{
+  Profile.SetOp(notifyOp);
   RINOK(Finilize())
 
   const CDirItem &dirItem = (*DirItems)[index];
-  GetStream2(dirItem.Path_For_Handler);
+  ::GetStream2(dirItem.Path_For_Handler);
  
   if (dirItem.IsDir())
     return S_OK;
@@ -756,6 +2618,8 @@ Z7_COM7F_IMF(CArchiveUpdateCallback::GetStream(UInt32 index, ISequentialInStream
       }
       // return sysError;
     }
+    // the holes of sparse file are not read from disk. Other files are read as usual.
+    inStreamSpec->Set_Sparse(true);
     *inStream = inStreamLoc.Detach();
   }
   return S_OK;
@@ -767,6 +2631,22 @@ Z7_COM7F_IMF(CArchiveUpdateCallback::SetOperationResult(Int32 /* operationResult
   return S_OK;
 }
 
+Z7_COM7F_IMF(CArchiveUpdateCallback::ReportOperation(UInt32 indexType, UInt32 index, UInt32 notifyOp))
+{
+  Profile.SetOp(notifyOp);
+  if (notifyOp == NUpdateNotifyOp::kInFileChanged
+      && indexType == NArchive::NEventIndexType::kOutArcIndex
+      && index < DirItems->Size())
+  {
+    const FString path = DirPrefix + (*DirItems)[index].FullPath;
+    ChangedFiles.Add(path);
+    RINOK(Finilize())
+    PrintError("WARNING: the file was changed while it was being compressed", path);
+    PrintNewLine();
+  }
+  return S_OK;
+}
+
 Z7_COM7F_IMF(CArchiveUpdateCallback::GetVolumeSize(UInt32 index, UInt64 *size))
 {
   if (VolumesSizes.Size() == 0)
@@ -816,6 +2696,362 @@ Z7_COM7F_IMF(CArchiveUpdateCallback::CryptoGetTextPassword2(Int32 *passwordIsDef
 }
 
 
+//////////////////////////////////////////////////////////////
+// Order of items for solid compression
+
+enum EItemsOrder
+{
+  k_ItemsOrder_Source,   // the order of command line
+  k_ItemsOrder_Type,     // extension, name, size : similar files are compressed together
+  k_ItemsOrder_Physical  // position on disk : files are read sequentially
+};
+
+static const char * const k_ItemsOrderNames[] =
+{
+    "source"
+  , "type"
+  , "physical"
+};
+
+struct CItemsSortParam
+{
+  const CObjectVector<CDirItem> *Items;
+  const UInt64 *Keys; // for k_ItemsOrder_Physical
+};
+
+static const wchar_t *GetItemName(const UString &path)
+{
+  return path.Ptr(path.ReverseFind_PathSepar() + 1);
+}
+
+static const wchar_t *GetItemExtension(const wchar_t *name)
+{
+  const wchar_t *ext = NULL;
+  for (const wchar_t *p = name; *p != 0; p++)
+    if (*p == '.')
+      ext = p + 1;
+  return ext ? ext : name + MyStringLen(name);
+}
+
+static int CompareItems_Type(const unsigned *p1, const unsigned *p2, void *param)
+{
+  const CObjectVector<CDirItem> &items = *((const CItemsSortParam *)param)->Items;
+  const CDirItem &i1 = items[*p1];
+  const CDirItem &i2 = items[*p2];
+  // directories are before files
+  if (i1.IsDir() != i2.IsDir())
+    return i1.IsDir() ? -1 : 1;
+  if (!i1.IsDir())
+  {
+    const wchar_t *name1 = GetItemName(i1.Path_For_Handler);
+    const wchar_t *name2 = GetItemName(i2.Path_For_Handler);
+    int res = CompareFileNames(GetItemExtension(name1), GetItemExtension(name2));
+    if (res != 0)
+      return res;
+    res = CompareFileNames(name1, name2);
+    if (res != 0)
+      return res;
+    if (i1.Size != i2.Size)
+      return MyCompare(i1.Size, i2.Size);
+  }
+  const int res = CompareFileNames(i1.Path_For_Handler, i2.Path_For_Handler);
+  if (res != 0)
+    return res;
+  return MyCompare(*p1, *p2);
+}
+
+static int CompareItems_Physical(const unsigned *p1, const unsigned *p2, void *param)
+{
+  const UInt64 *keys = ((const CItemsSortParam *)param)->Keys;
+  const UInt64 k1 = keys[(size_t)*p1 * 2];
+  const UInt64 k2 = keys[(size_t)*p2 * 2];
+  if (k1 != k2)
+    return MyCompare(k1, k2);
+  const UInt64 m1 = keys[(size_t)*p1 * 2 + 1];
+  const UInt64 m2 = keys[(size_t)*p2 * 2 + 1];
+  if (m1 != m2)
+    return MyCompare(m1, m2);
+  return MyCompare(*p1, *p2);
+}
+
+/* the key for k_ItemsOrder_Physical is (volume, offset):
+   the physical offset of first extent, if the file system reports it.
+   Empty files and the files without offset are at the end with (volume == (UInt64)(Int64)-1).
+   They are sorted by inode number in POSIX, that is close to the order of allocation.
+   Directories are after them. */
+
+static void GetPhysicalSortKey(const CDirItem &di, UInt64 &volume, UInt64 &offset)
+{
+  volume = (UInt64)(Int64)-1;
+  offset = (UInt64)(Int64)-1;
+  if (di.IsDir())
+    return;
+ #ifndef _WIN32
+  offset = (UInt64)di.ino;
+  if (offset == (UInt64)(Int64)-1)
+    offset--;
+ #endif
+  if (di.Size == 0)
+    return;
+  NIO::CInFile file;
+  if (!file.Open(di.FullPath))
+    return;
+  UInt64 pos;
+  if (file.GetPhysicalOffset(pos))
+  {
+   #ifdef _WIN32
+    volume = 0;
+   #else
+    volume = (UInt64)di.dev;
+   #endif
+    offset = pos;
+  }
+}
+
+static void SortDirItems(CObjectVector<CDirItem> &dirItems, EItemsOrder order)
+{
+  if (order == k_ItemsOrder_Source || dirItems.Size() < 2)
+    return;
+  const unsigned numItems = dirItems.Size();
+  CUIntVector indices;
+  indices.ClearAndSetSize(numItems);
+  for (unsigned i = 0; i < numItems; i++)
+    indices[i] = i;
+
+  CItemsSortParam param;
+  param.Items = &dirItems;
+  param.Keys = NULL;
+
+  if (order == k_ItemsOrder_Type)
+    indices.Sort(CompareItems_Type, &param);
+  else
+  {
+    CRecordVector<UInt64> keys;
+    keys.ClearAndSetSize(numItems * 2);
+    for (unsigned i = 0; i < numItems; i++)
+      GetPhysicalSortKey(dirItems[i], keys[i * 2], keys[i * 2 + 1]);
+    param.Keys = keys.ConstData();
+    indices.Sort(CompareItems_Physical, &param);
+  }
+
+  CObjectVector<CDirItem> items;
+  items.ClearAndReserve(numItems);
+  for (unsigned i = 0; i < numItems; i++)
+    items.AddInReserved(dirItems[indices[i]]);
+  dirItems = items;
+}
+
+
+
+//////////////////////////////////////////////////////////////
+// Deduplication of identical files
+
+/*
+  7z format has no links to data of another item. So we can't write
+  only one copy of identical files. Instead we place the identical files
+  next to each other in the list of items. 7z handler keeps that order in
+  solid block (if sorting by type (qs) is not enabled), and LZ encoder
+  encodes second copy as long matches to first copy,
+  if the file is smaller than dictionary.
+  Directories keep their positions, and the files are reordered
+  only in the positions of files.
+  In incremental mode the unchanged items are copied from old archive without
+  compression. So only new and changed files are hashed and reordered,
+  and the unchanged items keep their positions: (arcIndices) stays valid.
+*/
+
+static const unsigned kNumDedupThreads = 4;
+
+// (arcIndices) is NULL or it's the result of FindUnchangedItems()
+static HRESULT PlaceIdenticalFilesTogether(CObjectVector<CDirItem> &dirItems,
+    const CRecordVector<Int32> *arcIndices)
+{
+  FStringVector paths;
+  CRecordVector<UInt64> sizes;
+  CUIntVector fileIndices;
+  FOR_VECTOR (i, dirItems)
+  {
+    const CDirItem &di = dirItems[i];
+    if (di.IsDir())
+      continue;
+    if (arcIndices && (*arcIndices)[i] >= 0)
+      continue;
+    fileIndices.Add(i);
+    paths.Add(di.FullPath);
+    sizes.Add(di.Size);
+  }
+
+  CUniqFiles uniq;
+  uniq.NumThreads = kNumDedupThreads;
+  RINOK(uniq.Find(paths, sizes))
+  {
+    char s[32];
+    Print("Identical files: ");
+    ConvertUInt64ToString(uniq.NumDupFiles, s);
+    Print(s);
+    Print("  size: ");
+    ConvertUInt64ToString(uniq.DupBytes, s);
+    Print(s);
+    Print("  hashed: ");
+    ConvertUInt64ToString(uniq.NumHashedFiles, s);
+    Print(s);
+    PrintNewLine();
+  }
+  if (uniq.NumDupFiles == 0)
+    return S_OK;
+
+  CUIntVector order;
+  uniq.GetAdjacentOrder(order);
+  CObjectVector<CDirItem> items;
+  items.ClearAndReserve(dirItems.Size());
+  unsigned k = 0;
+  FOR_VECTOR (i, dirItems)
+  {
+    if (k == fileIndices.Size() || fileIndices[k] != i)
+      items.AddInReserved(dirItems[i]);
+    else
+      items.AddInReserved(dirItems[fileIndices[order[k++]]]);
+  }
+  dirItems = items;
+  return S_OK;
+}
+
+
+
+//////////////////////////////////////////////////////////////
+// Incremental update
+
+/*
+  In incremental mode we open the existing archive and look for the item
+  with the same path for each new item. If the sizes and modification times
+  are equal (and CRCs, if (compareCrc) mode), the item is unchanged.
+  Then GetUpdateItemInfo() returns (newData = 0) and the index of old item,
+  and the handler copies packed data from old archive without recompression.
+  The items of old archive that are not in (dirItems) are removed.
+*/
+
+// it compares the times with the precision of timestamp stored in archive
+static bool AreTimesEqual_for_ArcPrec(const CArcTime &arcTime, const CFiTime &fileTime)
+{
+  if (!arcTime.Def)
+    return false;
+  FILETIME ft;
+ #ifdef _WIN32
+  ft = fileTime;
+ #else
+  FiTime_To_FILETIME(fileTime, ft);
+ #endif
+  UInt64 unit = 1; // in 100 ns
+  if (arcTime.Prec == k_PropVar_TimePrec_Unix)
+    unit = 10000000;
+  else if (arcTime.Prec == k_PropVar_TimePrec_DOS)
+    unit = 20000000;
+  else if (arcTime.Prec >= k_PropVar_TimePrec_Base
+      && arcTime.Prec < k_PropVar_TimePrec_100ns)
+    for (unsigned i = arcTime.Prec; i < k_PropVar_TimePrec_100ns; i++)
+      unit *= 10;
+  const UInt64 t1 = FILETIME_To_UInt64(arcTime.FT);
+  const UInt64 t2 = FILETIME_To_UInt64(ft);
+  // archive handler can truncate or round the time
+  return (t1 < t2 ? t2 - t1 : t1 - t2) < unit;
+}
+
+static bool CalcFileCrc(const FString &path, CByteBuffer &buf, UInt32 &crc)
+{
+  NIO::CInFile file;
+  if (!file.Open(path))
+    return false;
+  const size_t kBufSize = (size_t)1 << 20;
+  if (buf.Size() != kBufSize)
+    buf.Alloc(kBufSize);
+  UInt32 v = CRC_INIT_VAL;
+  for (;;)
+  {
+    size_t processed;
+    if (!file.ReadFull(buf, kBufSize, processed))
+      return false;
+    if (processed == 0)
+      break;
+    v = CrcUpdate(v, buf, processed);
+  }
+  crc = CRC_GET_DIGEST(v);
+  return true;
+}
+
+static int CompareArcItemPaths(const unsigned *p1, const unsigned *p2, void *param)
+{
+  const CArcItemsSnapshot &snapshot = *(const CArcItemsSnapshot *)param;
+  return CompareFileNames(snapshot.GetPath(*p1), snapshot.GetPath(*p2));
+}
+
+// it sets (arcIndices[i]) to the index of unchanged item in archive or to (-1)
+static HRESULT FindUnchangedItems(IInArchive *archive, const CArcItemsSnapshot &snapshot,
+    const CObjectVector<CDirItem> &dirItems, bool compareCrc,
+    CRecordVector<Int32> &arcIndices, unsigned &numUnchanged)
+{
+  numUnchanged = 0;
+  const unsigned numArcItems = snapshot.Size();
+  CRecordVector<unsigned> sorted; // indices of archive items sorted by path
+  sorted.ClearAndSetSize(numArcItems);
+  for (unsigned i = 0; i < numArcItems; i++)
+    sorted[i] = i;
+  sorted.Sort(CompareArcItemPaths, (void *)&snapshot);
+
+  CByteBuffer buf;
+  arcIndices.ClearAndReserve(dirItems.Size());
+
+  FOR_VECTOR (i, dirItems)
+  {
+    const CDirItem &di = dirItems[i];
+    Int32 arcIndex = -1;
+    unsigned left = 0, right = numArcItems;
+    while (left != right)
+    {
+      const unsigned mid = (left + right) / 2;
+      const unsigned index = sorted[mid];
+      const int comp = CompareFileNames(di.Path_For_Handler, snapshot.GetPath(index));
+      if (comp == 0)
+      {
+        arcIndex = (Int32)index;
+        break;
+      }
+      if (comp < 0)
+        right = mid;
+      else
+        left = mid + 1;
+    }
+
+    if (arcIndex >= 0)
+    {
+      const unsigned index = (unsigned)arcIndex;
+      bool same = (snapshot.IsDir(index) == di.IsDir());
+      if (same && !di.IsDir())
+      {
+        same = snapshot.SizeDefined(index)
+            && snapshot.Sizes[index] == di.Size
+            && AreTimesEqual_for_ArcPrec(snapshot.MTimes[index], di.MTime);
+        if (same && compareCrc)
+        {
+          NCOM::CPropVariant prop;
+          RINOK(archive->GetProperty(index, kpidCRC, &prop))
+          UInt32 crc;
+          same = (prop.vt == VT_UI4)
+              && CalcFileCrc(di.FullPath, buf, crc)
+              && crc == prop.ulVal;
+        }
+      }
+      if (!same)
+        arcIndex = -1;
+      else
+        numUnchanged++;
+    }
+    arcIndices.AddInReserved(arcIndex);
+  }
+  return S_OK;
+}
+
+
+
 // Main function
 
 #if defined(_UNICODE) && !defined(_WIN64) && !defined(UNDER_CE)
@@ -824,30 +3060,35 @@ Z7_COM7F_IMF(CArchiveUpdateCallback::CryptoGetTextPassword2(Int32 *passwordIsDef
 
 int Z7_CDECL main(int numArgs, const char *args[])
 {
+  CrcGenerateTable();
 
   FString dllPrefix;
   dllPrefix = NDLL::GetModuleDirPrefix();
 
-  NDLL::CLibrary lib;
-  if (!lib.Load(dllPrefix + FTEXT(kDllName)))
+  // it measures the cost of loading of library for each operation
+  const bool benchmarkArcLibrary = false;
+  if (benchmarkArcLibrary)
   {
-    PrintError("Cannot load 7-zip library");
-    return 1;
+    BenchmarkArcLibrary(dllPrefix + FTEXT(kDllName), 100);
+    return 0;
   }
 
-#ifdef _WIN32
-Z7_DIAGNOSTIC_IGNORE_CAST_FUNCTION
-#endif
+  // it compares write() / pread() with io_uring for big sequential file
+  const bool benchmarkFileIO = false;
+  if (benchmarkFileIO)
+  {
+    BenchmarkFileIO(FString(FTEXT("7z_client_io.tmp")), (UInt64)1 << 30);
+    return 0;
+  }
 
-  Func_CreateObject
-     f_CreateObject = Z7_GET_PROC_ADDRESS(
-  Func_CreateObject, lib.Get_HMODULE(),
-      "CreateObject");
-  if (!f_CreateObject)
+  // the library is loaded once per process. Next GetArcLibrary() calls use cached library
+  const CArcLibrary *arcLib;
+  if (GetArcLibrary(dllPrefix + FTEXT(kDllName), arcLib) != S_OK)
   {
-    PrintError("Cannot get CreateObject");
+    PrintError("Cannot load 7-zip library");
     return 1;
   }
+  Func_CreateObject f_CreateObject = arcLib->CreateObjectFunc;
 
   UString password;
   bool passwordIsDefined = false;
@@ -857,6 +3098,44 @@ Z7_DIAGNOSTIC_IGNORE_CAST_FUNCTION
   const wchar_t* arc_path = LR"()";
   const FString &archiveName = arc_path;
 
+  // (a) command updates existing archive: unchanged files are not recompressed
+  const bool incrementalUpdate = true;
+  // (a) command also compares CRC of unchanged files (it reads all files)
+  const bool compareCrc = false;
+
+  // (a) command places identical files next to each other in solid block
+  const bool dedupFiles = true;
+
+  // (a) command sorts the files before compression: see EItemsOrder
+  const EItemsOrder itemsOrder = k_ItemsOrder_Type;
+
+  // (x) command reads archive and writes files with O_DIRECT: page cache is not polluted
+  const bool directIO = false;
+
+  // (x) command writes all-zero blocks of files as holes (sparse files)
+  const bool sparseFiles = false;
+
+  /* (x) command copies the items of zip archive stored without compression from archive file
+     to output files in kernel (copy_file_range, reflink). Then it reads the copied data for CRC check. */
+  const bool copyStoredItems = false;
+
+  /* (a) and (x) commands show the progress in stderr not more than
+     (MaxUpdatesPerSec) times per second.
+     If (FeedPath) is not empty, the progress is also written
+     to that file as JSON lines for job scheduler. */
+  CProgressReporter progress;
+  progress.MaxUpdatesPerSec = 4;
+  progress.FeedPath.Empty();
+
+  // the format and the columns of output of list command
+  EListFormat listFormat = k_ListFormat_Text;
+  UInt32 listColumns = k_ListColumns_Default;
+  if (!ParseListColumns("path,size,mtime,dir", listColumns))
+  {
+    PrintError("Unsupported list column");
+    return 1;
+  }
+
   char c = 0;
   if (c == 'a')
   {
@@ -885,30 +3164,144 @@ Z7_DIAGNOSTIC_IGNORE_CAST_FUNCTION
       }
     }
 
-    COutFileStream *outFileStreamSpec = new COutFileStream;
-    CMyComPtr<IOutStream> outFileStream = outFileStreamSpec;
-    if (!outFileStreamSpec->Create_NEW(archiveName))
+    SortDirItems(dirItems, itemsOrder);
+
+    // if archive exists, we update it in incremental mode
+    const bool updateMode = incrementalUpdate && NFind::DoesFileExist_Raw(archiveName);
+
+    CMyComPtr<IInArchive> oldArchive;
+    CMyComPtr<IInStream> oldFile;
+    CRecordVector<Int32> arcIndices;
+    CMyComPtr<IOutArchive> outArchive;
+    
+    if (updateMode)
     {
-      PrintError("can't create archive file");
+      CInFileStream *oldFileSpec = new CInFileStream;
+      oldFile = oldFileSpec;
+      if (!oldFileSpec->Open(archiveName))
+      {
+        PrintError("Cannot open archive file", archiveName);
+        return 1;
+      }
+      CArchiveOpenCallback *openCallbackSpec = new CArchiveOpenCallback;
+      CMyComPtr<IArchiveOpenCallback> openCallback(openCallbackSpec);
+      openCallbackSpec->PasswordIsDefined = passwordIsDefined;
+      openCallbackSpec->Password = password;
+      openCallbackSpec->ArcPath = archiveName;
+      CArcDetector detector;
+      detector.Library = arcLib;
+      int formatIndex;
+      if (detector.Open(oldFile, archiveName, openCallback, oldArchive, formatIndex) != S_OK)
+      {
+        PrintError("Cannot open file as archive", archiveName);
+        return 1;
+      }
+      CArcItemsSnapshot oldItems;
+      unsigned numUnchanged = 0;
+      if (oldItems.Load(oldArchive,
+              CArcItemsSnapshot::kProp_Path
+            | CArcItemsSnapshot::kProp_IsDir
+            | CArcItemsSnapshot::kProp_Size
+            | CArcItemsSnapshot::kProp_MTime) != S_OK
+          || FindUnchangedItems(oldArchive, oldItems, dirItems, compareCrc, arcIndices, numUnchanged) != S_OK)
+      {
+        PrintError("Cannot read the properties of items", archiveName);
+        return 1;
+      }
+      {
+        char s[32];
+        Print("Unchanged items: ");
+        ConvertUInt32ToString(numUnchanged, s);
+        Print(s);
+        Print("  New or changed items: ");
+        ConvertUInt32ToString(dirItems.Size() - numUnchanged, s);
+        Print(s);
+        PrintNewLine();
+      }
+      // the handler that has opened old archive can copy the data of old items
+      if (oldArchive.QueryInterface(IID_IOutArchive, &outArchive) != S_OK)
+      {
+        PrintError("Update operations are not supported for this archive");
+        return 1;
+      }
+    }
+    else if (f_CreateObject(&CLSID_Format, &IID_IOutArchive, (void **)&outArchive) != S_OK)
+    {
+      PrintError("Cannot get class object");
       return 1;
     }
 
-    CMyComPtr<IOutArchive> outArchive;
-    if (f_CreateObject(&CLSID_Format, &IID_IOutArchive, (void **)&outArchive) != S_OK)
+    // the unchanged items are known here, so we don't hash them
+    if (dedupFiles)
+      if (PlaceIdenticalFilesTogether(dirItems, updateMode ? &arcIndices : NULL) != S_OK)
+      {
+        PrintError("Cannot find identical files");
+        return 1;
+      }
+
+    // in update mode we write new archive to temp file, and then we replace old archive
+    FString outName = archiveName;
+    if (updateMode)
+      outName += ".tmp";
+
+    COutFileStream *outFileStreamSpec = new COutFileStream;
+    CMyComPtr<IOutStream> outFileStream = outFileStreamSpec;
+    if (!(updateMode ?
+        outFileStreamSpec->Create_ALWAYS(outName) :
+        outFileStreamSpec->Create_NEW(outName)))
     {
-      PrintError("Cannot get class object");
+      PrintError("can't create archive file");
       return 1;
     }
+    // the kernel writes the filled blocks, while the handler compresses next data.
+    // If io_uring is not available, the stream uses write().
+    outFileStreamSpec->Set_WriteQueue(4);
 
     CArchiveUpdateCallback *updateCallbackSpec = new CArchiveUpdateCallback;
     CMyComPtr<IArchiveUpdateCallback2> updateCallback(updateCallbackSpec);
     updateCallbackSpec->Init(&dirItems);
     updateCallbackSpec->PasswordIsDefined = passwordIsDefined;
     updateCallbackSpec->Password = password;
+    if (updateMode)
+      updateCallbackSpec->ArcIndices = &arcIndices;
+    updateCallbackSpec->Progress = &progress;
+
+    // the size of written archive is used for compression ratio in progress
+    CProgressOutStream *progressStreamSpec = new CProgressOutStream;
+    CMyComPtr<IOutStream> progressStream = progressStreamSpec;
+    progressStreamSpec->Init(outFileStream, &progress);
 
-    HRESULT result = outArchive->UpdateItems(outFileStream, dirItems.Size(), updateCallback);
+    progress.Operation = "update";
+    if (!progress.Start())
+    {
+      PrintError("Cannot create progress file", progress.FeedPath);
+      return 1;
+    }
+    const std::chrono::steady_clock::time_point updateStart = std::chrono::steady_clock::now();
+    HRESULT result = outArchive->UpdateItems(progressStream, dirItems.Size(), updateCallback);
+    const UInt64 updateTime_ms = GetTimeDiff_ms(updateStart);
+    progress.Stop();
     
     updateCallbackSpec->Finilize();
+    updateCallbackSpec->Profile.Finish();
+    if (result == S_OK)
+      result = outFileStreamSpec->Close();
+    
+    if (updateMode)
+    {
+      outArchive.Release();
+      oldArchive->Close();
+      oldArchive.Release();
+      oldFile.Release();
+      if (result != S_OK)
+        DeleteFileAlways(outName);
+      // the old archive is replaced in one operation: so it's kept, if the replacement fails
+      else if (!MyReplaceFile(outName, archiveName))
+      {
+        PrintError("Cannot replace archive file", archiveName);
+        return 1;
+      }
+    }
     
     if (result != S_OK)
     {
@@ -916,6 +3309,23 @@ Z7_DIAGNOSTIC_IGNORE_CAST_FUNCTION
       return 1;
     }
     
+    updateCallbackSpec->Profile.PrintProfile();
+
+    // the results for comparison of (itemsOrder) modes
+    {
+      NFind::CFileInfo arcInfo;
+      char s[32];
+      Print("Order: ");
+      Print(k_ItemsOrderNames[itemsOrder]);
+      Print("  time: ");
+      ConvertUInt64ToString(updateTime_ms, s);
+      Print(s);
+      Print(" ms  archive size: ");
+      ConvertUInt64ToString(arcInfo.Find(archiveName) ? arcInfo.Size : 0, s);
+      Print(s);
+      PrintNewLine();
+    }
+
     FOR_VECTOR (i, updateCallbackSpec->FailedFiles)
     {
       PrintNewLine();
@@ -925,6 +3335,90 @@ Z7_DIAGNOSTIC_IGNORE_CAST_FUNCTION
     if (updateCallbackSpec->FailedFiles.Size() != 0)
       return 1;
   }
+  else if (c == 'b')
+  {
+    CObjectVector<FString> arc_list;
+    arc_list.Add(archiveName);
+
+    CBatchExtractOptions options;
+    options.OutDir = FString(LR"(C:\Users\ewing\Desktop\archive_temp)");
+    options.DirectIO = directIO;
+    options.Sparse = sparseFiles;
+    options.PasswordIsDefined = passwordIsDefined;
+    options.Password = password;
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    CObjectVector<CBatchArcResult> results;
+    ExtractArchives_Batch(arcLib, options, arc_list, results);
+    PrintBatchResults(arc_list, results, GetTimeDiff_ms(start));
+
+    FOR_VECTOR (i, results)
+      if (results[i].Result != S_OK || results[i].NumErrors != 0)
+        return 1;
+  }
+  else if (c == 'm')
+  {
+    CMyComPtr<IInArchive> archive;
+    CMyComPtr<IInStream> file;
+    HRESULT openRes = OpenInStream_Volumes(archiveName, 0, file);
+    if (openRes == S_FALSE)
+      openRes = OpenInStream_Mapped_or_File(archiveName, file);
+    if (openRes != S_OK)
+    {
+      PrintError("Cannot open archive file", archiveName);
+      return 1;
+    }
+    {
+      CArchiveOpenCallback *openCallbackSpec = new CArchiveOpenCallback;
+      CMyComPtr<IArchiveOpenCallback> openCallback(openCallbackSpec);
+      openCallbackSpec->PasswordIsDefined = passwordIsDefined;
+      openCallbackSpec->Password = password;
+      openCallbackSpec->ArcPath = archiveName;
+      CArcDetector detector;
+      detector.Library = arcLib;
+      int formatIndex;
+      if (detector.Open(file, archiveName, openCallback, archive, formatIndex) != S_OK)
+      {
+        PrintError("Cannot open file as archive", archiveName);
+        return 1;
+      }
+    }
+
+    CPrintExtractToMemHandler handler;
+    CRecordVector<UInt32> indices;
+    UInt64 numErrors = 0;
+    HRESULT result = S_OK;
+    if (!params.IsEmpty())
+    {
+      UStringVector masks;
+      FOR_VECTOR (i, params)
+        masks.Add(fs2us(params[i]));
+      NWildcard::CCensor censor;
+      AddMasksToCensor(censor, masks, true);
+      CRecordVector<UInt32> itemIndices;
+      CArcItemsSnapshot snapshot;
+      result = snapshot.Load(archive, CArcItemsSnapshot::kProp_Path | CArcItemsSnapshot::kProp_IsDir);
+      if (result == S_OK)
+        result = GetSelectedIndices(snapshot, censor, itemIndices, indices);
+    }
+    // empty (indices) means all items. So we skip extraction, if no item was selected
+    if (result == S_OK && (params.IsEmpty() || !indices.IsEmpty()))
+      result = ExtractToMemory(archive, indices, &handler, passwordIsDefined, password, numErrors);
+    {
+      char temp[32];
+      ConvertUInt64ToString(handler.TotalSize, temp);
+      Print("Total size : ");
+      Print(temp);
+      PrintNewLine();
+    }
+    if (result != S_OK)
+    {
+      PrintError("Extract Error");
+      return 1;
+    }
+    if (numErrors != 0)
+      return 1;
+  }
   else
   {
     bool listCommand;
@@ -940,61 +3434,107 @@ Z7_DIAGNOSTIC_IGNORE_CAST_FUNCTION
     }
   
     CMyComPtr<IInArchive> archive;
-    if (f_CreateObject(&CLSID_Format, &IID_IInArchive, (void **)&archive) != S_OK)
+    CMyComPtr<IInStream> file;
+    // it's set, if archive is one file that is read via CInFileStream
+    CInFileStream *arcFileSpec = NULL;
+    
+    // the volumes are read with prefetching of next volume in extract command
+    const HRESULT volRes = OpenInStream_Volumes(archiveName, listCommand ? 0 : 4, file);
+    if (volRes != S_FALSE)
     {
-      PrintError("Cannot get class object");
-      return 1;
+      if (volRes != S_OK)
+      {
+        PrintError("Cannot open archive file", archiveName);
+        return 1;
+      }
     }
-    
-    CInFileStream *fileSpec = new CInFileStream;
-    CMyComPtr<IInStream> file = fileSpec;
-    
-    if (!fileSpec->Open(archiveName))
+    else if (listCommand)
     {
-      PrintError("Cannot open archive file", archiveName);
-      return 1;
+      // IInArchive::Open() does many small reads and seeks.
+      // So we use memory mapping, if it's possible. Otherwise it's CInFileStream.
+      if (OpenInStream_Mapped_or_File(archiveName, file) != S_OK)
+      {
+        PrintError("Cannot open archive file", archiveName);
+        return 1;
+      }
+    }
+    else
+    {
+      CInFileStream *fileSpec = new CInFileStream;
+      file = fileSpec;
+      arcFileSpec = fileSpec;
+      if (!fileSpec->Open(archiveName))
+      {
+        PrintError("Cannot open archive file", archiveName);
+        return 1;
+      }
+      // solid blocks are decoded sequentially. So the thread can read next blocks of archive.
+      // if prefetching is not supported, we use direct reading.
+      // In direct I/O mode the bounce buffer of file is used instead of prefetching.
+      // the holes of sparse archive are read from memory, and the stored items are copied with holes.
+      const bool sparseArc = (copyStoredItems && sparseFiles && fileSpec->Set_Sparse(true) == S_OK);
+      if (!sparseArc && (!directIO || !fileSpec->Set_DirectIO(true, (size_t)1 << 22)))
+        fileSpec->Set_Prefetch(4);
     }
 
+    int formatIndex = -1;
     {
       CArchiveOpenCallback *openCallbackSpec = new CArchiveOpenCallback;
       CMyComPtr<IArchiveOpenCallback> openCallback(openCallbackSpec);
       openCallbackSpec->PasswordIsDefined = passwordIsDefined;
       openCallbackSpec->Password = password;
+      openCallbackSpec->ArcPath = archiveName;
       
-      const UInt64 scanSize = 1ull << 23;
-      auto archive_open = archive->Open(file, &scanSize, openCallback) ;
-      if (archive_open != S_OK)
+      CArcDetector detector;
+      detector.Library = arcLib;
+      if (detector.Open(file, archiveName, openCallback, archive, formatIndex) != S_OK)
       {
         PrintError("Cannot open file as archive", archiveName);
         return 1;
       }
     }
-    
+
+    // the stored items are copied only from zip archive: see CArchiveExtractCallback::ArcFileStream
+    const bool copyStored = copyStoredItems && arcFileSpec
+        && arcLib->Formats[(unsigned)formatIndex].Name.IsEqualTo_Ascii_NoCase("zip");
+    // we read the metadata of all items once. Then both commands use that snapshot.
+    // The list command reads only the properties that it prints.
+    UInt32 snapshotProps = CArcItemsSnapshot::kProp_All;
     if (listCommand)
+      snapshotProps = (listFormat == k_ListFormat_Text ?
+          (UInt32)(CArcItemsSnapshot::kProp_Path | CArcItemsSnapshot::kProp_Size) :
+          listColumns);
+    CArcItemsSnapshot snapshot;
+    if (snapshot.Load(archive, snapshotProps, copyStored) != S_OK)
+    {
+      PrintError("Cannot read the properties of items", archiveName);
+      return 1;
+    }
+    
+    if (listCommand && listFormat != k_ListFormat_Text)
+    {
+      if (ListItems_Machine(snapshot, listFormat, listColumns) != S_OK)
+      {
+        PrintError("Cannot write the list of items");
+        return 1;
+      }
+    }
+    else if (listCommand)
     {
       // List command
-      UInt32 numItems = 0;
-      archive->GetNumberOfItems(&numItems);
-      for (UInt32 i = 0; i < numItems; i++)
+      const unsigned numItems = snapshot.Size();
+      for (unsigned i = 0; i < numItems; i++)
       {
         {
-          // Get uncompressed size of file
-          NCOM::CPropVariant prop;
-          archive->GetProperty(i, kpidSize, &prop);
-          char s[64];
-          ConvertPropVariantToShortString(prop, s);
+          // uncompressed size of file
+          char s[32];
+          s[0] = 0;
+          if (snapshot.SizeDefined(i))
+            ConvertUInt64ToString(snapshot.Sizes[i], s);
           Print(s);
           Print("  ");
         }
-        {
-          // Get name of file
-          NCOM::CPropVariant prop;
-          archive->GetProperty(i, kpidPath, &prop);
-          if (prop.vt == VT_BSTR)
-            Print(prop.bstrVal);
-          else if (prop.vt != VT_EMPTY)
-            Print("ERROR!");
-        }
+        Print(snapshot.GetPath(i));
         PrintNewLine();
       }
     }
@@ -1003,17 +3543,56 @@ Z7_DIAGNOSTIC_IGNORE_CAST_FUNCTION
       // Extract command
       CArchiveExtractCallback *extractCallbackSpec = new CArchiveExtractCallback;
       CMyComPtr<IArchiveExtractCallback> extractCallback(extractCallbackSpec);
+      extractCallbackSpec->WriteBehind = true;
+      extractCallbackSpec->DirectIO = directIO;
+      extractCallbackSpec->Sparse = sparseFiles;
+      if (copyStored)
+        extractCallbackSpec->ArcFileStream = arcFileSpec;
       extractCallbackSpec->Init(archive, FString(LR"(C:\Users\ewing\Desktop\archive_temp)")); // second parameter is output folder path
       extractCallbackSpec->PasswordIsDefined = passwordIsDefined;
       extractCallbackSpec->Password = password;
+      extractCallbackSpec->Snapshot = &snapshot;
+      extractCallbackSpec->Progress = &progress;
 
-      HRESULT result = archive->Extract(NULL, (UInt32)(Int32)(-1), false, extractCallback);
+      progress.Operation = "extract";
+      if (!progress.Start())
+      {
+        PrintError("Cannot create progress file", progress.FeedPath);
+        return 1;
+      }
+      HRESULT result;
+      if (params.IsEmpty())
+        result = archive->Extract(NULL, (UInt32)(Int32)(-1), false, extractCallback);
+      else
+      {
+        // fileName parameters are wildcards for paths of items in archive
+        UStringVector masks;
+        FOR_VECTOR (i, params)
+          masks.Add(fs2us(params[i]));
+        NWildcard::CCensor censor;
+        AddMasksToCensor(censor, masks, true);
+        CRecordVector<UInt32> itemIndices;
+        CRecordVector<UInt32> indices;
+        result = GetSelectedIndices(snapshot, censor, itemIndices, indices);
+        if (result == S_OK && !indices.IsEmpty())
+          result = archive->Extract(indices.ConstData(), indices.Size(), false, extractCallback);
+      }
+      progress.Stop();
   
       if (result != S_OK)
       {
         PrintError("Extract Error");
         return 1;
       }
+      if (sparseFiles)
+      {
+        char s[32];
+        ConvertUInt64ToString(extractCallbackSpec->SparseSkippedSize, s);
+        Print("Sparse holes: ");
+        Print(s);
+        Print(" bytes");
+        PrintNewLine();
+      }
     }
   }
 
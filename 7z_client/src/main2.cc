@@ -20,6 +20,8 @@
 #include "cpp/Windows/NtCheck.h"
 #include "cpp/Windows/PropVariant.h"
 #include "cpp/Windows/PropVariantConv.h"
+#include "cpp/7zip/Common/ArcLibrary.h"
+#include "cpp/7zip/Common/DirScanner.h"
 #include "cpp/7zip/Common/FileStreams.h"
 #include "cpp/7zip/Archive/IArchive.h"
 #include "cpp/7zip/IPassword.h"
@@ -52,6 +54,10 @@ using namespace NDir;
 #define kDllName "7z.so"
 #endif
 
+// the number of threads that scan the directories.
+// stat() latency of network file systems is hidden by parallel requests.
+static const unsigned kNumScanThreads = 8;
+
 // Utility functions for output
 static void Convert_UString_to_AString(const UString &s, AString &temp) {
   int codePage = CP_OEMCP;
@@ -213,6 +219,8 @@ Z7_COM7F_IMF(CArchiveUpdateCallback::GetStream(UInt32 index, ISequentialInStream
       FailedFiles.Add(dirItem.FullPath);
       return S_FALSE;
     }
+    // the holes of sparse file are not read from disk
+    inStreamSpec->Set_Sparse(true);
     *inStream = inStreamLoc.Detach();
   }
   return S_OK;
@@ -271,23 +279,16 @@ public:
                            const std::string& archive_path) {
     Print("Starting file compression...\n");
     
-    // Load 7z library
+    // Load 7z library: it's loaded once per process, next calls use cached library
     FString dll_prefix;
     dll_prefix = NDLL::GetModuleDirPrefix();
 
-    NDLL::CLibrary lib;
-    if (!lib.Load(dll_prefix + FTEXT(kDllName))) {
+    const CArcLibrary *arc_lib;
+    if (GetArcLibrary(dll_prefix + FTEXT(kDllName), arc_lib) != S_OK) {
       PrintError("Cannot load 7-zip library");
       return false;
     }
-
-    // Get CreateObject function
-    Func_CreateObject f_CreateObject = Z7_GET_PROC_ADDRESS(
-        Func_CreateObject, lib.Get_HMODULE(), "CreateObject");
-    if (!f_CreateObject) {
-      PrintError("Cannot get CreateObject function");
-      return false;
-    }
+    Func_CreateObject f_CreateObject = arc_lib->CreateObjectFunc;
 
     // Collect all files (including files from directories)
     CObjectVector<CDirItem> dir_items;
@@ -362,96 +363,74 @@ public:
   }
 
 private:
-  // Recursively collect files from given paths (files and directories)
+  // Collect files from given paths (files and directories).
+  // The directories are scanned recursively in several threads.
   static bool CollectFilesFromPaths(const std::vector<std::string>& file_paths,
                                    CObjectVector<CDirItem>& dir_items) {
+    FStringVector fs_paths;
     for (const auto& file_path : file_paths) {
-      FString fs_path = CmdStringToFString(file_path.c_str());
-      
-      NFind::CFileInfo file_info;
-      if (!file_info.Find(fs_path)) {
-        PrintError("Cannot find file or directory", fs_path);
-        return false;
-      }
+      fs_paths.Add(CmdStringToFString(file_path.c_str()));
+    }
 
-      if (file_info.IsDir()) {
-        // Process directory recursively
-        Print("Processing directory: ");
-        Print(file_path.c_str());
-        PrintNewLine();
-        
-        if (!CollectFilesFromDirectory(fs_path, L"", dir_items)) {
-          return false;
-        }
-      } else {
-        // Process single file
-        CDirItem dir_item(file_info);
-        dir_item.Path_For_Handler = fs2us(fs_path.Ptr(fs_path.ReverseFind_PathSepar() + 1));
-        dir_item.FullPath = fs_path;
-        dir_items.Add(dir_item);
-        
-        Print("Added file: ");
-        Print(file_path.c_str());
-        PrintNewLine();
+    CDirScanner scanner;
+    CDirScanOptions scan_options;
+    scan_options.NumThreads = kNumScanThreads;
+    scan_options.Recursive = true;
+    if (scanner.Scan(fs_paths, scan_options) != S_OK) {
+      PrintError("Cannot scan files: not enough memory");
+      return false;
+    }
+
+    if (scanner.Errors.Size() != 0) {
+      for (unsigned i = 0; i < scanner.Errors.Size(); i++) {
+        PrintError("Cannot find file or directory", scanner.Errors[i].Path);
       }
+      return false;
     }
+
+    // the items are sorted by (root path, relative path)
+    dir_items.ClearAndReserve(scanner.Items.Size());
+    for (unsigned i = 0; i < scanner.Items.Size(); i++) {
+      const CDirScanItem &scan_item = scanner.Items[i];
+      CDirItem dir_item(scan_item.Info);
+      dir_item.Path_For_Handler = scan_item.RelPath;
+      dir_item.FullPath = scan_item.FullPath;
+      dir_items.AddInReserved(dir_item);
+    }
+
+    PrintScanStat(scanner.Stat);
     return true;
   }
 
-  // Recursively collect files from a directory
-  static bool CollectFilesFromDirectory(const FString& dir_path,
-                                       const UString& relative_path,
-                                       CObjectVector<CDirItem>& dir_items) {
-    NFind::CEnumerator enumerator;
-    enumerator.SetDirPrefix(dir_path);
-    
-    NFind::CFileInfo file_info;
-    while (enumerator.Next(file_info)) {
-      if (file_info.IsDir()) {
-        // Skip current and parent directory entries
-        if (file_info.Name.IsEqualTo(".") || file_info.Name.IsEqualTo("..")) {
-          continue;
-        }
-        
-        // Recursively process subdirectory
-        FString sub_dir_path = dir_path;
-        sub_dir_path.Add_PathSepar();
-        sub_dir_path += file_info.Name;
-        
-        UString sub_relative_path = relative_path;
-        if (!sub_relative_path.IsEmpty()) {
-          sub_relative_path.Add_PathSepar();
-        }
-        sub_relative_path += fs2us(file_info.Name);
-        
-        if (!CollectFilesFromDirectory(sub_dir_path, sub_relative_path, dir_items)) {
-          return false;
-        }
-      } else {
-        // Add file to collection
-        CDirItem dir_item(file_info);
-        
-        // Set relative path for archive
-        UString file_relative_path = relative_path;
-        if (!file_relative_path.IsEmpty()) {
-          file_relative_path.Add_PathSepar();
-        }
-        file_relative_path += fs2us(file_info.Name);
-        dir_item.Path_For_Handler = file_relative_path;
-        
-        // Set full path for file system
-        dir_item.FullPath = dir_path;
-        dir_item.FullPath.Add_PathSepar();
-        dir_item.FullPath += file_info.Name;
-        
-        dir_items.Add(dir_item);
-        
-        Print("  Found file: ");
-        Print(fs2us(file_relative_path));
-        PrintNewLine();
-      }
+  static void PrintScanStat(const CDirScanStat& stat) {
+    char s[32];
+    Print("Scanned files: ");
+    ConvertUInt64ToString(stat.NumFiles, s);
+    Print(s);
+    Print("  directories: ");
+    ConvertUInt64ToString(stat.NumDirs, s);
+    Print(s);
+    Print("  bytes: ");
+    ConvertUInt64ToString(stat.NumBytes, s);
+    Print(s);
+    if (stat.NumHoleBytes != 0) {
+      const UInt32 ratio = stat.GetHoleRatio_Permille();
+      Print("  holes: ");
+      ConvertUInt64ToString(ratio / 10, s);
+      Print(s);
+      Print(".");
+      ConvertUInt64ToString(ratio % 10, s);
+      Print(s);
+      Print("%");
     }
-    return true;
+    Print("  time: ");
+    ConvertUInt64ToString(stat.Time_ms, s);
+    Print(s);
+    Print(" ms  (");
+    ConvertUInt64ToString(stat.GetItemsPerSec(), s);
+    Print(s);
+    Print(" items/s)");
+    PrintNewLine();
   }
 
   static FString CmdStringToFString(const char* s) {
@@ -2,24 +2,27 @@
 #include <vector>
 #include <string>
 #include "cpp/Common/MyWindows.h"
+#include "cpp/Common/MyBuffer.h"
 #include "cpp/Common/MyInitGuid.h"
 #include "cpp/Common/Defs.h"
 #include "cpp/Common/StringConvert.h"
-#include "cpp/Common/IntToString.h"
 #include "cpp/Windows/DLL.h"
 #include "cpp/Windows/FileDir.h"
 #include "cpp/Windows/FileFind.h"
 #include "cpp/Windows/PropVariant.h"
 #include "cpp/Windows/PropVariantConv.h"
 #include "cpp/Windows/TimeUtils.h"
+#include "cpp/7zip/Common/ArcLibrary.h"
+#include "cpp/7zip/Common/DirScanner.h"
 #include "cpp/7zip/Common/FileStreams.h"
+#include "cpp/7zip/Common/MultiVolOutStream.h"
+#include "cpp/7zip/Common/ProgressReporter.h"
 #include "cpp/7zip/Common/LimitedStreams.h"
 #include "cpp/7zip/Archive/IArchive.h"
 #include "cpp/7zip/IPassword.h"
 
 #include <Shlwapi.h>
 #include <iostream>
-#include <fstream>
 #pragma comment(lib, "Shlwapi.lib")
 
 #ifdef _WIN32
@@ -46,6 +49,12 @@ using namespace NWindows::NCOM;
 #define kDllName "7z.so"
 #endif
 
+// the number of threads that stat() the input paths
+static const unsigned kNumScanThreads = 8;
+
+// the progress line is rendered not more than that number of times per second
+static const unsigned kProgressUpdatesPerSec = 4;
+
 struct CDirItem: public NWindows::NFile::NFind::CFileInfoBase {
   UString path_for_handler;
   FString full_path;
@@ -63,41 +72,28 @@ class CArchiveUpdateCallback Z7_final:
   Z7_IFACE_COM7_IMP(IArchiveUpdateCallback)
 
 public:
-  // 分卷压缩相关成员
-  CRecordVector<UInt64> VolumesSizes;
-  UString VolName;
-  UString VolExt;
-  
   const CObjectVector<CDirItem> *dir_items_;
   bool password_is_defined_;
   UString password_;
+  // SetTotal() / SetCompleted() only store the values: the reporter thread prints them
+  CProgressReporter *progress_;
   
-  CArchiveUpdateCallback(): dir_items_(NULL), password_is_defined_(false) {}
+  CArchiveUpdateCallback(): dir_items_(NULL), password_is_defined_(false), progress_(NULL) {}
   
   void Init(const CObjectVector<CDirItem> *dir_items, const UString &password) {
     dir_items_ = dir_items;
     password_ = password;
     password_is_defined_ = !password.IsEmpty();
   }
-  
-  // 设置分卷参数
-  void SetVolumeInfo(const UString &vol_name, const UString &vol_ext, UInt64 volume_size) {
-    VolName = vol_name;
-    VolExt = vol_ext;
-    VolumesSizes.Clear();
-    if (volume_size > 0) {
-      VolumesSizes.Add(volume_size);
-    }
-  }
 };
 
 Z7_COM7F_IMF(CArchiveUpdateCallback::SetTotal(UInt64 size)) {
-  std::cout << "Total size: " << size << std::endl;
+  if (progress_) progress_->SetTotal(size);
   return S_OK;
 }
 
 Z7_COM7F_IMF(CArchiveUpdateCallback::SetCompleted(const UInt64 *completeValue)) {
-  std::cout << "Completed: " << *completeValue << std::endl;
+  if (progress_ && completeValue) progress_->SetCompleted(*completeValue);
   return S_OK;
 }
 
@@ -144,40 +140,13 @@ Z7_COM7F_IMF(CArchiveUpdateCallback::SetOperationResult(Int32 operationResult))
   return S_OK;
 }
 
-// 分卷大小获取方法
-Z7_COM7F_IMF(CArchiveUpdateCallback::GetVolumeSize(UInt32 index, UInt64 *size)) {
-  if (VolumesSizes.IsEmpty())
-    return S_FALSE;
-  if (index >= (UInt32)VolumesSizes.Size())
-    *size = VolumesSizes.Back();
-  else
-    *size = VolumesSizes[index];
-  return S_OK;
+// the volumes are written by CMultiVolOutStream: the handler doesn't request them from callback
+Z7_COM7F_IMF(CArchiveUpdateCallback::GetVolumeSize(UInt32 /* index */, UInt64 * /* size */)) {
+  return E_NOTIMPL;
 }
 
-// 分卷流创建方法
-Z7_COM7F_IMF(CArchiveUpdateCallback::GetVolumeStream(UInt32 index, ISequentialOutStream **volumeStream)) {
-  wchar_t temp[16];
-  ConvertUInt32ToString(index + 1, temp);
-  UString res = temp;
-  while (res.Len() < 3)  // 使用3位数字，支持更多分卷
-    res.InsertAtFront(L'0');
-  UString fileName = VolName;
-  fileName.Add_Dot();
-  fileName += res;
-  if (!VolExt.IsEmpty()) {
-    fileName.Add_Dot();
-    fileName += VolExt;
-  }
-  
-  COutFileStream *streamSpec = new COutFileStream;
-  CMyComPtr<ISequentialOutStream> streamLoc(streamSpec);
-  if (!streamSpec->Create_NEW(us2fs(fileName)))
-    return GetLastError_noZero_HRESULT();
-  *volumeStream = streamLoc.Detach();
-  
-  std::wcout << L"Creating volume: " << fileName << std::endl;
-  return S_OK;
+Z7_COM7F_IMF(CArchiveUpdateCallback::GetVolumeStream(UInt32 /* index */, ISequentialOutStream ** /* volumeStream */)) {
+  return E_NOTIMPL;
 }
 
 Z7_COM7F_IMF(CArchiveUpdateCallback::CryptoGetTextPassword2(Int32 *password_is_defined, BSTR *password)) {
@@ -213,13 +182,6 @@ public:
                                          const std::wstring& sfx_path,
                                          const std::wstring& password = L"",
                                          const std::wstring& sfx_module_path = L"") {
-    // 生成临时7z文件
-    std::wstring temp_7z_path = sfx_path + L".temp.7z";
-    
-    if (!CreateArchive(file_paths, temp_7z_path, password, true, 0)) {
-      return false;
-    }
-    
     // 确定SFX模块路径
     std::wstring sfx_module = sfx_module_path;
     if (sfx_module.empty()) {
@@ -235,12 +197,12 @@ public:
     }
     
     // 创建自解压文件：SFX模块 + 7z数据
-    bool success = CombineSfxAndArchive(sfx_module, temp_7z_path, sfx_path);
-    
-    // 清理临时文件
-    ::DeleteFile(temp_7z_path.c_str());
-    
-    return success;
+    // the archive is written directly after SFX module without temp archive
+    if (!CreateArchive(file_paths, sfx_path, password, true, 0, sfx_module)) {
+      return false;
+    }
+    std::wcout << L"Self-extracting archive created: " << sfx_path << std::endl;
+    return true;
   }
 
 private:
@@ -249,53 +211,60 @@ private:
                            const std::wstring& archive_path,
                            const std::wstring& password,
                            bool for_sfx,
-                           UInt64 volume_size = 0) {
-    // Load 7z library
+                           UInt64 volume_size = 0,
+                           const std::wstring& sfx_module_path = L"") {
+    // Load 7z library: it's loaded once per process, next calls use cached library
     FString dll_prefix = NDLL::GetModuleDirPrefix();
-    NDLL::CLibrary lib;
-    if (!lib.Load(dll_prefix + FTEXT(kDllName))) return false;
-    
-    Func_CreateObject f_create_object = Z7_GET_PROC_ADDRESS(
-        Func_CreateObject, lib.Get_HMODULE(), "CreateObject");
-    if (!f_create_object) return false;
+    const CArcLibrary *arc_lib;
+    if (GetArcLibrary(dll_prefix + FTEXT(kDllName), arc_lib) != S_OK) return false;
+    Func_CreateObject f_create_object = arc_lib->CreateObjectFunc;
     
-    // Collect files
-    CObjectVector<CDirItem> dir_items;
+    // Collect files: the paths are stat()-ed in parallel threads
+    FStringVector fs_paths;
     for (const auto& file_path : file_paths) {
-      FString fs_path = us2fs(UString(file_path.c_str()));
-      NFind::CFileInfo file_info;
-      if (!file_info.Find(fs_path)) return false;
-      
-      CDirItem dir_item(file_info);
-      dir_item.path_for_handler = fs2us(fs_path.Ptr(fs_path.ReverseFind_PathSepar() + 1));
-      dir_item.full_path = fs_path;
-      dir_items.Add(dir_item);
+      fs_paths.Add(us2fs(UString(file_path.c_str())));
+    }
+    CDirScanner scanner;
+    CDirScanOptions scan_options;
+    scan_options.NumThreads = kNumScanThreads;
+    scan_options.Recursive = false;  // directory is added as one item
+    if (scanner.Scan(fs_paths, scan_options) != S_OK) return false;
+    if (scanner.Errors.Size() != 0) {
+      std::wcerr << L"Cannot find file: " << fs2us(scanner.Errors[0].Path).Ptr() << std::endl;
+      return false;
     }
+
+    // the order of items is the order of (file_paths)
+    CObjectVector<CDirItem> dir_items;
+    dir_items.ClearAndReserve(scanner.Items.Size());
+    for (unsigned i = 0; i < scanner.Items.Size(); i++) {
+      const CDirScanItem &scan_item = scanner.Items[i];
+      CDirItem dir_item(scan_item.Info);
+      dir_item.path_for_handler = scan_item.RelPath;
+      dir_item.full_path = scan_item.FullPath;
+      dir_items.AddInReserved(dir_item);
+    }
+    std::wcout << L"Scanned " << scanner.Stat.NumFiles << L" files, "
+               << scanner.Stat.NumDirs << L" directories in "
+               << scanner.Stat.Time_ms << L" ms ("
+               << scanner.Stat.GetItemsPerSec() << L" items/s)" << std::endl;
     
     if (dir_items.Size() == 0) return false;
     
     // Create output file or volume stream
     CMyComPtr<IOutStream> out_file_stream;
+    CMultiVolOutStream *vol_stream_spec = NULL;
     
     if (volume_size > 0) {
-      // 分卷压缩：创建第一个分卷文件
+      // 分卷压缩：7z handler writes one stream, and the stream splits it to
+      // (archive_path).001, .002, ... Each volume is preallocated,
+      // and filled volumes are fsync()-ed and closed in background thread.
       FString archive_name = us2fs(UString(archive_path.c_str()));
-      COutFileStream *out_file_stream_spec = new COutFileStream;
-      
-      // 创建一个有限制大小的输出流
-      CLimitedSequentialOutStream *limited_out_stream_spec = new CLimitedSequentialOutStream;
-      CMyComPtr<ISequentialOutStream> limited_out_stream(limited_out_stream_spec);
-      
-      // 打开第一个分卷文件
-      if (!out_file_stream_spec->Create_NEW(archive_name)) return false;
-      
-      // 设置有限制大小的输出流
-      limited_out_stream_spec->SetStream(out_file_stream_spec);
-      limited_out_stream_spec->Init(volume_size);
-      
-      // 将有限制大小的输出流转换为IOutStream接口
-      // 注意：这里需要一个支持Seek操作的流，所以我们仍然需要使用原始的out_file_stream
-      out_file_stream = out_file_stream_spec;
+      vol_stream_spec = new CMultiVolOutStream;
+      out_file_stream = vol_stream_spec;
+      CRecordVector<UInt64> volume_sizes;
+      volume_sizes.Add(volume_size);
+      if (vol_stream_spec->Init(archive_name, volume_sizes) != S_OK) return false;
       
       std::wcout << L"Creating multi-volume archive with volume size: "
                  << (volume_size / 1024 / 1024) << L" MB" << std::endl;
@@ -305,6 +274,21 @@ private:
       COutFileStream *out_file_stream_spec = new COutFileStream;
       out_file_stream = out_file_stream_spec;
       if (!out_file_stream_spec->Create_NEW(archive_name)) return false;
+      if (!sfx_module_path.empty()) {
+        // SFX module is written first, and the handler writes the archive after it
+        UInt64 sfx_size = 0;
+        if (!WriteSfxModule(us2fs(UString(sfx_module_path.c_str())), *out_file_stream_spec, sfx_size)) {
+          out_file_stream.Release();
+          ::DeleteFile(archive_path.c_str());
+          return false;
+        }
+        CTailOutStream *tail_stream_spec = new CTailOutStream;
+        CMyComPtr<IOutStream> tail_stream(tail_stream_spec);
+        tail_stream_spec->Stream = out_file_stream;
+        tail_stream_spec->Offset = sfx_size;
+        tail_stream_spec->Init();
+        out_file_stream = tail_stream;
+      }
     }
     
     // Create archive object
@@ -335,28 +319,29 @@ private:
     CMyComPtr<IArchiveUpdateCallback2> update_callback(update_callback_spec);
     update_callback_spec->Init(&dir_items, UString(password.c_str()));
     
-    // 设置分卷信息
-    if (volume_size > 0) {
-      // 从archive_path提取基础名称和扩展名
-      UString base_path = UString(archive_path.c_str());
-      int dot_pos = base_path.ReverseFind_Dot();
-      UString vol_name, vol_ext;
-      
-      if (dot_pos >= 0) {
-        vol_name = base_path.Left(dot_pos);
-        vol_ext = base_path.Ptr(dot_pos + 1);
-      } else {
-        vol_name = base_path;
-        vol_ext = L"7z";
-      }
-      
-      update_callback_spec->SetVolumeInfo(vol_name, vol_ext, volume_size);
-    }
-    
+    // the written size of archive is used for compression ratio in progress
+    CProgressReporter progress;
+    progress.MaxUpdatesPerSec = kProgressUpdatesPerSec;
+    progress.Operation = "update";
+    update_callback_spec->progress_ = &progress;
+    CProgressOutStream *progress_stream_spec = new CProgressOutStream;
+    CMyComPtr<IOutStream> progress_stream(progress_stream_spec);
+    progress_stream_spec->Init(out_file_stream, &progress);
+    if (!progress.Start()) return false;
+
     // Perform compression
-    HRESULT result = out_archive->UpdateItems(out_file_stream, 
+    HRESULT result = out_archive->UpdateItems(progress_stream, 
                                              dir_items.Size(), 
                                              update_callback);
+    progress.Stop();
+    if (vol_stream_spec) {
+      // it waits for background flushes of volumes
+      const unsigned num_volumes = vol_stream_spec->GetNumVolumes();
+      const HRESULT close_result = vol_stream_spec->Close();
+      if (result == S_OK) result = close_result;
+      if (result == S_OK)
+        std::wcout << L"Volumes: " << num_volumes << std::endl;
+    }
     
     if (result == S_OK) {
       if (volume_size > 0) {
@@ -369,29 +354,22 @@ private:
     return result == S_OK;
   }
   
-  // 合并SFX模块和7z数据创建自解压文件
-  static bool CombineSfxAndArchive(const std::wstring& sfx_module_path,
-                                  const std::wstring& archive_path,
-                                  const std::wstring& output_path) {
-    std::ifstream sfx_file(sfx_module_path, std::ios::binary);
-    std::ifstream archive_file(archive_path, std::ios::binary);
-    std::ofstream output_file(output_path, std::ios::binary);
-    
-    if (!sfx_file.is_open() || !archive_file.is_open() || !output_file.is_open()) {
-      return false;
+  // 复制SFX模块: it's small, so simple buffered copy is enough
+  static bool WriteSfxModule(const FString& sfx_module_path,
+                             COutFileStream& out_stream,
+                             UInt64& sfx_size) {
+    sfx_size = 0;
+    NIO::CInFile sfx_file;
+    if (!sfx_file.Open(sfx_module_path)) return false;
+    const size_t kBufSize = (size_t)1 << 20;
+    CByteBuffer buf(kBufSize);
+    for (;;) {
+      size_t processed;
+      if (!sfx_file.ReadFull(buf, kBufSize, processed)) return false;
+      if (processed == 0) break;
+      if (!out_stream.File.WriteFull(buf, processed)) return false;
+      sfx_size += processed;
     }
-    
-    // 复制SFX模块
-    output_file << sfx_file.rdbuf();
-    
-    // 复制7z数据
-    output_file << archive_file.rdbuf();
-    
-    sfx_file.close();
-    archive_file.close();
-    output_file.close();
-    
-    std::wcout << L"Self-extracting archive created: " << output_path << std::endl;
     return true;
   }
 };